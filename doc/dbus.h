@@ -24,7 +24,13 @@
  * the caller does not care or is not intending to provision any SIM specific
  * settings he can simply pass an empty string.  Provman will
  * then associate any SIM specific settings with the SIM card of the first
- * modem it discovers in the device.
+ * modem it discovers in the device.  If the caller passes "*", the SIM
+ * specific settings of all the modems are managed in the same session, the
+ * settings of each SIM card being stored under /telephony/\<IMSI\>/.
+ *
+ * If provman was started with the --concurrent option, #Start returns
+ * straight away if the sessions in progress manage the same IMSI and no
+ * other client is waiting for them to end.
  *
  * \exception com.intel.provman.Error.Unexpected A call to #Start is
  *   outstanding or has completed and a device management session is already
@@ -131,6 +137,79 @@ string Get(string key);
 
 dictionary GetAll(string key);
 
+/*!
+ * \brief Retrieves the key/value pairs associated with a given key one
+ * page at a time.
+ *
+ * GetAllPaged returns the same settings as #GetAll, but spread over as
+ * many calls as are needed to retrieve them page_size settings at a
+ * time, so that neither provman nor the client needs to hold all of
+ * them in a single message.  Settings are returned in key order, which
+ * compares keys segment by segment, so a key is always returned before
+ * the keys located under it.
+ *
+ * The first page is retrieved by passing an empty cursor.  Each call
+ * returns a cursor that should be passed to the next call to retrieve
+ * the following page.  An empty cursor is returned with the last page.
+ * Cursors are opaque strings that remain valid for the rest of the
+ * session, even if settings are added or deleted between two calls.
+ * Settings added before the cursor's position are not returned by
+ * subsequent calls, and settings deleted after it are not returned.
+ *
+ * @param key the key whose value(s) you wish to retrieve
+ * @param page_size the maximum number of settings to return, of type
+ *   \a u.
+ * @param cursor the cursor returned by the previous call, or an empty
+ *   string to retrieve the first page
+ * @return a dictionary of key value settings of type \a a{ss}, and the
+ *   cursor of the next page, of type \a s.
+ *
+ * \exception com.intel.provman.Error.Unexpected #GetAllPaged is invoked
+ * before #Start.
+ * \exception com.intel.provman.Error.Cancelled The call to #GetAllPaged
+ *   has failed because provman has been killed.
+ * \exception com.intel.provman.Error.BadArgs page_size is 0.
+*/
+
+dictionary, string GetAllPaged(string key, uint32 page_size, string cursor);
+
+/*!
+ * \brief Retrieves the settings associated with a given key that have
+ * changed since a given generation.
+ *
+ * Each modification of the settings, whether made by a device
+ * management client or detected when provman reads the settings from
+ * the middleware at the start of a session, is assigned a new
+ * generation number.  Generations only ever increase, including across
+ * restarts of provman.  A client that maintains a copy of the settings
+ * can keep it up to date by passing the generation returned by its
+ * previous call to GetChangesSince.  The cost of the call depends on
+ * the number of settings that have changed, rather than on the total
+ * number of settings.  To obtain the current generation without
+ * retrieving any changes, pass the largest possible generation,
+ * 0xffffffffffffffff.
+ *
+ * @param key the key whose value(s) you wish to retrieve
+ * @param generation the generation after which changes are reported, of
+ *   type \a t.
+ * @return a dictionary of type \a a{ss} containing the settings that
+ *   have been created or modified and their current values, an array of
+ *   type \a as containing the keys of the settings that have been
+ *   deleted, and the current generation, of type \a t.
+ *
+ * \exception com.intel.provman.Error.Unexpected #GetChangesSince is
+ * invoked before #Start.
+ * \exception com.intel.provman.Error.Cancelled The call to
+ *   #GetChangesSince has failed because provman has been killed.
+ * \exception com.intel.provman.Error.Expired provman does not know
+ *   which settings have changed since the generation, typically because
+ *   it was restarted in the meantime, or the generation is greater than
+ *   any that provman has returned.  The client needs to retrieve all
+ *   the settings again, using #GetAll.
+*/
+
+dictionary, array, uint64 GetChangesSince(string key, uint64 generation);
+
 
 /*!
  * \brief Deletes a key or directory.
@@ -151,6 +230,187 @@ dictionary GetAll(string key);
 
 void Delete(string key);
 
+/*!
+ * \brief Retrieves the committed value of a key.
+ *
+ * The committed settings are those that provman last read from or wrote
+ * to the middleware.  They do not include any changes made during the
+ * current session.  Unlike #Get, GetCommitted does not need to be called
+ * within a management session and returns immediately, even if provman
+ * is busy reading or writing settings on behalf of another client.
+ *
+ * Each time the committed settings change, provman increments a
+ * generation number, which is returned with the value.  A client can
+ * compare the generation numbers returned by two calls to find out
+ * whether the committed settings changed between them.
+ *
+ * @param key the key whose value you wish to retrieve
+ * @return the committed value of the key, of type \a s, and the
+ * generation of the committed settings, of type \a t.
+ *
+ * \exception com.intel.provman.Error.NotFound The specified key
+ *   does not exist or the settings of its plugin have not been read.
+*/
+
+string, uint64 GetCommitted(string key);
+
+/*!
+ * \brief Retrieves the committed key/value pairs associated with a
+ * given key.
+ *
+ * This is the #GetAll equivalent of #GetCommitted.  Keys belonging to
+ * plugins whose settings have not been read are omitted.
+ *
+ * @param key the key whose value(s) you wish to retrieve
+ * @return a dictionary of key value settings of type \a a{ss}, and the
+ * generation of the committed settings, of type \a t.
+*/
+
+dictionary, uint64 GetAllCommitted(string key);
+
+/*!
+ * \brief Subscribes to notifications of changes to the settings located
+ * under a given key.
+ *
+ * Once a client has called Watch, provman sends it a #SettingsChanged
+ * signal each time a sync with the middleware changes settings that
+ * match one of its prefixes.  A prefix matches keys in the same way as
+ * the key passed to #GetAll.  Watch does not belong to a device
+ * management session and can be called at any time.  A client's
+ * subscriptions are removed when it disconnects from the bus.
+ * provman does not exit while it has subscribers.
+ *
+ * @param prefix the key whose settings you wish to watch
+*/
+
+void Watch(string prefix);
+
+/*!
+ * \brief Cancels a subscription created by #Watch.
+ *
+ * @param prefix a prefix previously passed to #Watch
+ *
+ * \exception com.intel.provman.Error.NotFound The client is not
+ *   watching prefix.
+*/
+
+void Unwatch(string prefix);
+
+/*!
+ * \brief Signal sent to the clients that have called #Watch when
+ * settings change.
+ *
+ * The changes made to the settings when a session ends, or detected
+ * when provman reads the settings from the middleware at the start of a
+ * session, are sent in a single signal.  The signal is addressed to each
+ * subscriber separately and only contains the settings that match its
+ * prefixes.  No signal is sent to clients none of whose settings have
+ * changed.
+ *
+ * @param set a dictionary of type \a a{ss} containing the settings that
+ *   have been created or modified and their new values.
+ * @param removed an array of type \a as containing the keys of the
+ *   settings that have been deleted.
+*/
+
+signal SettingsChanged(dictionary set, array removed);
+
+/*!
+ * \brief Executes a sequence of operations in a single command
+ *
+ * Execute allows a client to combine any number of set, get and delete
+ * operations into a single command, reducing the IPC overhead of a
+ * session.  The operations are executed in order, so each operation
+ * sees the effects of the operations that precede it.  The failure of an
+ * individual operation does not prevent the remaining operations from
+ * being executed.
+ *
+ * Each operation is a structure of three strings, the name of the
+ * operation, a key and a value.  The following operations are supported.
+ *
+ * \li \a set assigns the value to the key, as #Set does.
+ * \li \a get retrieves the value of the key, as #Get does.
+ * \li \a getall retrieves all the settings under the key, as #GetAll does.
+ * \li \a delete deletes the key or directory, as #Delete does.
+ *
+ * The value is ignored by all operations other than \a set.
+ *
+ * @param operations an array of operations of type \a a(sss)
+ * @return an array of results of type \a a(sa{ss}), containing one
+ * result for each operation, in the same order as the operations.  Each
+ * result contains the name of the D-Bus error that caused the operation
+ * to fail, or an empty string if it succeeded, and a dictionary
+ * containing the settings retrieved by \a get and \a getall operations.
+ * The dictionary is empty for the other operations.
+ *
+ * \exception com.intel.provman.Error.Unexpected #Execute is invoked
+ * before #Start.
+ * \exception com.intel.provman.Error.Cancelled The call to #Execute
+ *   has failed because provman has been killed.
+*/
+
+array Execute(array operations);
+
+/*!
+ * \brief Imports a large number of settings from a file descriptor
+ *
+ * Import is intended for clients that need to provision many thousands
+ * of settings at once.  Rather than being marshalled in a D-Bus message,
+ * the settings are read from a file descriptor, typically one end of a
+ * pipe or an open file, passed by the client.  Each setting is encoded
+ * as a key followed by a value.  Each string is encoded as a 32 bit big
+ * endian length, the bytes of the string and a terminating NUL character
+ * which is not counted in the length.  Provman reads settings until it
+ * reaches the end of the file.  As with #SetAll, the failure to import an
+ * individual setting does not prevent the remaining settings from being
+ * imported.
+ *
+ * @param fd the file descriptor from which the settings are read, of
+ * type \a h.
+ * @return the number of settings imported, of type \a u, and an array
+ * containing the keys of the settings that could not be imported, of
+ * type \a as.  At most 1024 keys are returned.
+ *
+ * \exception com.intel.provman.Error.BadArgs No file descriptor was
+ *   passed with the message.
+ * \exception com.intel.provman.Error.Unknown The stream is malformed or
+ *   could not be read.
+ *   The settings decoded before the error was detected remain set.
+ * \exception com.intel.provman.Error.Unexpected #Import is invoked
+ * before #Start.
+ * \exception com.intel.provman.Error.Cancelled The call to #Import
+ *   has failed because provman has been killed.
+*/
+
+uint32, array Import(fd);
+
+/*!
+ * \brief Exports the settings associated with a key to a file descriptor
+ *
+ * This is the counterpart of #Import.  The settings under the key are
+ * written to the file descriptor using the format described in #Import.
+ * Provman closes its copy of the descriptor once the last setting has
+ * been written and then returns.  The settings are written as the client
+ * reads them, and provman continues to process other requests in the
+ * meantime.
+ *
+ * @param key the key whose value(s) you wish to export
+ * @param fd the file descriptor to which the settings are written, of
+ * type \a h.
+ * @return the number of settings exported, of type \a u.
+ *
+ * \exception com.intel.provman.Error.BadArgs No file descriptor was
+ *   passed with the message.
+ * \exception com.intel.provman.Error.NotFound The specified key
+ *   does not exist.
+ * \exception com.intel.provman.Error.Unexpected #Export is invoked
+ * before #Start.
+ * \exception com.intel.provman.Error.Cancelled The call to #Export
+ *   has failed because provman has been killed.
+*/
+
+uint32 Export(string key, fd);
+
 /*!
  * \brief Ends the device management session begun by #Start
  *
@@ -160,6 +420,17 @@ void Delete(string key);
  * #Start, the #Start method will complete for one of these clients and
  * its device management session will begin.
  *
+ * In concurrent mode the changes made during the session are first
+ * merged with the settings shared by all the sessions.  They are pushed
+ * to the plugins once every session has ended.  If any of the settings
+ * modified during the session have been modified by another session
+ * that has ended since this session started, none of the changes are
+ * merged and #End fails with com.intel.provman.Error.Conflict.  The
+ * session is over in either case.  The client can retry by calling
+ * #Start again and reapplying its changes.
+ *
+ * \exception com.intel.provman.Error.Conflict The session's changes
+ *   conflict with those of another session and have been discarded.
  * \exception com.intel.provman.Error.Unexpected #End is invoked
  * before #Start.
  * \exception com.intel.provman.Error.Cancelled The call to #End
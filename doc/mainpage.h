@@ -103,7 +103,38 @@
  * instances.  Each provman instance supports a different set of plugins.
  *
  * The provman instances are launched by D-Bus.  They run until all of their
- * tasks have been completed and then exit.  
+ * tasks have been completed and then exit.  If an instance is started with
+ * the --resident option it keeps running between management sessions, so
+ * that its plugins do not need to reload their settings at the start of
+ * each session.  Plugins that can compute a validation token are checked
+ * at the start of each session and reload their settings only if the
+ * token has changed.  A resident instance releases any unused memory once it
+ * has been idle for the number of seconds given by the --trim-delay option,
+ * 60 by default.
+ *
+ * By default provman asks all of its plugins to load their settings when
+ * a session is started.  When started with the --lazy option it only
+ * loads the settings of a plugin when a client first accesses a key
+ * owned by that plugin.  Requests are queued until these settings have
+ * been loaded.  At the end of the session only these plugins write their
+ * settings back, so sessions that manage a single subsystem, e.g.,
+ * /telephony/, complete more quickly.
+ *
+ * Only one client can hold a session at a time by default.  When started
+ * with the --concurrent option, provman lets several clients that manage
+ * the same IMSI hold sessions at the same time.  Each of these clients
+ * sees the settings as they were when its session started, together with
+ * its own modifications.  Its modifications are merged with the settings
+ * when it calls #End, unless another client has modified the same
+ * settings in the meantime.  The settings are written back once the last
+ * of the sessions has ended.  The --lazy option is ignored in this mode.
+ *
+ * Provman executes the requests of a session one at a time on its main
+ * thread.  The decoding of large requests and the construction of large
+ * replies are however performed by a small pool of dispatch threads, so
+ * that these requests do not hold up other clients.  The size of the
+ * pool is set by the --dispatch-threads option, 2 by default.  If it is
+ * set to 0, all work is performed on the main thread.
  *
  * @section api-overview API Overview
  * 
@@ -153,8 +184,18 @@
  * <tr><td>#SetAll</td><td>\copybrief SetAll</td></tr>
  * <tr><td>#Get</td><td>\copybrief Get</td></tr>
  * <tr><td>#GetAll</td><td>\copybrief GetAll</td></tr>
+ * <tr><td>#GetAllPaged</td><td>\copybrief GetAllPaged</td></tr>
+ * <tr><td>#GetChangesSince</td><td>\copybrief GetChangesSince</td></tr>
  * <tr><td>#Delete</td><td>\copybrief Delete</td></tr>
+ * <tr><td>#Execute</td><td>\copybrief Execute</td></tr>
+ * <tr><td>#Import</td><td>\copybrief Import</td></tr>
+ * <tr><td>#Export</td><td>\copybrief Export</td></tr>
  * <tr><td>#End</td><td>\copybrief End</td></tr>
+ * <tr><td>#GetCommitted</td><td>\copybrief GetCommitted</td></tr>
+ * <tr><td>#GetAllCommitted</td><td>\copybrief GetAllCommitted</td></tr>
+ * <tr><td>#Watch</td><td>\copybrief Watch</td></tr>
+ * <tr><td>#Unwatch</td><td>\copybrief Unwatch</td></tr>
+ * <tr><td>#SettingsChanged</td><td>\copybrief SettingsChanged</td></tr>
  * </table>
  *
  * A simple python script demonstrating how these methods can be used is shown below.
@@ -406,6 +447,12 @@ manager.End()
  * </td></tr>
  * </table>
  *
+ * A client can manage the telephony settings of all the SIM cards of the
+ * device in a single session by passing "*" to #Start.  The settings of each
+ * SIM card are then stored under /telephony/\<IMSI\>/, e.g., the APN of a
+ * 3G context is stored in /telephony/\<IMSI\>/contexts/\<X\>/apn.  The
+ * modems are read and updated concurrently.
+ *
  * @subsection sync Data Synchronisation Settings
  * Synchronisation accounts, e.g., SyncML accounts, can be provisioned via provman.
  *
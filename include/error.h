@@ -44,6 +44,8 @@
 	".Error.TransactionInProgress"
 #define PROVMAN_DBUS_ERR_NO_TRANSACTION PROVMAN_SERVICE\
 	".Error.NotInTransaction"
+#define PROVMAN_DBUS_ERR_EXPIRED PROVMAN_SERVICE".Error.Expired"
+#define PROVMAN_DBUS_ERR_CONFLICT PROVMAN_SERVICE".Error.Conflict"
 
 enum provman_errors
 {
@@ -65,7 +67,9 @@ enum provman_errors
 	PROVMAN_ERR_BAD_ARGS,
 	PROVMAN_ERR_TIMEOUT,
 	PROVMAN_ERR_BAD_KEY,
-	PROVMAN_ERR_SUBSYSTEM
+	PROVMAN_ERR_SUBSYSTEM,
+	PROVMAN_ERR_EXPIRED,
+	PROVMAN_ERR_CONFLICT
 };
 
 const gchar* provman_err_to_dbus(int error);
@@ -35,6 +35,8 @@
 #include <stdbool.h> 
 #include <glib.h>
 
+#include "settings_tree.h"
+
 /*!
  * @brief Handle to a provman plugin instance.
  */
@@ -47,17 +49,21 @@ typedef void *provman_plugin_instance;
  * 
  * @param result an error code indicating whether the call to 
  * #provman_plugin_sync_in could be successfully completed.
- * @param settings A GHashTable containing all the settings obtained
+ * @param settings A settings tree containing all the settings obtained
  *        by the plugin from the middleware during the call to
- *        #provman_plugin_sync_in.  If result indicates an
+ *        #provman_plugin_sync_in.  Ownership of the tree passes to
+ *        provman.  Plugins that keep their own copy of the settings
+ *        should pass a snapshot of it, created with
+ *        #provman_settings_tree_snapshot.  If result indicates an
  *        error this parameter should be NULL.
  * @param user_data This parameter should contain the data that 
  *        provman passed to the #provman_plugin_sync_in
  *        in the user_data parameter.
  *
  */
-typedef void (*provman_plugin_sync_in_cb)(int result, GHashTable* settings,
-					       void *user_data);
+typedef void (*provman_plugin_sync_in_cb)(int result,
+					  provman_settings_tree_t *settings,
+					  void *user_data);
 /*! 
  * @brief Typedef for the callback function that plugins invoke when they
  *        want to complete a call to #provman_plugin_sync_out.
@@ -125,7 +131,9 @@ typedef void (*provman_plugin_delete)(provman_plugin_instance instance);
  *        modem.  If this paramater is set to "" and the plugin supports SIM
  *        specific settings it must associate all settings in
  *        the management session with the SIM card of the first modem
- *        discovered in the device.
+ *        discovered in the device.  A value of "*" requests the settings
+ *        of all the SIM cards.  Plugins that support it store the settings
+ *        of each SIM card in a separate subtree named after its IMSI.
  * @param callback A function pointer that must be invoked by the plugin when
  *        it has completed the #provman_plugin_sync_in task.  If the plugin
  *        returns PROVMAN_ERR_NONE for the call to #provman_plugin_sync_in it
@@ -276,6 +284,48 @@ typedef int (*provman_plugin_validate_set)(provman_plugin_instance instance,
 typedef int (*provman_plugin_validate_del)(provman_plugin_instance instance,
 						const char* key, bool *leaf);
 
+/*! 
+ * @brief Typedef for a function pointer that is called when provman
+ *        wishes to know whether the settings it obtained from the plugin
+ *        in an earlier session are still valid.
+ *
+ * Provman stores the settings returned by the plugin's
+ * #provman_plugin_sync_in function in a snapshot file together with the
+ * token returned by this function just before #provman_plugin_sync_in was
+ * called.  When provman is restarted it calls this function again and, if
+ * the token it returns matches the one stored in the snapshot, it uses the
+ * contents of the snapshot rather than calling #provman_plugin_sync_in.
+ * In this case #provman_plugin_sync_in is only called if the client
+ * modifies the plugin's settings, just before #provman_plugin_sync_out.
+ *
+ * Provman also calls this function at the start of every management
+ * session.  If the token no longer matches the one that was current when
+ * the plugin instance last read its settings, provman deletes the plugin
+ * instance and creates a new one, so that the settings are read again
+ * from the middleware.  This matters when provman is resident, as a
+ * plugin instance then outlives many sessions.
+ *
+ * The token must change whenever the settings managed by the plugin
+ * change and it must be cheaper to compute than the settings themselves,
+ * for example, a checksum of the middleware's configuration.
+ *
+ * This function is optional.  Plugins that cannot compute such a token
+ * should set the get_token_fn member of their #provman_plugin_ structure
+ * to NULL, in which case no snapshot is kept.  Such plugins must make sure
+ * themselves that the settings returned by #provman_plugin_sync_in are
+ * up to date, either by reading them again or by tracking changes to the
+ * middleware.
+ *
+ * @param instance A pointer to the plugin instance.
+ * @param imsi The imsi number that will be passed to #provman_plugin_sync_in.
+ *
+ * @return a newly allocated token that provman will free with g_free, or
+ *         NULL if no token can be computed.
+ */
+
+typedef gchar *(*provman_plugin_get_token)(provman_plugin_instance instance,
+					   const char *imsi);
+
 /*! \brief Typedef for struct provman_plugin_ */
 typedef struct provman_plugin_ provman_plugin;
 
@@ -314,6 +364,8 @@ struct provman_plugin_
 	provman_plugin_validate_set validate_set_fn;
         /*! \brief Pointer to the plugin's validate del function. */
 	provman_plugin_validate_del validate_del_fn;
+        /*! \brief Pointer to the plugin's get token function, or NULL. */
+	provman_plugin_get_token get_token_fn;
 };
 
 /*! \cond */
@@ -0,0 +1,294 @@
+/*
+ * Provman
+ *
+ * Copyright (C) 2011 Intel Corporation. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ *
+ *
+ * Mark Ryan <mark.d.ryan@intel.com>
+ *
+ */
+
+/*!
+ * @file settings_tree.h
+ *
+ * @brief contains definitions for the settings tree
+ *
+ * The settings tree is a compressed radix tree that stores a set of
+ * settings.  Edges are labelled with one or more '/' separated key
+ * segments rather than with individual characters, so a chain of
+ * directories that contain a single sub-directory occupies only one node.
+ * Point lookups cost O(depth) and the enumeration or removal of a
+ * directory costs O(size of the directory), regardless of the number of
+ * settings stored in the tree.
+ *
+ * The nodes of the tree are reference counted and are shared between
+ * a tree and its snapshots.  Taking a snapshot costs O(1).  A node is
+ * only copied when one of the trees that share it is modified, and then
+ * only the nodes that lie on the path to the modified setting are copied.
+ * Plugins use snapshots to pass their settings to provman at the end of
+ * #provman_plugin_sync_in without having to duplicate them.
+ *
+ *****************************************************************************/
+
+#ifndef PROVMAN_SETTINGS_TREE_H
+#define PROVMAN_SETTINGS_TREE_H
+
+#include <stdbool.h>
+
+#include <glib.h>
+
+/*! @brief Represents a settings tree.
+ *
+ * The details of this structure are private and are not exposed to the
+ * plugins.
+ */
+
+typedef struct provman_settings_tree_t_ provman_settings_tree_t;
+
+/*! @brief Typedef for the callback function invoked by
+ *         #provman_settings_tree_foreach.
+ *
+ * @param key the key of the setting.  The string is only valid for the
+ *        duration of the callback.
+ * @param value the value of the setting.  This is an interned string, see
+ *        #provman_utils_intern.
+ * @param user_data the user_data passed to #provman_settings_tree_foreach
+ */
+
+typedef void (*provman_settings_tree_cb_t)(const gchar *key,
+					   const gchar *value,
+					   void *user_data);
+
+/*! @brief Creates a new, empty, settings tree.
+ *
+ * @param tree a pointer to the new tree is returned via this parameter.
+ *        The tree should be deleted by calling
+ *        #provman_settings_tree_delete when it is no longer needed.
+ */
+
+void provman_settings_tree_new(provman_settings_tree_t **tree);
+
+/*! @brief Creates a snapshot of a settings tree.
+ *
+ * The snapshot initially contains the same settings as tree.  Subsequent
+ * modifications to either tree are not visible in the other.  The nodes of
+ * the tree are shared until they are modified, so this function does not
+ * copy any settings.
+ *
+ * @param tree the tree to snapshot.
+ * @return a new tree.  The caller assumes ownership of this tree and
+ *         should delete it by calling #provman_settings_tree_delete when
+ *         it is no longer needed.
+ */
+
+provman_settings_tree_t *provman_settings_tree_snapshot(
+	provman_settings_tree_t *tree);
+
+/*! @brief Deletes a settings tree.
+ *
+ * Nodes that are shared with snapshots of the tree are not freed until
+ * the snapshots are also deleted.
+ *
+ * @param tree the tree to delete.  Can be NULL.
+ */
+
+void provman_settings_tree_delete(provman_settings_tree_t *tree);
+
+/*! @brief Returns a new hash table containing all the settings stored in
+ *         a tree.
+ *
+ * @param tree the settings tree.
+ * @return a hash table created by #provman_utils_new_settings.  The caller
+ *         assumes ownership of this hash table and should delete it with
+ *         g_hash_table_unref when it is no longer needed.
+ */
+
+GHashTable *provman_settings_tree_to_hash(provman_settings_tree_t *tree);
+
+/*! @brief Returns the number of settings stored in a tree.
+ *
+ * @param tree the settings tree.
+ * @return the number of settings.
+ */
+
+unsigned int provman_settings_tree_size(provman_settings_tree_t *tree);
+
+/*! @brief Retrieves the value of a setting.
+ *
+ * @param tree the settings tree.
+ * @param key the key of the setting to retrieve.
+ * @return the value of the setting, or NULL if the setting does not exist.
+ *         The value is an interned string that remains owned by the tree.
+ */
+
+const gchar *provman_settings_tree_lookup(provman_settings_tree_t *tree,
+					  const gchar *key);
+
+/*! @brief Adds a setting to a tree, replacing any existing setting with the
+ *         same key.
+ *
+ * This function interns value, so it must only be called from the thread
+ * that runs the main loop.
+ *
+ * @param tree the settings tree.
+ * @param key the key of the setting.  The caller retains ownership of
+ *        this string.
+ * @param value the value of the setting.  The value is interned.  The
+ *        caller retains ownership of this string.
+ * @return true if the tree was modified, i.e., if key did not previously
+ *         exist or if it was associated with a different value.
+ */
+
+bool provman_settings_tree_insert(provman_settings_tree_t *tree,
+				  const gchar *key, const gchar *value);
+
+/*! @brief Removes a setting from a tree.
+ *
+ * @param tree the settings tree.
+ * @param key the key of the setting to remove.
+ * @return true if the setting existed and was removed.
+ */
+
+bool provman_settings_tree_remove(provman_settings_tree_t *tree,
+				  const gchar *key);
+
+/*! @brief Removes all the settings that are located under a directory.
+ *
+ * @param tree the settings tree.
+ * @param key the directory.  A trailing '/' is ignored.  The setting
+ *        called key, if any, is not removed.
+ * @return the number of settings removed.
+ */
+
+unsigned int provman_settings_tree_remove_dir(provman_settings_tree_t *tree,
+					      const gchar *key);
+
+/*! @brief Invokes a callback for each setting that matches a search key.
+ *
+ * The settings are visited in key order.  If search_key ends with a '/'
+ * all the settings located under the directory search_key are matched.
+ * Otherwise, the setting search_key itself and all the settings located
+ * under the directory search_key are matched.  The tree must not be
+ * modified by the callback.
+ *
+ * @param tree the settings tree.
+ * @param search_key the key to search for.
+ * @param cb the function to invoke for each matching setting.
+ * @param user_data passed to cb.
+ */
+
+void provman_settings_tree_foreach(provman_settings_tree_t *tree,
+				   const gchar *search_key,
+				   provman_settings_tree_cb_t cb,
+				   void *user_data);
+
+/*! @brief Invokes a callback for a page of the settings that match a
+ *         search key.
+ *
+ * This function visits the same settings, in the same order, as
+ * #provman_settings_tree_foreach but skips the settings whose keys do
+ * not follow after and stops once limit settings have been visited.  A
+ * large set of settings can therefore be retrieved in pages by passing
+ * the last key visited by one call as the after parameter of the next.
+ * after does not need to be stored in the tree, so the enumeration can
+ * be resumed even if that key has been removed in the meantime.
+ *
+ * @param tree the settings tree.
+ * @param search_key the key to search for.
+ * @param after only settings that follow this key, as determined by
+ *        #provman_settings_tree_key_cmp, are visited.  Can be NULL, in
+ *        which case the enumeration starts with the first matching
+ *        setting.
+ * @param limit the maximum number of settings to visit.
+ * @param cb the function to invoke for each matching setting.
+ * @param user_data passed to cb.
+ * @return the number of settings visited.
+ */
+
+unsigned int provman_settings_tree_foreach_after(
+	provman_settings_tree_t *tree, const gchar *search_key,
+	const gchar *after, unsigned int limit,
+	provman_settings_tree_cb_t cb, void *user_data);
+
+/*! @brief Compares two keys in the order in which
+ *         #provman_settings_tree_foreach visits them.
+ *
+ * Keys are compared segment by segment, so a key sorts before the keys
+ * located under it, e.g., '/a/b' sorts before '/a/b/c', which sorts
+ * before '/a/b-c'.
+ *
+ * @param a the first key.
+ * @param b the second key.
+ * @return a negative value if a comes before b, 0 if the keys are
+ *         identical and a positive value if a comes after b.
+ */
+
+int provman_settings_tree_key_cmp(const gchar *a, const gchar *b);
+
+/*! @brief Reports the differences between two settings trees.
+ *
+ * changed is invoked for each setting of new_tree that is either not
+ * present in old_tree or that has a different value in old_tree.
+ * removed is invoked, with the old value, for each setting of old_tree
+ * that is not present in new_tree.  Nodes that are shared by the two
+ * trees, because one is a snapshot of the other or both are snapshots of
+ * the same tree, are skipped without being visited, so comparing a tree
+ * with a modified snapshot of itself only costs time proportional to the
+ * number of modifications.  Neither tree may be modified by the
+ * callbacks.
+ *
+ * @param old_tree the original settings tree.
+ * @param new_tree the modified settings tree.
+ * @param changed the function to invoke for new and modified settings.
+ * @param removed the function to invoke for removed settings.
+ * @param user_data passed to changed and removed.
+ */
+
+void provman_settings_tree_diff(provman_settings_tree_t *old_tree,
+				provman_settings_tree_t *new_tree,
+				provman_settings_tree_cb_t changed,
+				provman_settings_tree_cb_t removed,
+				void *user_data);
+
+/*! @brief Retrieves the names of the sub-directories and settings located
+ *         immediately under a directory.
+ *
+ * This is the tree equivalent of #provman_utils_get_contexts.  For
+ * example, if dir is '/telephony/contexts/' the names of all the
+ * telephony contexts stored in the tree are returned.
+ *
+ * @param tree the settings tree.
+ * @param dir the directory.  A trailing '/' is ignored.
+ * @return a new hash table that contains only keys.  The caller assumes
+ *         ownership of this hash table and must delete it when no longer
+ *         required, by calling g_hash_table_unref.
+ */
+
+GHashTable *provman_settings_tree_get_children(provman_settings_tree_t *tree,
+					       const gchar *dir);
+
+#ifdef PROVMAN_LOGGING
+
+/*! @brief Dumps the contents of a settings tree to the log file
+ *
+ * @param tree the settings tree.
+ */
+
+void provman_settings_tree_dump(provman_settings_tree_t *tree);
+#endif
+
+#endif
@@ -47,6 +47,21 @@
 
 int provman_utils_validate_key(const char *key);
 
+/*! @brief Determines whether a key is matched by a search key.
+ *
+ * Search keys are interpreted in the same way as the key passed to the
+ * GetAll D-Bus method.  If search_key ends with a '/', it matches all the
+ * keys located under the directory search_key.  Otherwise, it matches the
+ * key search_key itself and all the keys located under it.
+ *
+ * @param search_key the search key
+ * @param key the key to test
+ *
+ * @return TRUE if search_key matches key
+ */
+
+gboolean provman_utils_key_matches(const char *search_key, const char *key);
+
 /*! @brief Convenience function for creating a path of a file owned
  *    by provman.
  *
@@ -64,20 +79,100 @@ int provman_utils_validate_key(const char *key);
 
 int provman_utils_make_file_path(const char* fname, gchar **path);
 
+/*! @brief Returns an interned copy of a string.
+ *
+ * Provman maintains a pool of reference counted strings that is shared by
+ * its caches and by the plugins.  Many of the keys and values stored by
+ * the plugins are identical, e.g., "two-way" or "text/calendar", and
+ * interning them ensures that only one copy of each distinct string is
+ * kept in memory.  Two interned strings are equal if and only if their
+ * pointers are equal.
+ *
+ * Interned strings must not be modified.  Each call to this function
+ * returns a new reference that must be released by calling
+ * #provman_utils_intern_unref.
+ *
+ * The pool and the reference counts of its strings are not protected by
+ * a lock.  This function, #provman_utils_intern_ref and
+ * #provman_utils_intern_unref must only be called from the thread that
+ * runs the main loop.  The same applies to any function that interns
+ * strings, such as #provman_utils_settings_insert,
+ * #provman_utils_dup_settings and #provman_settings_tree_insert.  Other
+ * threads may read interned strings, but must not take or release
+ * references to them.
+ *
+ * @param str the string to intern.  Can be NULL, in which case NULL is
+ *        returned.
+ * @return a reference to the interned copy of str.
+ */
+
+const gchar *provman_utils_intern(const gchar *str);
+
+/*! @brief Returns a new reference to an interned string.
+ *
+ * This is a cheaper alternative to #provman_utils_intern that can be
+ * used when str is already known to be interned.
+ *
+ * @param str a string returned by #provman_utils_intern
+ * @return str
+ */
+
+const gchar *provman_utils_intern_ref(const gchar *str);
+
+/*! @brief Releases a reference to an interned string.
+ *
+ * The string is freed when its last reference is released.  This
+ * function can be used as the destroy function of a GHashTable.
+ *
+ * @param str a string returned by #provman_utils_intern or
+ *        #provman_utils_intern_ref.  Can be NULL.
+ */
+
+void provman_utils_intern_unref(gpointer str);
+
+/*! @brief Creates a new hash table of settings whose keys and values
+ * are interned strings.
+ *
+ * Plugins should use this function to create the hash tables they pass
+ * to provman and should add settings to these tables by calling
+ * #provman_utils_settings_insert.
+ *
+ * @return a new hash table.  The caller should delete it with 
+ *   g_hash_table_unref when it is no longer needed.
+ */
+
+GHashTable *provman_utils_new_settings(void);
+
+/*! @brief Adds a setting to a hash table created by 
+ * #provman_utils_new_settings.
+ *
+ * Any existing setting with the same key is replaced.
+ *
+ * @param settings the hash table
+ * @param key the key of the setting.  The key is interned.  The caller
+ *   retains ownership of this string.
+ * @param value the value of the setting.  The value is interned.  The
+ *   caller retains ownership of this string.
+ */
+
+void provman_utils_settings_insert(GHashTable *settings, const gchar *key,
+				   const gchar *value);
+
 /*! @brief Duplicates a hash table used to store settings
  *
- * During a call to a plugin's #provman_plugin_sync_in_cb function
- * it will generate a hash table of settings.  The is obliged to pass
- * ownership of this hash table to provman.  Plugins can
- * call this function to duplicate the hash table of settings, so that they
- * can retain their own copy.  Some plugins may want to do this to faciliate
- * their implementation of #provman_plugin_sync_out_cb, which becomes
- * a simple comparison of two different hash tables.  
+ * Plugins that need to retain a copy of the settings they pass to
+ * #provman_plugin_sync_in_cb should store them in a settings tree and
+ * pass a snapshot of it instead, see #provman_settings_tree_snapshot.
+ * Unlike this function, taking a snapshot does not copy any settings.
+ *
+ * This function interns the keys and values it copies, so it must only be
+ * called from the thread that runs the main loop.
  *
  * @param settings the hash table of settings to duplicate
  * @return a pointer to a newly allocated hash table.  Callers assume ownership
  *   of this hash table and should delete it with a call to g_hash_table_unref
- *   when they no longer need it.
+ *   when they no longer need it.  The keys and values of the new hash
+ *   table are interned strings.
  */
 
 GHashTable* provman_utils_dup_settings(GHashTable *settings);
@@ -142,6 +237,12 @@ GHashTable *provman_utils_get_contexts(GHashTable *settings, const char *root,
  */
 
 void provman_utils_dump_hash_table(GHashTable* hash_table);
+
+/*! @brief Logs the number of strings held in the intern pool and the
+ *         number of references to them.
+ */
+
+void provman_utils_log_intern_stats(void);
 #endif
 
 #endif
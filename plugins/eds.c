@@ -50,6 +50,7 @@
 
 #define EDS_MAP_FILE_CAT "Default"
 #define EDS_MAP_FILE_NAME "eds-mapfile.ini"
+#define EDS_GCONF_ACCOUNTS "/apps/evolution/mail/accounts"
 
 #define LOCAL_KEY_EMAIL_ROOT "/applications/email/"
 #define LOCAL_KEY_EMAIL_INCOMING "incoming"
@@ -147,7 +148,7 @@ const gchar *g_incoming_auth_type_values[] = {
 typedef struct eds_plugin_t_ eds_plugin_t;
 struct eds_plugin_t_ {
 	GConfClient *gconf;
-	GHashTable *settings;
+	provman_settings_tree_t *settings;
 	EAccountList *account_list;
 	provman_map_file_t *map_file;
 	provman_plugin_sync_in_cb sync_in_cb;
@@ -210,8 +211,7 @@ int eds_plugin_new(provman_plugin_instance *instance)
 		goto on_error;
 	}
 
-	plugin_instance->settings = 
-		g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+	provman_settings_tree_new(&plugin_instance->settings);
 	provman_map_file_new(map_file_path, &plugin_instance->map_file);
 	g_free(map_file_path);
 
@@ -237,8 +237,7 @@ void eds_plugin_delete(provman_plugin_instance instance)
 		plugin_instance = instance;
 		if (plugin_instance->gconf)
 			g_object_unref(plugin_instance->gconf);
-		if (plugin_instance->settings)
-			g_hash_table_unref(plugin_instance->settings);
+		provman_settings_tree_delete(plugin_instance->settings);
 		if (plugin_instance->account_list)
 			g_object_unref(plugin_instance->account_list);
 		if (plugin_instance->map_file)
@@ -260,8 +259,9 @@ static void prv_add_param(eds_plugin_t *plugin_instance,
 		g_string_append(key, "/");
 	}
 	g_string_append(key, prop_name);
-	g_hash_table_insert(plugin_instance->settings,
-			    g_string_free(key, FALSE), g_strdup(value));	
+	(void) provman_settings_tree_insert(plugin_instance->settings,
+					    key->str, value);
+	g_string_free(key, TRUE);
 }
 
 static void prv_add_use_ssl_type(eds_plugin_t *plugin_instance, 
@@ -468,14 +468,14 @@ on_error:
 static gboolean prv_complete_sync_in(gpointer user_data)
 {
 	eds_plugin_t *plugin_instance = user_data;
-	GHashTable *copy = NULL;
+	provman_settings_tree_t *copy = NULL;
 
 #ifdef PROVMAN_LOGGING
-	provman_utils_dump_hash_table(plugin_instance->settings);
+	provman_settings_tree_dump(plugin_instance->settings);
 #endif
 
 	if (plugin_instance->err == PROVMAN_ERR_NONE)
-		copy = provman_utils_dup_settings(plugin_instance->settings);
+		copy = provman_settings_tree_snapshot(plugin_instance->settings);
 	plugin_instance->sync_in_cb(plugin_instance->err, copy,
 				    plugin_instance->sync_in_user_data);
 
@@ -687,9 +687,8 @@ static void prv_eds_plugin_analyse(eds_plugin_t *plugin_instance,
 					 prv_eds_account_free);	
 
 	in_contexts = 
-		provman_utils_get_contexts(plugin_instance->settings,
-					     LOCAL_KEY_EMAIL_ROOT,
-					     sizeof(LOCAL_KEY_EMAIL_ROOT) - 1);
+		provman_settings_tree_get_children(plugin_instance->settings,
+						   LOCAL_KEY_EMAIL_ROOT);
 	out_contexts = 
 		provman_utils_get_contexts(new_settings,
 					     LOCAL_KEY_EMAIL_ROOT,
@@ -712,8 +711,9 @@ static void prv_eds_plugin_analyse(eds_plugin_t *plugin_instance,
 
 	g_hash_table_iter_init(&iter, new_settings);
 	while (g_hash_table_iter_next(&iter, &key, &value)) {
-		old_value = g_hash_table_lookup(plugin_instance->settings, key);
-		if (!old_value || strcmp(value, old_value))
+		old_value = provman_settings_tree_lookup(
+			plugin_instance->settings, key);
+		if (old_value != value)
 			prv_update_account(plugin_instance, key, value,
 					   accounts);
 	}
@@ -812,6 +812,24 @@ void eds_plugin_sync_in_cancel(provman_plugin_instance instance)
 	plugin_instance->err = PROVMAN_ERR_CANCELLED;
 }
 
+/*
+ * Rather than tracking which of the requested changes were applied, the
+ * plugin discards the accounts it has read after a sync_out and reads
+ * them again during the next sync_in.  This matters when provman is
+ * resident, as the plugin instance then outlives many sessions.
+ */
+
+static void prv_invalidate_settings(eds_plugin_t *plugin_instance)
+{
+	if (plugin_instance->account_list) {
+		g_object_unref(plugin_instance->account_list);
+		plugin_instance->account_list = NULL;
+	}
+
+	provman_settings_tree_delete(plugin_instance->settings);
+	provman_settings_tree_new(&plugin_instance->settings);
+}
+
 int eds_plugin_sync_out(provman_plugin_instance instance, 
 			GHashTable* settings, 
 			provman_plugin_sync_out_cb callback, 
@@ -826,6 +844,7 @@ int eds_plugin_sync_out(provman_plugin_instance instance,
 #endif
 
 	prv_eds_plugin_analyse(plugin_instance, settings);		
+	prv_invalidate_settings(plugin_instance);
 
 	plugin_instance->sync_out_cb = callback;
 	plugin_instance->sync_out_user_data = user_data;
@@ -841,6 +860,39 @@ void eds_plugin_sync_out_cancel(provman_plugin_instance instance)
 	plugin_instance->err = PROVMAN_ERR_CANCELLED;
 }
 
+/*
+ * All the settings exposed by the plugin are derived from the account
+ * descriptions that EAccountList stores in gconf, so a checksum of these
+ * descriptions changes whenever the settings do.  Computing it avoids
+ * parsing the accounts and their URLs.
+ */
+
+gchar *eds_plugin_get_token(provman_plugin_instance instance,
+			    const char *imsi)
+{
+	eds_plugin_t *plugin_instance = instance;
+	GSList *accounts;
+	GSList *ptr;
+	GChecksum *checksum;
+	gchar *token;
+
+	accounts = gconf_client_get_list(plugin_instance->gconf,
+					 EDS_GCONF_ACCOUNTS,
+					 GCONF_VALUE_STRING, NULL);
+
+	checksum = g_checksum_new(G_CHECKSUM_SHA1);
+	for (ptr = accounts; ptr; ptr = ptr->next) {
+		g_checksum_update(checksum, ptr->data, strlen(ptr->data) + 1);
+		g_free(ptr->data);
+	}
+	g_slist_free(accounts);
+
+	token = g_strdup(g_checksum_get_string(checksum));
+	g_checksum_free(checksum);
+
+	return token;
+}
+
 int eds_plugin_validate_set(provman_plugin_instance instance, 
 			    const char* key, const char* value)
 {
@@ -52,5 +52,7 @@ int eds_plugin_validate_set(provman_plugin_instance instance,
 			    const char* key, const char* value);
 int eds_plugin_validate_del(provman_plugin_instance instance, 
 			    const char* key, bool *leaf);
+gchar *eds_plugin_get_token(provman_plugin_instance instance,
+			    const char *imsi);
 #endif
 
@@ -46,10 +46,18 @@
 #include "map_file.h"
 
 #define OFONO_MAP_FILE_NAME "ofono-mapfile.ini"
+#define OFONO_ALL_MODEMS "*"
 
 #define OFONO_SERVER_NAME "org.ofono"
+#define OFONO_MANAGER_INTERFACE "org.ofono.Manager"
 #define OFONO_CONNMAN_INTERFACE	"org.ofono.ConnectionManager"
 #define OFONO_CONTEXT_INTERFACE	"org.ofono.ConnectionContext"
+#define OFONO_SIM_MANAGER_INTERFACE "org.ofono.SimManager"
+#define OFONO_MANAGER_MODEM_ADDED "ModemAdded"
+#define OFONO_MANAGER_MODEM_REMOVED "ModemRemoved"
+#define OFONO_CONNMAN_CONTEXT_ADDED "ContextAdded"
+#define OFONO_CONNMAN_CONTEXT_REMOVED "ContextRemoved"
+#define OFONO_PROPERTY_CHANGED "PropertyChanged"
 #define OFONO_CONNMAN_GET_CONTEXTS "GetContexts"
 #define OFONO_CONNMAN_REMOVE_CONTEXT "RemoveContext"
 #define OFONO_CONNMAN_ADD_CONTEXT "AddContext"
@@ -62,6 +70,7 @@
 #define OFONO_PROP_PASSWORD "Password"
 #define OFONO_PROP_MMS_PROXY "MessageProxy"
 #define OFONO_PROP_MMSC "MessageCenter"
+#define OFONO_PROP_IMSI "SubscriberIdentity"
 
 #define LOCAL_PROP_NAME "name"
 #define LOCAL_PROP_APN "apn"
@@ -74,6 +83,9 @@
 #define LOCAL_PROP_MMS_PROXY "proxy"
 #define LOCAL_PROP_MMSC "mmsc"
 
+#define OFONO_MAX_PENDING_PROXIES 8
+#define OFONO_MAX_PENDING_CMDS 8
+
 enum ofono_plugin_state_t_ {
 	OFONO_PLUGIN_IDLE,
 	OFONO_PLUGIN_GETTING_MODEMS,
@@ -88,13 +100,30 @@ typedef struct ofono_plugin_modem_t_ ofono_plugin_modem_t;
 struct ofono_plugin_modem_t_
 {
 	gchar *path;
+	gchar *imsi;
+	bool tracked;
 	GDBusProxy *cm_proxy;
 	GHashTable *ctxt_proxies;
-	GHashTable *settings;
+	provman_settings_tree_t *settings;
 	gchar *mms_context;
 	GPtrArray *extra_mms_contexts;
 };
 
+typedef struct ofono_plugin_signal_t_ ofono_plugin_signal_t;
+struct ofono_plugin_signal_t_ {
+	const gchar *interface;
+	const gchar *member;
+};
+
+static const ofono_plugin_signal_t g_ofono_signals[] = {
+	{ OFONO_MANAGER_INTERFACE, OFONO_MANAGER_MODEM_ADDED },
+	{ OFONO_MANAGER_INTERFACE, OFONO_MANAGER_MODEM_REMOVED },
+	{ OFONO_CONNMAN_INTERFACE, OFONO_CONNMAN_CONTEXT_ADDED },
+	{ OFONO_CONNMAN_INTERFACE, OFONO_CONNMAN_CONTEXT_REMOVED },
+	{ OFONO_CONTEXT_INTERFACE, OFONO_PROPERTY_CHANGED },
+	{ OFONO_SIM_MANAGER_INTERFACE, OFONO_PROPERTY_CHANGED }
+};
+
 typedef struct ofono_plugin_t_ ofono_plugin_t;
 struct ofono_plugin_t_ {
 	GHashTable *modems;
@@ -108,15 +137,43 @@ struct ofono_plugin_t_ {
 	utils_ofono_handle_t of_handle;
 	gchar *default_imsi;
 	gchar *imsi;
+	bool all_modems;
+	GPtrArray *active_modems;
+	unsigned int pending_modems;
+	int modems_err;
 	GCancellable *cancellable;
 	GPtrArray *cmds;
-	unsigned int current_cmd;
+	GPtrArray *chains;
+	unsigned int next_chain;
+	unsigned int pending_chains;
+	unsigned int pending_deletes;
 	provman_map_file_t *map_file;
-	GHashTableIter ctx_proxy_iter;
-	gchar *current_ctx_path;
-	GDBusProxy *current_ctx_proxy;
+	GPtrArray *proxy_reqs;
+	unsigned int next_proxy;
+	unsigned int pending_proxies;
+	int proxies_err;
+	GDBusConnection *connection;
+	guint signal_ids[G_N_ELEMENTS(g_ofono_signals)];
+	guint name_watch;
+	bool modems_stale;
 };
 
+/*
+ * Once the first ConnectionManager proxy has been created, the plugin
+ * subscribes to the oFono signals that report changes to the contexts
+ * and to the SIM cards.  A modem is tracked once its contexts have been
+ * read with GetContexts.  From then on, its settings are updated as the
+ * signals arrive and they do not need to be read again at the start of
+ * the next session.  A modem stops being tracked as soon as sync_out
+ * computes commands for it, as the plugin updates its settings itself as
+ * the commands complete, so the signals that report these changes are
+ * ignored.  Signals for the other modems are still processed during
+ * sync_out.  A change of IMSI, the addition or the removal of a modem
+ * and the disappearance of oFono from the bus mark the modems table as
+ * stale.  The last three also stop the tracking of every modem, so that
+ * their contexts are read again at the start of the next session.
+ */
+
 enum ofono_plugin_cmd_type_t_ {
 	OFONO_PLUGIN_DELETE,
 	OFONO_PLUGIN_DELETE_MMS,
@@ -129,7 +186,7 @@ typedef enum ofono_plugin_cmd_type_t_ ofono_plugin_cmd_type_t;
 typedef struct ofono_plugin_spare_context_t_ ofono_plugin_spare_context_t;
 struct ofono_plugin_spare_context_t_ {
 	gchar *ofono_ctxt_name;
-	GHashTable *settings;	
+	provman_settings_tree_t *settings;
 };
 
 typedef struct ofono_plugin_cmd_t_ ofono_plugin_cmd_t;
@@ -143,7 +200,8 @@ static void prv_get_modems_cb(int result, utils_ofono_handle_t handle,
 			      GHashTable *modem_imsi, gchar *default_imsi,
 			      void *user_data);
 static int prv_sync_in_step(ofono_plugin_t *plugin_instance, bool *again);
-static void prv_sync_out_step(ofono_plugin_t *plugin_instance, bool *again);
+static void prv_subscribe_signals(ofono_plugin_t *plugin_instance,
+				  GDBusProxy *proxy);
 
 
 static void prv_ofono_plugin_cmd_free(gpointer data)
@@ -168,7 +226,7 @@ static void prv_ofono_plugin_spare_context_delete(gpointer object)
 	
 	if (spare) {
 		g_free(spare->ofono_ctxt_name);
-		g_hash_table_unref(spare->settings);
+		provman_settings_tree_delete(spare->settings);
 		g_free(spare);
 	}
 }
@@ -179,8 +237,7 @@ void prv_ofono_plugin_spare_context_new(const gchar *context,
 	ofono_plugin_spare_context_t *sp = 
 		g_new0(ofono_plugin_spare_context_t,1);
 	sp->ofono_ctxt_name = g_strdup(context);
-	sp->settings = g_hash_table_new_full(g_str_hash, g_str_equal,
-					     g_free, g_free);
+	provman_settings_tree_new(&sp->settings);
 	*spare = sp;
 }
 
@@ -189,27 +246,29 @@ static void prv_ofono_plugin_modem_free(gpointer object)
 	ofono_plugin_modem_t* modem = object;
 	if (modem) {
 		g_free(modem->path);
+		g_free(modem->imsi);
 		if (modem->extra_mms_contexts)
 			g_ptr_array_unref(modem->extra_mms_contexts);
 		if (modem->cm_proxy)
 		    g_object_unref(modem->cm_proxy);
 		g_hash_table_unref(modem->ctxt_proxies);
-		g_hash_table_unref(modem->settings);
+		provman_settings_tree_delete(modem->settings);
 		g_free(modem->mms_context);
 		g_free(modem);
 	}
 }
 
-static ofono_plugin_modem_t* prv_ofono_plugin_modem_new(const gchar* path)
+static ofono_plugin_modem_t* prv_ofono_plugin_modem_new(const gchar* path,
+							 const gchar *imsi)
 {
 	ofono_plugin_modem_t* modem;
 
 	modem = g_new0(ofono_plugin_modem_t, 1);
 	modem->path = g_strdup(path);
+	modem->imsi = g_strdup(imsi);
 	modem->ctxt_proxies = g_hash_table_new_full(g_str_hash, g_str_equal,
 						    g_free, prv_g_object_unref);
-	modem->settings = g_hash_table_new_full(g_str_hash, g_str_equal,
-						g_free, g_free);
+	provman_settings_tree_new(&modem->settings);
 	modem->extra_mms_contexts = 
 		g_ptr_array_new_with_free_func(
 			prv_ofono_plugin_spare_context_delete);
@@ -217,6 +276,15 @@ static ofono_plugin_modem_t* prv_ofono_plugin_modem_new(const gchar* path)
 	return modem;
 }
 
+static void prv_ofono_plugin_modem_reset(ofono_plugin_modem_t *modem)
+{
+	provman_settings_tree_delete(modem->settings);
+	provman_settings_tree_new(&modem->settings);
+	g_free(modem->mms_context);
+	modem->mms_context = NULL;
+	g_ptr_array_set_size(modem->extra_mms_contexts, 0);
+}
+
 int ofono_plugin_new(provman_plugin_instance *instance)
 {
 	int err = PROVMAN_ERR_NONE;
@@ -234,6 +302,7 @@ int ofono_plugin_new(provman_plugin_instance *instance)
 					       g_free, 
 					       prv_ofono_plugin_modem_free);
 	retval->state = OFONO_PLUGIN_IDLE;
+	retval->active_modems = g_ptr_array_new();
 	provman_map_file_new(map_file_path, &retval->map_file);
 	g_free(map_file_path);
 
@@ -247,7 +316,18 @@ on_error:
 void ofono_plugin_delete(provman_plugin_instance instance)
 {
 	ofono_plugin_t *plugin_instance = instance;
+	unsigned int i;
+
 	if (plugin_instance) {
+		if (plugin_instance->connection) {
+			for (i = 0; i < G_N_ELEMENTS(g_ofono_signals); ++i)
+				g_dbus_connection_signal_unsubscribe(
+					plugin_instance->connection,
+					plugin_instance->signal_ids[i]);
+			g_bus_unwatch_name(plugin_instance->name_watch);
+			g_object_unref(plugin_instance->connection);
+		}
+		g_ptr_array_unref(plugin_instance->active_modems);
 		if (plugin_instance->modems)
 			g_hash_table_unref(plugin_instance->modems);
 		provman_map_file_delete(plugin_instance->map_file);
@@ -257,148 +337,221 @@ void ofono_plugin_delete(provman_plugin_instance instance)
 	}
 }
 
-static int prv_complete_results_call(ofono_plugin_t *plugin_instance,
-				     GDBusProxy *proxy, GAsyncResult *result,
-				     GSourceFunc quit_callback, GVariant **retvals)
+/*
+ * When the session manages all the modems, the settings of each modem
+ * are reported under /telephony/<imsi>/.  They cannot be shared with the
+ * modem's settings tree as their keys differ, so they are copied.
+ */
+
+typedef struct ofono_plugin_merge_t_ ofono_plugin_merge_t;
+struct ofono_plugin_merge_t_ {
+	ofono_plugin_modem_t *modem;
+	provman_settings_tree_t *settings;
+};
+
+static void prv_add_modem_setting(const gchar *key, const gchar *value,
+				  void *user_data)
 {
-	int err = PROVMAN_ERR_NONE;
-	GVariant *res;
+	ofono_plugin_merge_t *merge = user_data;
+	gchar *modem_key;
 
-	res = g_dbus_proxy_call_finish(proxy, result, NULL);
+	modem_key = g_strconcat(LOCAL_KEY_TEL_ROOT, merge->modem->imsi,
+				key + sizeof(LOCAL_KEY_TEL_ROOT) - 2, NULL);
+	(void) provman_settings_tree_insert(merge->settings, modem_key, value);
+	g_free(modem_key);
+}
 
-	if (g_cancellable_is_cancelled(plugin_instance->cancellable)) {
-		PROVMAN_LOG("Operation Cancelled");
-		err = PROVMAN_ERR_CANCELLED;
-		goto on_error;
-	} else if (!res) {
-		PROVMAN_LOG("Operation Failed");
-		err = PROVMAN_ERR_IO;
-		goto on_error;
+static provman_settings_tree_t *prv_get_session_settings(
+	ofono_plugin_t *plugin_instance)
+{
+	ofono_plugin_merge_t merge;
+	ofono_plugin_modem_t *modem;
+	unsigned int i;
+
+	if (!plugin_instance->all_modems) {
+		modem = plugin_instance->active_modems->pdata[0];
+		return provman_settings_tree_snapshot(modem->settings);
 	}
 
-	*retvals = res;
-	res = NULL;
+	provman_settings_tree_new(&merge.settings);
+	for (i = 0; i < plugin_instance->active_modems->len; ++i) {
+		merge.modem = plugin_instance->active_modems->pdata[i];
+		provman_settings_tree_foreach(merge.modem->settings, "/",
+					      prv_add_modem_setting, &merge);
+	}
+
+	return merge.settings;
+}
+
+static gboolean prv_complete_sync_in(gpointer user_data)
+{
+	ofono_plugin_t *plugin_instance = user_data;
+	provman_settings_tree_t *settings = NULL;
+
+	plugin_instance->state = OFONO_PLUGIN_IDLE;
+
+	if (plugin_instance->cancellable) {
+		g_object_unref(plugin_instance->cancellable);
+		plugin_instance->cancellable = NULL;
+	}
+
+	if (plugin_instance->cb_err == PROVMAN_ERR_NONE)
+		settings = prv_get_session_settings(plugin_instance);
+
+	plugin_instance->sync_in_cb(plugin_instance->cb_err, settings,
+				    plugin_instance->sync_in_user_data);
+
+	plugin_instance->completion_source = 0;
+
+	return FALSE;
+}
+
+static void prv_continue_sync_in(ofono_plugin_t *plugin_instance, int err)
+{
+	bool again;
+
+	if (err != PROVMAN_ERR_NONE)
+		goto on_error;
+
+	do {
+		err = prv_sync_in_step(plugin_instance, &again);
+		if (err != PROVMAN_ERR_NONE)
+			goto on_error;
+	} while (again);
+
+	return;
 
 on_error:
 
-	if (res)
-		g_variant_unref(res);
+	plugin_instance->cb_err = err;
+	plugin_instance->completion_source = 
+		g_idle_add(prv_complete_sync_in, plugin_instance);
+}
 
-	g_object_unref(plugin_instance->cancellable);
-	plugin_instance->cancellable = NULL;
-	
-	if (err == PROVMAN_ERR_CANCELLED) {
-		plugin_instance->cb_err = err;
-		plugin_instance->completion_source = 
-			g_idle_add(quit_callback, plugin_instance);
-	}		
+/*
+ * The ConnectionManager proxies and the contexts of the modems of the
+ * session are retrieved concurrently, one request per modem.  The
+ * requests share the plugin's cancellable.  pending_modems counts the
+ * outstanding requests and modems_err records the first error reported.
+ * The session proceeds to its next step when the last request completes.
+ */
 
-	return err;
+typedef struct ofono_plugin_modem_req_t_ ofono_plugin_modem_req_t;
+struct ofono_plugin_modem_req_t_ {
+	ofono_plugin_t *plugin_instance;
+	ofono_plugin_modem_t *modem;
+};
+
+static ofono_plugin_modem_req_t *prv_modem_request_new(
+	ofono_plugin_t *plugin_instance, ofono_plugin_modem_t *modem)
+{
+	ofono_plugin_modem_req_t *req;
+
+	req = g_new(ofono_plugin_modem_req_t, 1);
+	req->plugin_instance = plugin_instance;
+	req->modem = modem;
+	++plugin_instance->pending_modems;
+
+	return req;
 }
 
-static int prv_complete_proxy_call(ofono_plugin_t *plugin_instance,
-				   GAsyncResult *result,
-				   GSourceFunc quit_callback,
-				   GDBusProxy **proxy)
+static int prv_modem_request_err(ofono_plugin_t *plugin_instance, bool ok)
 {
 	int err = PROVMAN_ERR_NONE;
-	GDBusProxy *res;
-
-	res = g_dbus_proxy_new_finish(result, NULL);
 
 	if (g_cancellable_is_cancelled(plugin_instance->cancellable)) {
 		PROVMAN_LOG("Operation Cancelled");
 		err = PROVMAN_ERR_CANCELLED;
-		goto on_error;
-	} else if (!res) {
+	} else if (!ok) {
 		PROVMAN_LOG("Operation Failed");
 		err = PROVMAN_ERR_IO;
-		goto on_error;
 	}
 
-	*proxy = res;
-	res = NULL;
+	return err;
+}
 
-on_error:
+static void prv_modem_request_done(ofono_plugin_modem_req_t *req, int err)
+{
+	ofono_plugin_t *plugin_instance = req->plugin_instance;
 
-	if (res)
-		g_object_unref(res);
+	g_free(req);
+
+	--plugin_instance->pending_modems;
+	if (err == PROVMAN_ERR_CANCELLED ||
+	    plugin_instance->modems_err == PROVMAN_ERR_NONE)
+		plugin_instance->modems_err = err;
+
+	if (plugin_instance->pending_modems > 0)
+		return;
 
 	g_object_unref(plugin_instance->cancellable);
 	plugin_instance->cancellable = NULL;
-	
-	if (err == PROVMAN_ERR_CANCELLED) {
-		plugin_instance->cb_err = err;
-		plugin_instance->completion_source = 
-			g_idle_add(quit_callback, plugin_instance);
-	}		
 
-	return err;
+	prv_continue_sync_in(plugin_instance, plugin_instance->modems_err);
 }
 
-
-
-static gboolean prv_complete_sync_in(gpointer user_data)
+static void prv_connman_proxy_created(GObject *source_object, 
+				      GAsyncResult *result,
+				      gpointer user_data)
 {
-	ofono_plugin_t *plugin_instance = user_data;
-	GHashTable *settings = NULL;
-	ofono_plugin_modem_t *modem;
-
-	plugin_instance->state = OFONO_PLUGIN_IDLE;
+	int err = PROVMAN_ERR_NONE;
+	ofono_plugin_modem_req_t *req = user_data;
+	ofono_plugin_t *plugin_instance = req->plugin_instance;
+	GDBusProxy *proxy;
 
-	if (plugin_instance->cancellable) {
-		g_object_unref(plugin_instance->cancellable);
-		plugin_instance->cancellable = NULL;
+	proxy = g_dbus_proxy_new_finish(result, NULL);
+	err = prv_modem_request_err(plugin_instance, proxy != NULL);
+	if (err != PROVMAN_ERR_NONE) {
+		if (proxy)
+			g_object_unref(proxy);
+		goto on_error;
 	}
 
-	if (plugin_instance->cb_err == PROVMAN_ERR_NONE) {
-		modem = g_hash_table_lookup(plugin_instance->modems, 
-					    plugin_instance->imsi);	
-		settings = provman_utils_dup_settings(modem->settings);
-	}		
+	req->modem->cm_proxy = proxy;
 
-	plugin_instance->sync_in_cb(plugin_instance->cb_err, settings,
-				    plugin_instance->sync_in_user_data);
+	PROVMAN_LOGF("Connman Proxy Created for %s", req->modem->path);
 
-	plugin_instance->completion_source = 0;
+	if (!plugin_instance->connection)
+		prv_subscribe_signals(plugin_instance, proxy);
 
-	return FALSE;
+on_error:
+
+	prv_modem_request_done(req, err);
 }
 
-static void prv_connman_proxy_created(GObject *source_object, 
-				      GAsyncResult *result,
-				      gpointer user_data)
+static bool prv_create_connman_proxies(ofono_plugin_t *plugin_instance)
 {
-	int err = PROVMAN_ERR_NONE;
-	bool again;
-	ofono_plugin_t *plugin_instance = user_data;
-	GDBusProxy *proxy;
+	unsigned int i;
 	ofono_plugin_modem_t *modem;
+	ofono_plugin_modem_req_t *req;
 
-	err = prv_complete_proxy_call(plugin_instance, result,
-				      prv_complete_sync_in,
-				      &proxy);
-       	if (err != PROVMAN_ERR_NONE)
-		goto on_error;
+	plugin_instance->pending_modems = 0;
+	plugin_instance->modems_err = PROVMAN_ERR_NONE;
+	plugin_instance->cancellable = g_cancellable_new();
 
-	modem = g_hash_table_lookup(plugin_instance->modems, 
-				    plugin_instance->imsi);
-	
-	modem->cm_proxy = proxy;
+	for (i = 0; i < plugin_instance->active_modems->len; ++i) {
+		modem = plugin_instance->active_modems->pdata[i];
+		if (modem->cm_proxy)
+			continue;
 
-	PROVMAN_LOG("Connman Proxy Created.");
+		PROVMAN_LOGF("Creating Proxy for %s", modem->path);
 
-	do {
-		err = prv_sync_in_step(plugin_instance, &again);
-		if (err != PROVMAN_ERR_NONE)
-			goto on_error;
-	} while (again);
+		req = prv_modem_request_new(plugin_instance, modem);
+		g_dbus_proxy_new_for_bus(
+			G_BUS_TYPE_SYSTEM,
+			G_DBUS_PROXY_FLAGS_DO_NOT_LOAD_PROPERTIES,
+			NULL, OFONO_SERVER_NAME, modem->path,
+			OFONO_CONNMAN_INTERFACE, 
+			plugin_instance->cancellable,
+			prv_connman_proxy_created, req);
+	}
 
-	return;
+	if (plugin_instance->pending_modems == 0) {
+		g_object_unref(plugin_instance->cancellable);
+		plugin_instance->cancellable = NULL;
+	}
 
-on_error:
-	
-	return;
+	return plugin_instance->pending_modems > 0;
 }
 
 static void prv_add_context_str_prop(ofono_plugin_modem_t *modem,
@@ -406,30 +559,28 @@ static void prv_add_context_str_prop(ofono_plugin_modem_t *modem,
 				     const gchar *prop_name,
 				     GVariant *value)
 {
-	gchar* val;
 	GString *key;
 	
-	val = g_variant_dup_string(value, NULL);
 	key = g_string_new(LOCAL_KEY_CONTEXT_ROOT);
 	key = g_string_append(key, context_name);
 	key = g_string_append(key, "/");
 	key = g_string_append(key, prop_name);	
-	g_hash_table_insert(modem->settings, key->str, val);
-	g_string_free(key, FALSE);
+	(void) provman_settings_tree_insert(modem->settings, key->str,
+					    g_variant_get_string(value, NULL));
+	g_string_free(key, TRUE);
 }
 
-static void prv_add_mms_str_prop(GHashTable *settings,
+static void prv_add_mms_str_prop(provman_settings_tree_t *settings,
 				 const gchar *prop_name,
 				 GVariant *value)
 {
-	gchar* val;
 	GString *key;
 	
-	val = g_variant_dup_string(value, NULL);
 	key = g_string_new(LOCAL_KEY_MMS_ROOT);
 	key = g_string_append(key, prop_name);	
-	g_hash_table_insert(settings, key->str, val);
-	g_string_free(key, FALSE);
+	(void) provman_settings_tree_insert(settings, key->str,
+					    g_variant_get_string(value, NULL));
+	g_string_free(key, TRUE);
 }
 
 static void prv_add_context_prop(ofono_plugin_modem_t *modem,
@@ -451,7 +602,7 @@ static void prv_add_context_prop(ofono_plugin_modem_t *modem,
 					 LOCAL_PROP_PASSWORD, value);
 }
 
-static void prv_add_mms_prop(GHashTable *settings,
+static void prv_add_mms_prop(provman_settings_tree_t *settings,
 			     const gchar *prop_name,
 			     GVariant *value)
 {
@@ -490,156 +641,443 @@ static bool prv_is_mms_context(GVariant *properties)
 	return retval;
 }
 
+static ofono_plugin_spare_context_t *prv_find_spare_context(
+	ofono_plugin_modem_t *modem, const gchar *path, unsigned int *index)
+{
+	unsigned int i;
+	ofono_plugin_spare_context_t *spare;
+
+	for (i = 0; i < modem->extra_mms_contexts->len; ++i) {
+		spare = g_ptr_array_index(modem->extra_mms_contexts, i);
+		if (!strcmp(spare->ofono_ctxt_name, path)) {
+			if (index)
+				*index = i;
+			return spare;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Returns the client identifier of an internet context, creating a
+ * mapping for contexts that have not been seen before.  The caller
+ * must free the identifier.
+ */
+
+static gchar *prv_get_client_id(ofono_plugin_t *plugin_instance,
+				ofono_plugin_modem_t *modem,
+				const gchar *full_context_name)
+{
+	gchar *context_name;
+	const gchar *last;
+
+	context_name = provman_map_file_find_client_id(
+		plugin_instance->map_file, modem->imsi, full_context_name);
+	if (!context_name) {
+		last = strrchr(full_context_name, '/');
+		context_name = g_strdup(last ? last + 1 : full_context_name);
+		provman_map_file_store_map(plugin_instance->map_file,
+					   modem->imsi, context_name,
+					   full_context_name);
+	}
+
+	return context_name;
+}
+
+static void prv_ofono_plugin_add_context(ofono_plugin_t *plugin_instance,
+					 ofono_plugin_modem_t *modem,
+					 const gchar *full_context_name,
+					 GVariant *properties)
+{
+	GVariantIter *iter;
+	gchar *context_name;
+	gchar* prop_name;
+	GVariant *value;
+	provman_settings_tree_t *mms_settings;
+	ofono_plugin_spare_context_t *spare_ctxt;
+
+	if (!g_hash_table_lookup_extended(modem->ctxt_proxies,
+					  full_context_name, NULL, NULL))
+		g_hash_table_insert(modem->ctxt_proxies,
+				    g_strdup(full_context_name), NULL);
+
+	if (prv_is_mms_context(properties)) {
+		if (!modem->mms_context) {
+			modem->mms_context = g_strdup(full_context_name);
+			mms_settings = modem->settings;
+		} else {
+			prv_ofono_plugin_spare_context_new(full_context_name,
+							   &spare_ctxt);
+			mms_settings = spare_ctxt->settings;
+			g_ptr_array_add(modem->extra_mms_contexts, spare_ctxt);
+		}
+
+		iter = g_variant_iter_new(properties);
+		while (g_variant_iter_next(iter, "{&sv}", &prop_name,
+					   &value)) {
+			prv_add_mms_prop(mms_settings, prop_name, value);
+			g_variant_unref(value);
+		}
+		g_variant_iter_free(iter);
+	} else {
+		context_name = prv_get_client_id(plugin_instance, modem,
+						 full_context_name);
+
+		iter = g_variant_iter_new(properties);
+		while (g_variant_iter_next(iter, "{&sv}", &prop_name,
+					   &value)) {
+			prv_add_context_prop(modem, context_name, prop_name,
+					     value);
+			g_variant_unref(value);
+		}
+		g_variant_iter_free(iter);
+		g_free(context_name);
+	}
+}
+
 static void prv_ofono_plugin_update_contexts(ofono_plugin_t *plugin_instance,
 					     ofono_plugin_modem_t *modem,
 					     GVariant *array)
 {
 	GVariant *tuple;
-	GVariantIter *iter;
 	GVariant *properties;
 	gchar *full_context_name;
-	gchar *context_name;
-	gchar *mapped_name;
 	unsigned int i;
-	gchar* prop_name;
-	GVariant *value;
 	GHashTable *full_contexts;
-	bool ctx_type_mms;
-	GHashTable *mms_settings;
-	ofono_plugin_spare_context_t *spare_ctxt;
+	GHashTableIter iter;
+	gpointer key;
 
 	full_contexts = g_hash_table_new_full(g_str_hash, g_str_equal,
-					      NULL, NULL);
+					      g_free, NULL);
 	
 	for (i = 0; i < g_variant_n_children(array); ++i) {
 		tuple = g_variant_get_child_value(array, i);
 		
 		g_variant_get_child(tuple, 0, "o", &full_context_name);
-		
-		/* full_context_name is owned by ctxt_proxies */
 
-		g_hash_table_insert(modem->ctxt_proxies, full_context_name,
-				    NULL);
+		/* full_context_name is owned by full_contexts */
+
 		g_hash_table_insert(full_contexts, full_context_name, NULL);
 
 		properties = g_variant_get_child_value(tuple,1);
-		ctx_type_mms = prv_is_mms_context(properties);
-
-		if (ctx_type_mms) {
-			if (!modem->mms_context) {
-				modem->mms_context = 
-					g_strdup(full_context_name);
-				mms_settings = modem->settings;
-			} else {
-				prv_ofono_plugin_spare_context_new(full_context_name,
-								   &spare_ctxt);
-				mms_settings = spare_ctxt->settings;
-				g_ptr_array_add(modem->extra_mms_contexts, spare_ctxt);
-			}
-
-			iter = g_variant_iter_new(properties);
-			while (g_variant_iter_next(iter, "{&sv}",
-						   &prop_name,
-						   &value)) {
-				prv_add_mms_prop(mms_settings,
-						 prop_name, value);
-				g_variant_unref(value);
-			}
-			g_variant_iter_free(iter);
-		} else {
-			mapped_name = provman_map_file_find_client_id(
-				plugin_instance->map_file,
-				plugin_instance->imsi,
-				full_context_name);
-			if (mapped_name) {
-				context_name = mapped_name;
-			} else {
-				context_name = strrchr(full_context_name, '/');
-				if (!context_name)
-					context_name = full_context_name;
-				else
-					++context_name;
-				provman_map_file_store_map(
-					plugin_instance->map_file,
-					plugin_instance->imsi,
-					context_name,
-					full_context_name);
-			}
-
-			iter = g_variant_iter_new(properties);
-			while (g_variant_iter_next(iter, "{&sv}", &prop_name,
-						   &value)) {
-				prv_add_context_prop(modem, context_name,
-						     prop_name, value);
-				g_variant_unref(value);
-			}
-			g_variant_iter_free(iter);
-			g_free(mapped_name);
-		}
+		prv_ofono_plugin_add_context(plugin_instance, modem,
+					     full_context_name, properties);
 		
 		g_variant_unref(properties);
 		g_variant_unref(tuple);
 	}
+
+	/* The proxies of contexts that no longer exist are released. */
+
+	g_hash_table_iter_init(&iter, modem->ctxt_proxies);
+	while (g_hash_table_iter_next(&iter, &key, NULL))
+		if (!g_hash_table_lookup_extended(full_contexts, key, NULL,
+						  NULL))
+			g_hash_table_iter_remove(&iter);
+
 	provman_map_file_remove_unused(plugin_instance->map_file,
-				       plugin_instance->imsi, full_contexts);
+				       modem->imsi, full_contexts);
 	provman_map_file_save(plugin_instance->map_file);
 	g_hash_table_unref(full_contexts);
 }
 
+static void prv_merge_setting(const gchar *key, const gchar *value,
+			      void *user_data)
+{
+	(void) provman_settings_tree_insert(user_data, key, value);
+}
+
+/*
+ * When the MMS context is removed, the first spare MMS context, if any,
+ * takes its place.
+ */
+
+static void prv_mms_context_removed(ofono_plugin_modem_t *modem)
+{
+	ofono_plugin_spare_context_t *spare;
+
+	g_free(modem->mms_context);
+	modem->mms_context = NULL;
+	(void) provman_settings_tree_remove_dir(modem->settings,
+						LOCAL_KEY_MMS_ROOT);
+	if (modem->extra_mms_contexts->len > 0) {
+		spare = modem->extra_mms_contexts->pdata[0];
+		modem->mms_context = spare->ofono_ctxt_name;
+		spare->ofono_ctxt_name = NULL;
+		provman_settings_tree_foreach(spare->settings, "/",
+					      prv_merge_setting,
+					      modem->settings);
+		g_ptr_array_remove_index(modem->extra_mms_contexts, 0);
+	}
+}
+
+static void prv_ofono_plugin_remove_context(ofono_plugin_t *plugin_instance,
+					    ofono_plugin_modem_t *modem,
+					    const gchar *full_context_name)
+{
+	unsigned int index;
+	gchar *context_name;
+	gchar *dir;
+
+	if (!g_hash_table_remove(modem->ctxt_proxies, full_context_name))
+		return;
+
+	if (!g_strcmp0(modem->mms_context, full_context_name)) {
+		prv_mms_context_removed(modem);
+	} else if (prv_find_spare_context(modem, full_context_name, &index)) {
+		g_ptr_array_remove_index(modem->extra_mms_contexts, index);
+	} else {
+		context_name = provman_map_file_find_client_id(
+			plugin_instance->map_file, modem->imsi,
+			full_context_name);
+		if (context_name) {
+			dir = g_strconcat(LOCAL_KEY_CONTEXT_ROOT, context_name,
+					  NULL);
+			(void) provman_settings_tree_remove_dir(modem->settings,
+								dir);
+			(void) provman_map_file_delete_map(
+				plugin_instance->map_file, modem->imsi,
+				context_name);
+			provman_map_file_save(plugin_instance->map_file);
+			g_free(dir);
+			g_free(context_name);
+		}
+	}
+}
+
+static void prv_ofono_plugin_context_changed(ofono_plugin_t *plugin_instance,
+					     ofono_plugin_modem_t *modem,
+					     const gchar *full_context_name,
+					     const gchar *prop_name,
+					     GVariant *value)
+{
+	ofono_plugin_spare_context_t *spare;
+	gchar *context_name;
+
+	if (!g_strcmp0(modem->mms_context, full_context_name)) {
+		prv_add_mms_prop(modem->settings, prop_name, value);
+	} else {
+		spare = prv_find_spare_context(modem, full_context_name, NULL);
+		if (spare) {
+			prv_add_mms_prop(spare->settings, prop_name, value);
+		} else {
+			context_name = prv_get_client_id(plugin_instance,
+							 modem,
+							 full_context_name);
+			prv_add_context_prop(modem, context_name, prop_name,
+					     value);
+			g_free(context_name);
+		}
+	}
+}
+
+static ofono_plugin_modem_t *prv_find_modem(ofono_plugin_t *plugin_instance,
+					    const gchar *path, bool context)
+{
+	GHashTableIter iter;
+	gpointer value;
+	ofono_plugin_modem_t *modem;
+
+	g_hash_table_iter_init(&iter, plugin_instance->modems);
+	while (g_hash_table_iter_next(&iter, NULL, &value)) {
+		modem = value;
+		if (context ? g_hash_table_lookup_extended(modem->ctxt_proxies,
+							   path, NULL, NULL)
+		    : !strcmp(modem->path, path))
+			return modem;
+	}
+
+	return NULL;
+}
+
+static void prv_invalidate_modems(ofono_plugin_t *plugin_instance)
+{
+	GHashTableIter iter;
+	gpointer value;
+	ofono_plugin_modem_t *modem;
+
+	/* The modems are not freed here as the active modems and any
+	   pending requests may still point to them.  Stale entries are
+	   replaced or removed when the modems are next retrieved. */
+
+	plugin_instance->modems_stale = true;
+
+	if (plugin_instance->modems) {
+		g_hash_table_iter_init(&iter, plugin_instance->modems);
+		while (g_hash_table_iter_next(&iter, NULL, &value)) {
+			modem = value;
+			modem->tracked = false;
+		}
+	}
+}
+
+static void prv_ofono_vanished(GDBusConnection *connection,
+			       const gchar *name, gpointer user_data)
+{
+	PROVMAN_LOGF("%s has left the bus", name);
+
+	prv_invalidate_modems(user_data);
+}
+
+static void prv_ofono_signal(GDBusConnection *connection,
+			     const gchar *sender_name,
+			     const gchar *object_path,
+			     const gchar *interface_name,
+			     const gchar *signal_name,
+			     GVariant *parameters,
+			     gpointer user_data)
+{
+	ofono_plugin_t *plugin_instance = user_data;
+	ofono_plugin_modem_t *modem;
+	const gchar *name;
+	GVariant *value;
+	bool context = !strcmp(interface_name, OFONO_CONTEXT_INTERFACE);
+
+	if (!strcmp(interface_name, OFONO_MANAGER_INTERFACE)) {
+		PROVMAN_LOGF("%s.%s received", interface_name, signal_name);
+		prv_invalidate_modems(plugin_instance);
+		return;
+	}
+
+	if (!strcmp(interface_name, OFONO_SIM_MANAGER_INTERFACE)) {
+		g_variant_get(parameters, "(&sv)", &name, &value);
+		if (!strcmp(name, OFONO_PROP_IMSI)) {
+			PROVMAN_LOGF("IMSI of %s has changed", object_path);
+			plugin_instance->modems_stale = true;
+		}
+		g_variant_unref(value);
+		return;
+	}
+
+	modem = prv_find_modem(plugin_instance, object_path, context);
+	if (!modem || !modem->tracked)
+		return;
+
+	PROVMAN_LOGF("%s.%s received for %s", interface_name, signal_name,
+		     object_path);
+
+	if (context) {
+		g_variant_get(parameters, "(&sv)", &name, &value);
+		prv_ofono_plugin_context_changed(plugin_instance, modem,
+						 object_path, name, value);
+		g_variant_unref(value);
+	} else if (!strcmp(signal_name, OFONO_CONNMAN_CONTEXT_ADDED)) {
+		g_variant_get(parameters, "(&o@a{sv})", &name, &value);
+		prv_ofono_plugin_add_context(plugin_instance, modem, name,
+					     value);
+		provman_map_file_save(plugin_instance->map_file);
+		g_variant_unref(value);
+	} else if (!strcmp(signal_name, OFONO_CONNMAN_CONTEXT_REMOVED)) {
+		g_variant_get(parameters, "(&o)", &name);
+		prv_ofono_plugin_remove_context(plugin_instance, modem, name);
+	}
+}
+
+static void prv_subscribe_signals(ofono_plugin_t *plugin_instance,
+				  GDBusProxy *proxy)
+{
+	unsigned int i;
+
+	plugin_instance->connection =
+		g_object_ref(g_dbus_proxy_get_connection(proxy));
+
+	for (i = 0; i < G_N_ELEMENTS(g_ofono_signals); ++i)
+		plugin_instance->signal_ids[i] =
+			g_dbus_connection_signal_subscribe(
+				plugin_instance->connection,
+				OFONO_SERVER_NAME,
+				g_ofono_signals[i].interface,
+				g_ofono_signals[i].member,
+				NULL, NULL, G_DBUS_SIGNAL_FLAGS_NONE,
+				prv_ofono_signal, plugin_instance, NULL);
+
+	plugin_instance->name_watch =
+		g_bus_watch_name_on_connection(plugin_instance->connection,
+					       OFONO_SERVER_NAME,
+					       G_BUS_NAME_WATCHER_FLAGS_NONE,
+					       NULL, prv_ofono_vanished,
+					       plugin_instance, NULL);
+}
+
 static void prv_get_contexts_cb(GObject *source_object,
 				GAsyncResult *result,
 				gpointer user_data)
 {
 	int err = PROVMAN_ERR_NONE;
-	GVariant *retvals = NULL;
+	GVariant *retvals;
 	GVariant *array;
-	ofono_plugin_t *plugin_instance = user_data;
-	ofono_plugin_modem_t *modem;
-	bool again;
-
-	modem = g_hash_table_lookup(plugin_instance->modems, 
-				    plugin_instance->imsi);
+	ofono_plugin_modem_req_t *req = user_data;
+	ofono_plugin_t *plugin_instance = req->plugin_instance;
+	ofono_plugin_modem_t *modem = req->modem;
 
-	err = prv_complete_results_call(plugin_instance, modem->cm_proxy,
-					result, prv_complete_sync_in,
-					&retvals);
-	if (err != PROVMAN_ERR_NONE)
+	retvals = g_dbus_proxy_call_finish(modem->cm_proxy, result, NULL);
+	err = prv_modem_request_err(plugin_instance, retvals != NULL);
+	if (err != PROVMAN_ERR_NONE) {
+		PROVMAN_LOGF("Unable to Retrieve oFono Contexts.  Error %d",
+			     err);
+		if (retvals)
+			g_variant_unref(retvals);
 		goto on_error;
+	}
 
 	array = g_variant_get_child_value(retvals,0);
 	prv_ofono_plugin_update_contexts(plugin_instance, modem, array);
 	g_variant_unref(array);
+	g_variant_unref(retvals);
+	modem->tracked = plugin_instance->connection != NULL;
 
-	do {
-		err = prv_sync_in_step(plugin_instance, &again);
-		if (err != PROVMAN_ERR_NONE)
-			goto on_error;
-	} while (again);
+on_error:
 
-	g_variant_unref(retvals);
+	prv_modem_request_done(req, err);
+}
 
-	return;
+static bool prv_get_contexts(ofono_plugin_t *plugin_instance)
+{
+	unsigned int i;
+	ofono_plugin_modem_t *modem;
 
-on_error:
-	
-	PROVMAN_LOGF("Unable to Retrieve oFono Contexts.  Error %d", err);
+	plugin_instance->pending_modems = 0;
+	plugin_instance->modems_err = PROVMAN_ERR_NONE;
+	plugin_instance->cancellable = g_cancellable_new();
 
-	if (retvals)
-		g_variant_unref(retvals);
-	
-	plugin_instance->cb_err = err;
-	plugin_instance->completion_source = 
-		g_idle_add(prv_complete_sync_in, plugin_instance);
+	for (i = 0; i < plugin_instance->active_modems->len; ++i) {
+		modem = plugin_instance->active_modems->pdata[i];
+		if (modem->tracked)
+			continue;
+
+		PROVMAN_LOGF("Retrieving Context Settings for %s",
+			     modem->path);
+
+		prv_ofono_plugin_modem_reset(modem);
+		g_dbus_proxy_call(modem->cm_proxy,
+				  OFONO_CONNMAN_GET_CONTEXTS,
+				  NULL, G_DBUS_CALL_FLAGS_NONE,
+				  -1, plugin_instance->cancellable,
+				  prv_get_contexts_cb,
+				  prv_modem_request_new(plugin_instance,
+							modem));
+	}
+
+	if (plugin_instance->pending_modems == 0) {
+		g_object_unref(plugin_instance->cancellable);
+		plugin_instance->cancellable = NULL;
+	}
+
+	return plugin_instance->pending_modems > 0;
 }
 
 #ifdef PROVMAN_LOGGING
 static void prv_dump_settings(ofono_plugin_t *plugin_instance)
 {
 	ofono_plugin_modem_t *modem;
+	unsigned int i;
 
-	modem = g_hash_table_lookup(plugin_instance->modems, 
-				    plugin_instance->imsi);
-	provman_utils_dump_hash_table(modem->settings);
+	for (i = 0; i < plugin_instance->active_modems->len; ++i) {
+		modem = plugin_instance->active_modems->pdata[i];
+		PROVMAN_LOGF("Settings of %s", modem->imsi);
+		provman_settings_tree_dump(modem->settings);
+	}
 }
 
 static void prv_dump_tasks(GPtrArray *cmds)
@@ -663,86 +1101,163 @@ static void prv_dump_tasks(GPtrArray *cmds)
 }
 #endif
 
-static bool prv_get_context_proxies(ofono_plugin_t *plugin_instance,
-				    ofono_plugin_modem_t *modem);
+/*
+ * The proxies of all the contexts that do not have one yet, on all the
+ * modems of the session, are created concurrently.  proxy_reqs lists the
+ * contexts concerned and next_proxy is the index of the first context
+ * whose proxy has not been requested.
+ * At most OFONO_MAX_PENDING_PROXIES requests are outstanding at any one
+ * time, each completion issuing the next request.  The requests share
+ * the plugin's cancellable, which is released when the last of them
+ * completes.  proxies_err records the first error reported.
+ */
+
+typedef struct ofono_plugin_proxy_req_t_ ofono_plugin_proxy_req_t;
+struct ofono_plugin_proxy_req_t_ {
+	ofono_plugin_t *plugin_instance;
+	ofono_plugin_modem_t *modem;
+	gchar *path;
+};
+
+static void prv_proxy_req_free(gpointer data)
+{
+	ofono_plugin_proxy_req_t *req = data;
 
+	if (req) {
+		g_free(req->path);
+		g_free(req);
+	}
+}
+
+static void prv_context_proxy_created(GObject *source_object, 
+				      GAsyncResult *result,
+				      gpointer user_data);
+
+static void prv_request_context_proxy(ofono_plugin_t *plugin_instance)
+{
+	ofono_plugin_proxy_req_t *req;
+
+	req = g_ptr_array_index(plugin_instance->proxy_reqs,
+				plugin_instance->next_proxy);
+	++plugin_instance->next_proxy;
+	++plugin_instance->pending_proxies;
+
+	g_dbus_proxy_new_for_bus(G_BUS_TYPE_SYSTEM, 
+				 G_DBUS_PROXY_FLAGS_DO_NOT_LOAD_PROPERTIES,
+				 NULL, OFONO_SERVER_NAME, req->path,
+				 OFONO_CONTEXT_INTERFACE, 
+				 plugin_instance->cancellable,
+				 prv_context_proxy_created, req);
+}
 
 static void prv_context_proxy_created(GObject *source_object, 
 				      GAsyncResult *result,
 				      gpointer user_data)
 {
-	int err = PROVMAN_ERR_NONE;
-	bool again;
-	ofono_plugin_t *plugin_instance = user_data;
+	ofono_plugin_proxy_req_t *req = user_data;
+	ofono_plugin_t *plugin_instance = req->plugin_instance;
 	GDBusProxy *proxy;
-	ofono_plugin_modem_t *modem;
+	ofono_plugin_modem_t *modem = req->modem;
 
-	err = prv_complete_proxy_call(plugin_instance, result,
-				      prv_complete_sync_in,
-				      &proxy);
-	if (err != PROVMAN_ERR_NONE)
-		goto on_error;
+	proxy = g_dbus_proxy_new_finish(result, NULL);
+	--plugin_instance->pending_proxies;
 
-	modem = g_hash_table_lookup(plugin_instance->modems, 
-				    plugin_instance->imsi);
-	
-	g_hash_table_insert(modem->ctxt_proxies,
-			    g_strdup(plugin_instance->current_ctx_path), proxy);
+	if (g_cancellable_is_cancelled(plugin_instance->cancellable)) {
+		PROVMAN_LOG("Operation Cancelled");
+		plugin_instance->proxies_err = PROVMAN_ERR_CANCELLED;
+	} else if (!proxy) {
+		PROVMAN_LOGF("Unable to create Context Proxy for %s",
+			     req->path);
+		if (plugin_instance->proxies_err == PROVMAN_ERR_NONE)
+			plugin_instance->proxies_err = PROVMAN_ERR_IO;
+	} else {
 
-	PROVMAN_LOGF("Context Proxy Created for %s", 
-		plugin_instance->current_ctx_path);
+		/* The context may have been removed while its proxy was
+		   being created. */
 
-	if (!prv_get_context_proxies(plugin_instance, modem))
-		do {
-			err = prv_sync_in_step(plugin_instance, &again);
-			if (err != PROVMAN_ERR_NONE)
-				goto on_error;			
-		} while (again);
-	
-	return;
+		if (g_hash_table_lookup_extended(modem->ctxt_proxies,
+						 req->path, NULL, NULL)) {
+			g_hash_table_insert(modem->ctxt_proxies,
+					    g_strdup(req->path), proxy);
+			proxy = NULL;
+			PROVMAN_LOGF("Context Proxy Created for %s",
+				     req->path);
+		}
+	}
 
-on_error:
-	
-	return;
+	if (proxy)
+		g_object_unref(proxy);
+
+	if (plugin_instance->proxies_err == PROVMAN_ERR_NONE &&
+	    plugin_instance->next_proxy < plugin_instance->proxy_reqs->len)
+		prv_request_context_proxy(plugin_instance);
+
+	if (plugin_instance->pending_proxies > 0)
+		return;
+
+	g_ptr_array_unref(plugin_instance->proxy_reqs);
+	plugin_instance->proxy_reqs = NULL;
+	g_object_unref(plugin_instance->cancellable);
+	plugin_instance->cancellable = NULL;
+
+	prv_continue_sync_in(plugin_instance, plugin_instance->proxies_err);
 }
 
-static bool prv_get_context_proxies(ofono_plugin_t *plugin_instance,
-				    ofono_plugin_modem_t *modem)
+static bool prv_get_context_proxies(ofono_plugin_t *plugin_instance)
 {
-	gpointer key = NULL;
+	GHashTableIter iter;
+	gpointer key;
 	gpointer value;
+	unsigned int i;
+	ofono_plugin_modem_t *modem;
+	ofono_plugin_proxy_req_t *req;
+
+	plugin_instance->proxy_reqs =
+		g_ptr_array_new_with_free_func(prv_proxy_req_free);
+
+	for (i = 0; i < plugin_instance->active_modems->len; ++i) {
+		modem = plugin_instance->active_modems->pdata[i];
+		g_hash_table_iter_init(&iter, modem->ctxt_proxies);
+		while (g_hash_table_iter_next(&iter, &key, &value))
+			if (!value) {
+				req = g_new(ofono_plugin_proxy_req_t, 1);
+				req->plugin_instance = plugin_instance;
+				req->modem = modem;
+				req->path = g_strdup(key);
+				g_ptr_array_add(plugin_instance->proxy_reqs,
+						req);
+			}
+	}
 
-	g_hash_table_iter_init(&plugin_instance->ctx_proxy_iter,
-			       modem->ctxt_proxies);
-
-	while (g_hash_table_iter_next(&plugin_instance->ctx_proxy_iter, &key,
-				      &value)  && value)
-		key = NULL;
-	
-	if (key) {
-		plugin_instance->current_ctx_path = key;
-		plugin_instance->cancellable = g_cancellable_new();			
-		g_dbus_proxy_new_for_bus(
-			G_BUS_TYPE_SYSTEM, 
-			G_DBUS_PROXY_FLAGS_DO_NOT_LOAD_PROPERTIES,
-			NULL, 
-			OFONO_SERVER_NAME, 
-			key,
-			OFONO_CONTEXT_INTERFACE, 
-			plugin_instance->cancellable,
-			prv_context_proxy_created,
-			plugin_instance);		
+	if (plugin_instance->proxy_reqs->len == 0) {
+		g_ptr_array_unref(plugin_instance->proxy_reqs);
+		plugin_instance->proxy_reqs = NULL;
+		return false;
 	}
-	
-	return key != NULL;
+
+	PROVMAN_LOGF("Creating %u Context Proxies",
+		     plugin_instance->proxy_reqs->len);
+
+	plugin_instance->next_proxy = 0;
+	plugin_instance->proxies_err = PROVMAN_ERR_NONE;
+	plugin_instance->cancellable = g_cancellable_new();
+
+	for (i = 0; i < OFONO_MAX_PENDING_PROXIES &&
+		     i < plugin_instance->proxy_reqs->len; ++i)
+		prv_request_context_proxy(plugin_instance);
+
+	return true;
 }
 
 static bool prv_have_imsi(ofono_plugin_t *plugin_instance)
 {
 	bool have_imsi = false;
 
-	if (plugin_instance->modems) {
-		if (!plugin_instance->imsi) {
+	if (plugin_instance->modems && !plugin_instance->modems_stale) {
+		if (plugin_instance->all_modems) {
+			have_imsi = g_hash_table_size(
+				plugin_instance->modems) > 0;
+		} else if (!plugin_instance->imsi) {
 			have_imsi = plugin_instance->default_imsi != NULL;
 			if (have_imsi)
 				plugin_instance->imsi = 
@@ -757,10 +1272,27 @@ static bool prv_have_imsi(ofono_plugin_t *plugin_instance)
 	return have_imsi;	
 }
 
+static void prv_select_modems(ofono_plugin_t *plugin_instance)
+{
+	GHashTableIter iter;
+	gpointer value;
+
+	g_ptr_array_set_size(plugin_instance->active_modems, 0);
+
+	if (plugin_instance->all_modems) {
+		g_hash_table_iter_init(&iter, plugin_instance->modems);
+		while (g_hash_table_iter_next(&iter, NULL, &value))
+			g_ptr_array_add(plugin_instance->active_modems, value);
+	} else {
+		g_ptr_array_add(plugin_instance->active_modems,
+				g_hash_table_lookup(plugin_instance->modems, 
+						    plugin_instance->imsi));
+	}
+}
+
 static int prv_sync_in_step(ofono_plugin_t *plugin_instance, bool *again)
 {
 	int err = PROVMAN_ERR_NONE;
-	ofono_plugin_modem_t *modem;
 	bool recall = false;
 
 	if (plugin_instance->state == OFONO_PLUGIN_IDLE) {
@@ -778,46 +1310,14 @@ static int prv_sync_in_step(ofono_plugin_t *plugin_instance, bool *again)
 		}
 	} else if (plugin_instance->state == OFONO_PLUGIN_GETTING_MODEMS) {
 		plugin_instance->state = OFONO_PLUGIN_CONNMAN_PROXIES;
-		modem = g_hash_table_lookup(plugin_instance->modems, 
-					    plugin_instance->imsi);
-		if (modem->cm_proxy) {
-			recall = true;
-		}
-		else {
-			PROVMAN_LOGF("Creating Proxy for %s", modem->path);
-
-			plugin_instance->cancellable = g_cancellable_new();			
-			g_dbus_proxy_new_for_bus(
-				G_BUS_TYPE_SYSTEM,
-				G_DBUS_PROXY_FLAGS_DO_NOT_LOAD_PROPERTIES,
-				NULL, OFONO_SERVER_NAME, modem->path,
-				OFONO_CONNMAN_INTERFACE, 
-				plugin_instance->cancellable,
-				prv_connman_proxy_created,
-				plugin_instance);
-		}
+		prv_select_modems(plugin_instance);
+		recall = !prv_create_connman_proxies(plugin_instance);
 	} else if (plugin_instance->state == OFONO_PLUGIN_CONNMAN_PROXIES) {
 		plugin_instance->state = OFONO_PLUGIN_GET_CONTEXTS;
-		modem = g_hash_table_lookup(plugin_instance->modems, 
-					    plugin_instance->imsi);
-		if (g_hash_table_size(modem->settings) > 0) {
-			recall = true;
-		} else {
-
-			PROVMAN_LOG("Retrieving Context Settings");
-
-			plugin_instance->cancellable = g_cancellable_new();
-			g_dbus_proxy_call(modem->cm_proxy,
-					  OFONO_CONNMAN_GET_CONTEXTS,
-					  NULL, G_DBUS_CALL_FLAGS_NONE,
-					  -1, plugin_instance->cancellable,
-					  prv_get_contexts_cb, plugin_instance);
-		}
+		recall = !prv_get_contexts(plugin_instance);
 	} else if (plugin_instance->state == OFONO_PLUGIN_GET_CONTEXTS) {
-		modem = g_hash_table_lookup(plugin_instance->modems, 
-					    plugin_instance->imsi);
 		plugin_instance->state = OFONO_PLUGIN_GET_CONTEXT_PROXIES;		
-		recall = !prv_get_context_proxies(plugin_instance, modem);
+		recall = !prv_get_context_proxies(plugin_instance);
 	} else {
 
 #ifdef PROVMAN_LOGGING
@@ -858,10 +1358,12 @@ static void prv_get_modems_cb(int result, utils_ofono_handle_t handle,
 	g_hash_table_iter_init(&iter, modem_imsi);
 	
 	while (g_hash_table_iter_next(&iter, &key, &value)) {
-		if (!plugin_instance->modems ||
-		    !g_hash_table_lookup(plugin_instance->modems, key)) {
+		modem = plugin_instance->modems ?
+			g_hash_table_lookup(plugin_instance->modems, key) :
+			NULL;
+		if (!modem || strcmp(modem->path, value)) {
 
-			modem = prv_ofono_plugin_modem_new(value);
+			modem = prv_ofono_plugin_modem_new(value, key);
 			g_hash_table_insert(plugin_instance->modems,
 					    g_strdup((gchar*) key), modem);
 	
@@ -879,11 +1381,18 @@ static void prv_get_modems_cb(int result, utils_ofono_handle_t handle,
 	}
 
 	g_hash_table_unref(modem_imsi);
+	plugin_instance->modems_stale = false;
 
 	g_free(plugin_instance->default_imsi);
 	plugin_instance->default_imsi = default_imsi;
 
-	if (!plugin_instance->imsi) {
+	if (plugin_instance->all_modems) {
+		if (g_hash_table_size(plugin_instance->modems) == 0) {
+			PROVMAN_LOG("No Modems Found.");
+			err = PROVMAN_ERR_NOT_FOUND;
+			goto on_error;	
+		}
+	} else if (!plugin_instance->imsi) {
 		if (default_imsi) {
 			plugin_instance->imsi = g_strdup(default_imsi);
 		} else {
@@ -932,10 +1441,17 @@ int ofono_plugin_sync_in(provman_plugin_instance instance,
 
 	plugin_instance->sync_in_cb = callback;
 	plugin_instance->sync_in_user_data = user_data;
-	if (strlen(imsi) > 0)
+
+	/* The imsi is normally released by sync_out but sync_out is
+	   not called for sessions that do not modify any settings. */
+
+	g_free(plugin_instance->imsi);
+	plugin_instance->all_modems = !strcmp(imsi, OFONO_ALL_MODEMS);
+	if (strlen(imsi) > 0 && !plugin_instance->all_modems)
 		plugin_instance->imsi = g_strdup(imsi);
 	else
 		plugin_instance->imsi = NULL;
+	g_ptr_array_set_size(plugin_instance->active_modems, 0);
 
 	do {
 		err = prv_sync_in_step(plugin_instance, &again);
@@ -973,6 +1489,9 @@ static gboolean prv_complete_sync_out(gpointer user_data)
 	}
 	g_free(plugin_instance->imsi);
 	plugin_instance->imsi = NULL;
+	plugin_instance->all_modems = false;
+	g_ptr_array_unref(plugin_instance->chains);
+	plugin_instance->chains = NULL;
 	g_ptr_array_unref(plugin_instance->cmds);
 	plugin_instance->cmds = NULL;
 
@@ -1014,10 +1533,8 @@ static void prv_ofono_plugin_anaylse(ofono_plugin_t *plugin_instance,
 	ofono_plugin_cmd_t *cmd;
 
 	in_contexts = 
-		provman_utils_get_contexts(modem->settings, 
-					     LOCAL_KEY_CONTEXT_ROOT,
-					     sizeof(LOCAL_KEY_CONTEXT_ROOT)
-					     - 1);
+		provman_settings_tree_get_children(modem->settings,
+						   LOCAL_KEY_CONTEXT_ROOT);
 	out_contexts =
 		provman_utils_get_contexts(new_settings,
 					     LOCAL_KEY_CONTEXT_ROOT,
@@ -1026,10 +1543,6 @@ static void prv_ofono_plugin_anaylse(ofono_plugin_t *plugin_instance,
 	in_mms = modem->mms_context != NULL;
 	out_mms = prv_have_mms(new_settings);
 
-	plugin_instance->current_cmd = 0;
-	plugin_instance->cmds = 
-		g_ptr_array_new_with_free_func(prv_ofono_plugin_cmd_free);
-
 	g_hash_table_iter_init(&iter, in_contexts);
 	while (g_hash_table_iter_next(&iter, &key, NULL))
 		if (!g_hash_table_lookup_extended(out_contexts, key, NULL, NULL)) {
@@ -1064,8 +1577,9 @@ static void prv_ofono_plugin_anaylse(ofono_plugin_t *plugin_instance,
 
 	g_hash_table_iter_init(&iter, new_settings);
 	while (g_hash_table_iter_next(&iter, &key, &value)) {
-		old_value = g_hash_table_lookup(modem->settings, key);
-		if (!old_value || strcmp(value, old_value)) {
+		old_value = (gpointer) provman_settings_tree_lookup(
+			modem->settings, key);
+		if (old_value != value) {
 			cmd = g_new0(ofono_plugin_cmd_t,1);
 			cmd->type = OFONO_PLUGIN_SET;
 			cmd->path = g_strdup(key);
@@ -1074,40 +1588,295 @@ static void prv_ofono_plugin_anaylse(ofono_plugin_t *plugin_instance,
 		}
 	}
 
+	g_hash_table_unref(out_contexts);
+	g_hash_table_unref(in_contexts);
+}
+
+/*
+ * The commands produced by prv_ofono_plugin_anaylse are grouped into
+ * chains, one chain per context.  The commands of a chain are executed
+ * in order, as the SetProperty calls on a context need the proxy created
+ * by the context's AddContext command, but the chains are independent of
+ * each other and up to OFONO_MAX_PENDING_CMDS of them are executed
+ * concurrently.  The chains that delete contexts are started first, and
+ * the chains that add contexts are only started once all the deletions
+ * have completed.  All the D-Bus calls share the plugin's cancellable,
+ * which is released once the last chain completes.
+ */
+
+typedef struct ofono_plugin_chain_t_ ofono_plugin_chain_t;
+struct ofono_plugin_chain_t_ {
+	ofono_plugin_t *plugin_instance;
+	ofono_plugin_modem_t *modem;
+	GPtrArray *cmds;
+	unsigned int next;
+	ofono_plugin_cmd_t *cmd;
+	GDBusProxy *proxy;
+	gchar *ctx_path;
+};
+
+static bool prv_chain_step(ofono_plugin_chain_t *chain);
+static void prv_start_chains(ofono_plugin_t *plugin_instance);
+
+static void prv_chain_free(gpointer data)
+{
+	ofono_plugin_chain_t *chain = data;
+
+	if (chain) {
+		g_ptr_array_unref(chain->cmds);
+		g_free(chain->ctx_path);
+		g_free(chain);
+	}
+}
+
+static bool prv_is_delete_chain(ofono_plugin_chain_t *chain)
+{
+	ofono_plugin_cmd_t *cmd = chain->cmds->pdata[0];
+
+	return cmd->type == OFONO_PLUGIN_DELETE ||
+		cmd->type == OFONO_PLUGIN_DELETE_MMS;
+}
+
+static bool prv_is_add_chain(ofono_plugin_chain_t *chain)
+{
+	ofono_plugin_cmd_t *cmd = chain->cmds->pdata[0];
+
+	return cmd->type == OFONO_PLUGIN_ADD ||
+		cmd->type == OFONO_PLUGIN_ADD_MMS;
+}
+
+static gchar *prv_get_cmd_context(ofono_plugin_cmd_t *cmd)
+{
+	gchar *context;
+
+	if (cmd->type == OFONO_PLUGIN_DELETE_MMS ||
+	    cmd->type == OFONO_PLUGIN_ADD_MMS ||
+	    !strncmp(LOCAL_KEY_MMS_ROOT, cmd->path,
+		     sizeof(LOCAL_KEY_MMS_ROOT) - 1))
+		context = g_strdup(LOCAL_KEY_MMS_ROOT);
+	else if (cmd->type != OFONO_PLUGIN_SET)
+		context = g_strdup(cmd->path);
+	else {
+		context = provman_utils_get_context_from_key(
+			cmd->path, LOCAL_KEY_CONTEXT_ROOT,
+			sizeof(LOCAL_KEY_CONTEXT_ROOT) - 1);
+		if (!context)
+			context = g_strdup(cmd->path);
+	}
+
+	return context;
+}
+
+/*
+ * Groups the commands of a modem, starting at index first, into chains.
+ * The add chains are stored in adds.
+ */
+
+static void prv_ofono_plugin_make_chains(ofono_plugin_t *plugin_instance,
+					 ofono_plugin_modem_t *modem,
+					 unsigned int first, GPtrArray *adds)
+{
+	GHashTable *contexts;
+	ofono_plugin_chain_t *chain;
+	ofono_plugin_cmd_t *cmd;
+	gchar *context;
+	unsigned int i;
+
+	contexts = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+					 NULL);
+
+	for (i = first; i < plugin_instance->cmds->len; ++i) {
+		cmd = plugin_instance->cmds->pdata[i];
+		context = prv_get_cmd_context(cmd);
+		chain = g_hash_table_lookup(contexts, context);
+		if (!chain) {
+			chain = g_new0(ofono_plugin_chain_t, 1);
+			chain->plugin_instance = plugin_instance;
+			chain->modem = modem;
+			chain->cmds = g_ptr_array_new();
+			g_hash_table_insert(contexts, context, chain);
+			context = NULL;
+
+			if (cmd->type == OFONO_PLUGIN_ADD ||
+			    cmd->type == OFONO_PLUGIN_ADD_MMS)
+				g_ptr_array_add(adds, chain);
+			else
+				g_ptr_array_add(plugin_instance->chains, chain);
+		}
+		g_ptr_array_add(chain->cmds, cmd);
+		g_free(context);
+	}
+
+	g_hash_table_unref(contexts);
+}
+
+/*
+ * Returns the settings of a modem from the settings of a session that
+ * manages all the modems, i.e., the settings stored under
+ * /telephony/<imsi>/ with their keys moved to /telephony/.
+ */
+
+static GHashTable *prv_get_modem_settings(ofono_plugin_modem_t *modem,
+					  GHashTable *settings)
+{
+	GHashTable *modem_settings;
+	GHashTableIter iter;
+	gpointer key;
+	gpointer value;
+	gchar *prefix;
+	gchar *modem_key;
+	size_t prefix_len;
+
+	modem_settings = provman_utils_new_settings();
+	prefix = g_strconcat(LOCAL_KEY_TEL_ROOT, modem->imsi, "/", NULL);
+	prefix_len = strlen(prefix);
+
+	g_hash_table_iter_init(&iter, settings);
+	while (g_hash_table_iter_next(&iter, &key, &value)) {
+		if (strncmp(prefix, key, prefix_len))
+			continue;
+		modem_key = g_strconcat(LOCAL_KEY_TEL_ROOT,
+					(gchar *) key + prefix_len, NULL);
+		provman_utils_settings_insert(modem_settings, modem_key,
+					      value);
+		g_free(modem_key);
+	}
+
+	g_free(prefix);
+
+	return modem_settings;
+}
+
+/*
+ * Computes the commands needed to update each modem of the session and
+ * groups them into chains.  The chains of all the modems are executed
+ * together so the updates of the modems overlap.
+ */
+
+static void prv_ofono_plugin_plan(ofono_plugin_t *plugin_instance,
+				  GHashTable *settings)
+{
+	GPtrArray *adds;
+	GHashTable *modem_settings;
+	ofono_plugin_modem_t *modem;
+	unsigned int first;
+	unsigned int i;
+
+	plugin_instance->cmds = 
+		g_ptr_array_new_with_free_func(prv_ofono_plugin_cmd_free);
+	plugin_instance->chains = g_ptr_array_new_with_free_func(
+		prv_chain_free);
+	adds = g_ptr_array_new();
+
+	for (i = 0; i < plugin_instance->active_modems->len; ++i) {
+		modem = plugin_instance->active_modems->pdata[i];
+		if (plugin_instance->all_modems)
+			modem_settings = prv_get_modem_settings(modem,
+								settings);
+		else
+			modem_settings = g_hash_table_ref(settings);
+
+		first = plugin_instance->cmds->len;
+		prv_ofono_plugin_anaylse(plugin_instance, modem,
+					 modem_settings);
+		prv_ofono_plugin_make_chains(plugin_instance, modem, first,
+					     adds);
+
+		/* The signals for the modem are ignored while sync_out
+		   updates it, so its settings are reread at the start of
+		   the next session. */
+
+		if (plugin_instance->cmds->len > first)
+			modem->tracked = false;
+
+		g_hash_table_unref(modem_settings);
+	}
+
+	/* The add chains are moved to the end of the list so that they do
+	   not delay the chains that only modify existing contexts. */
+
+	for (i = 0; i < adds->len; ++i)
+		g_ptr_array_add(plugin_instance->chains, adds->pdata[i]);
+	g_ptr_array_free(adds, TRUE);
+
 #ifdef PROVMAN_LOGGING
 	prv_dump_tasks(plugin_instance->cmds);
 #endif
 
-	g_hash_table_unref(out_contexts);
-	g_hash_table_unref(in_contexts);
+	PROVMAN_LOGF("%u commands grouped into %u chains",
+		     plugin_instance->cmds->len, plugin_instance->chains->len);
+
+	plugin_instance->next_chain = 0;
+	plugin_instance->pending_chains = 0;
+	plugin_instance->pending_deletes = 0;
+	for (i = 0; i < plugin_instance->chains->len; ++i)
+		if (prv_is_delete_chain(plugin_instance->chains->pdata[i]))
+			++plugin_instance->pending_deletes;
+}
+
+static void prv_chain_finished(ofono_plugin_chain_t *chain)
+{
+	ofono_plugin_t *plugin_instance = chain->plugin_instance;
+
+	if (prv_is_delete_chain(chain))
+		--plugin_instance->pending_deletes;
+	--plugin_instance->pending_chains;
+
+	prv_start_chains(plugin_instance);
+}
+
+static void prv_chain_continue(ofono_plugin_chain_t *chain)
+{
+	if (chain->plugin_instance->cb_err == PROVMAN_ERR_CANCELLED ||
+	    !prv_chain_step(chain))
+		prv_chain_finished(chain);
+}
+
+static int prv_complete_cmd(ofono_plugin_chain_t *chain, GDBusProxy *proxy,
+			    GAsyncResult *result, GVariant **retvals)
+{
+	int err = PROVMAN_ERR_NONE;
+	ofono_plugin_t *plugin_instance = chain->plugin_instance;
+	GVariant *res;
+
+	res = g_dbus_proxy_call_finish(proxy, result, NULL);
+
+	if (g_cancellable_is_cancelled(plugin_instance->cancellable)) {
+		PROVMAN_LOG("Operation Cancelled");
+		err = PROVMAN_ERR_CANCELLED;
+		plugin_instance->cb_err = err;
+		goto on_error;
+	} else if (!res) {
+		PROVMAN_LOG("Operation Failed");
+		err = PROVMAN_ERR_IO;
+		goto on_error;
+	}
+
+	*retvals = res;
+	res = NULL;
+
+on_error:
+
+	if (res)
+		g_variant_unref(res);
+
+	return err;
 }
 
-static int prv_context_deleted(ofono_plugin_t *plugin_instance,
-			       ofono_plugin_modem_t *modem,
-			       GObject *source_object,
-			       GAsyncResult *result,
-			       gpointer user_data)
+static int prv_context_deleted(ofono_plugin_chain_t *chain,
+			       GAsyncResult *result)
 {
 	int err = PROVMAN_ERR_NONE;
 	GVariant *retvals;
-	bool again;
 
-	err = prv_complete_results_call(plugin_instance, modem->cm_proxy,
-					result, prv_complete_sync_out,
-					&retvals);
+	err = prv_complete_cmd(chain, chain->modem->cm_proxy, result,
+			       &retvals);
 
 	PROVMAN_LOGF("Context Delete returned with err %d", err);
 	syslog(LOG_INFO, "oFono Plugin: Context deleted with err %u", err);
 
-	if (err != PROVMAN_ERR_CANCELLED) {
-		++plugin_instance->current_cmd;
-		do 
-			prv_sync_out_step(plugin_instance, &again);
-		while (again);
-		
-		if (err == PROVMAN_ERR_NONE)
-			g_variant_unref(retvals);
-	}
+	if (err == PROVMAN_ERR_NONE)
+		g_variant_unref(retvals);
 
 	return err;
 }
@@ -1116,131 +1885,99 @@ static void prv_context_deleted_cb(GObject *source_object,
 				   GAsyncResult *result,
 				   gpointer user_data)
 {
-	ofono_plugin_t *plugin_instance = user_data;
-	ofono_plugin_modem_t *modem;
-
-	modem = g_hash_table_lookup(plugin_instance->modems, 
-				    plugin_instance->imsi);
+	ofono_plugin_chain_t *chain = user_data;
+	gchar *dir;
+
+	/* The settings of the deleted context must not be reported by
+	   the next sync_in. */
+
+	if (prv_context_deleted(chain, result) == PROVMAN_ERR_NONE) {
+		dir = g_strconcat(LOCAL_KEY_CONTEXT_ROOT, chain->cmd->path,
+				  NULL);
+		(void) provman_settings_tree_remove_dir(chain->modem->settings,
+							dir);
+		g_free(dir);
+	}
 
-	(void) prv_context_deleted(plugin_instance, modem, source_object,
-				   result, user_data);
+	prv_chain_continue(chain);
 }
 
 static void prv_mms_context_deleted_cb(GObject *source_object,
 				       GAsyncResult *result,
 				       gpointer user_data)
 {
-	ofono_plugin_t *plugin_instance = user_data;
-	ofono_plugin_modem_t *modem;
-	GHashTableIter iter;
-	ofono_plugin_spare_context_t *spare;
-	gpointer key;
-	gpointer value;
+	ofono_plugin_chain_t *chain = user_data;
 
-	modem = g_hash_table_lookup(plugin_instance->modems, 
-				    plugin_instance->imsi);
+	if (prv_context_deleted(chain, result) == PROVMAN_ERR_NONE)
+		prv_mms_context_removed(chain->modem);
 
-	if (prv_context_deleted(plugin_instance, modem, source_object, result,
-				user_data) == PROVMAN_ERR_NONE) {
-		g_free(modem->mms_context);
-		modem->mms_context = NULL;
-		if (modem->extra_mms_contexts->len > 0) {
-			spare = modem->extra_mms_contexts->pdata[0];
-			modem->mms_context = spare->ofono_ctxt_name;
-			spare->ofono_ctxt_name = NULL;
-			g_hash_table_iter_init(&iter, spare->settings);
-			while (g_hash_table_iter_next(&iter, &key, &value)) {
-				g_hash_table_iter_steal(&iter);
-				g_hash_table_insert(modem->settings, key,
-						    value);
-			}
-			g_ptr_array_remove_index(modem->extra_mms_contexts, 0);
-		}
-	}
+	prv_chain_continue(chain);
 }
 
 static void prv_context_added_complete_cb(GObject *source_object, 
 					  GAsyncResult *result,
 					  gpointer user_data)
 {
-	int err = PROVMAN_ERR_NONE;
-	ofono_plugin_t *plugin_instance = user_data;
+	ofono_plugin_chain_t *chain = user_data;
+	ofono_plugin_t *plugin_instance = chain->plugin_instance;
 	GDBusProxy *proxy;
-	ofono_plugin_modem_t *modem;
-	bool again;
 
-	err = prv_complete_proxy_call(plugin_instance, result,
-				      prv_complete_sync_out,
-				      &proxy);
-
-	if (err != PROVMAN_ERR_NONE) {
-		g_free(plugin_instance->current_ctx_path);
-		plugin_instance->current_ctx_path = NULL;
-		if (err == PROVMAN_ERR_CANCELLED)
-			goto on_error;
-	} else if (err == PROVMAN_ERR_NONE) {
-		modem = g_hash_table_lookup(plugin_instance->modems, 
-					    plugin_instance->imsi);
-		
-		g_hash_table_insert(modem->ctxt_proxies,
-				    plugin_instance->current_ctx_path,
-				    proxy);
+	proxy = g_dbus_proxy_new_finish(result, NULL);
 
-		PROVMAN_LOGF("Context Proxy Created for %s", 
-			 plugin_instance->current_ctx_path);
-		plugin_instance->current_ctx_path = NULL;
-	}
+	if (g_cancellable_is_cancelled(plugin_instance->cancellable)) {
+		PROVMAN_LOG("Operation Cancelled");
+		plugin_instance->cb_err = PROVMAN_ERR_CANCELLED;
+		if (proxy)
+			g_object_unref(proxy);
+	} else if (!proxy) {
+		PROVMAN_LOGF("Unable to create Context Proxy for %s",
+			     chain->ctx_path);
+		chain->next = chain->cmds->len;
+	} else {
+		PROVMAN_LOGF("Context Proxy Created for %s", chain->ctx_path);
 
-	++plugin_instance->current_cmd;
-	do
-		prv_sync_out_step(plugin_instance, &again);
-	while (again);
-	
-	return;
+		/* chain->ctx_path is now owned by ctxt_proxies */
 
-on_error:
+		g_hash_table_insert(chain->modem->ctxt_proxies,
+				    chain->ctx_path, proxy);
+		chain->ctx_path = NULL;
+	}
 
-	return;
+	prv_chain_continue(chain);
 }
 
-static const gchar *prv_context_added(ofono_plugin_t *plugin_instance,
-				      ofono_plugin_modem_t *modem,
-				      GObject *source_object,
-				      GAsyncResult *result,
-				      gpointer user_data)
+/*
+ * Returns the path of the new context or NULL if the context could not
+ * be created, in which case the remaining commands of the chain, which
+ * can only be SetProperty calls on the new context, are skipped.
+ */
+
+static const gchar *prv_context_added(ofono_plugin_chain_t *chain,
+				      GAsyncResult *result)
 {
 	int err = PROVMAN_ERR_NONE;
 	GVariant *retvals;
-	gchar *plugin_id;
-	bool again;
+	ofono_plugin_t *plugin_instance = chain->plugin_instance;
 	const gchar *path = NULL;
 
-	err = prv_complete_results_call(plugin_instance, modem->cm_proxy,
-					result, prv_complete_sync_out,
-					&retvals);
-	if ((err != PROVMAN_ERR_NONE) && (err != PROVMAN_ERR_CANCELLED)) {
-		++plugin_instance->current_cmd;
-		do 
-			prv_sync_out_step(plugin_instance, &again);
-		while (again);
-	} else if (err == PROVMAN_ERR_NONE) {
-		g_variant_get(retvals, "(o)", &plugin_id);
-
-		plugin_instance->cancellable = g_cancellable_new();
-
-		/* plugin_instance->current_ctx_path now owns plugin_id */
-		plugin_instance->current_ctx_path = plugin_id;
-		path = plugin_id;
+	err = prv_complete_cmd(chain, chain->modem->cm_proxy, result,
+			       &retvals);
+	if (err == PROVMAN_ERR_NONE) {
+		g_variant_get(retvals, "(o)", &chain->ctx_path);
+		path = chain->ctx_path;
 		g_dbus_proxy_new_for_bus(
 			G_BUS_TYPE_SYSTEM, 
 			G_DBUS_PROXY_FLAGS_DO_NOT_LOAD_PROPERTIES,
-			NULL, OFONO_SERVER_NAME, plugin_id,
+			NULL, OFONO_SERVER_NAME, path,
 			OFONO_CONTEXT_INTERFACE, 
 			plugin_instance->cancellable,
 			prv_context_added_complete_cb,
-			plugin_instance);
-		
+			chain);
 		g_variant_unref(retvals);
+	} else {
+		if (err != PROVMAN_ERR_CANCELLED)
+			chain->next = chain->cmds->len;
+		prv_chain_continue(chain);
 	}
 
 	return path;
@@ -1250,27 +1987,18 @@ static void prv_context_added_cb(GObject *source_object,
 				 GAsyncResult *result,
 				 gpointer user_data)
 {
-	ofono_plugin_t *plugin_instance = user_data;
-	ofono_plugin_modem_t *modem;
+	ofono_plugin_chain_t *chain = user_data;
+	ofono_plugin_t *plugin_instance = chain->plugin_instance;
 	const gchar *path;
-	ofono_plugin_cmd_t *cmd;
-
-	modem = g_hash_table_lookup(plugin_instance->modems, 
-				    plugin_instance->imsi);
-	
-	path = prv_context_added(plugin_instance, modem, source_object, result,
-				 user_data);
 
+	path = prv_context_added(chain, result);
 	if (path) {
 		syslog(LOG_INFO,"oFono Plugin: Internet Context %s added",
 			path);
 		PROVMAN_LOGF("Internet Access Point added %s",path);
-		cmd = plugin_instance->cmds->pdata[
-			plugin_instance->current_cmd];
-
 		provman_map_file_store_map(plugin_instance->map_file,
-					   plugin_instance->imsi,
-					   cmd->path, path);
+					   chain->modem->imsi,
+					   chain->cmd->path, path);
 	} else {
 		syslog(LOG_INFO,"oFono Plugin: Failed to add Internet Context");
 	}	      
@@ -1280,15 +2008,11 @@ static void prv_mms_context_added_cb(GObject *source_object,
 				     GAsyncResult *result,
 				     gpointer user_data)
 {
-	ofono_plugin_t *plugin_instance = user_data;
-	ofono_plugin_modem_t *modem;	
+	ofono_plugin_chain_t *chain = user_data;
+	ofono_plugin_modem_t *modem = chain->modem;
 	const gchar *path;
 
-	modem = g_hash_table_lookup(plugin_instance->modems, 
-				    plugin_instance->imsi);
-	
-	path = prv_context_added(plugin_instance, modem, source_object, result,
-				 user_data);
+	path = prv_context_added(chain, result);
 	if (path && !modem->mms_context) {
 		syslog(LOG_INFO,"oFono Plugin: MMS Context %s added", path);
 		PROVMAN_LOGF("MMS Access Point added %s",path);
@@ -1302,44 +2026,25 @@ static void prv_prop_set_cb(GObject *source_object,
 			    GAsyncResult *result,
 			    gpointer user_data)
 {
-	int err = PROVMAN_ERR_NONE;
+	ofono_plugin_chain_t *chain = user_data;
 	GVariant *retvals;
-	ofono_plugin_t *plugin_instance = user_data;
-	bool again;
-	ofono_plugin_modem_t *modem;
-	ofono_plugin_cmd_t *cmd;
 
-	err = prv_complete_results_call(plugin_instance, 
-					plugin_instance->current_ctx_proxy,
-					result, prv_complete_sync_out,
-					&retvals);
-
-	if (err != PROVMAN_ERR_CANCELLED) {
-		if (err == PROVMAN_ERR_NONE) {
-			modem = g_hash_table_lookup(plugin_instance->modems, 
-						    plugin_instance->imsi);
-			
-			cmd = plugin_instance->cmds->pdata[
-				plugin_instance->current_cmd];
-			
-			g_hash_table_insert(modem->settings,
-					    g_strdup(cmd->path), 
-					    g_strdup(cmd->value));
-			
-			g_variant_unref(retvals);							
-		}
-		
-		++plugin_instance->current_cmd;
-		do 
-			prv_sync_out_step(plugin_instance, &again);
-		while (again);
+	if (prv_complete_cmd(chain, chain->proxy, result, &retvals) ==
+	    PROVMAN_ERR_NONE) {
+		(void) provman_settings_tree_insert(chain->modem->settings,
+						    chain->cmd->path,
+						    chain->cmd->value);
+		g_variant_unref(retvals);
 	}
+
+	prv_chain_continue(chain);
 }
 
-static bool prv_sync_context_set_prop(ofono_plugin_t *plugin_instance,
-				      ofono_plugin_modem_t *modem,
-				      ofono_plugin_cmd_t *cmd)
+static bool prv_sync_context_set_prop(ofono_plugin_chain_t *chain)
 {
+	ofono_plugin_t *plugin_instance = chain->plugin_instance;
+	ofono_plugin_modem_t *modem = chain->modem;
+	ofono_plugin_cmd_t *cmd = chain->cmd;
 	gchar *context = NULL;
 	const char *local_prop;
 	const char *prop;
@@ -1352,6 +2057,10 @@ static bool prv_sync_context_set_prop(ofono_plugin_t *plugin_instance,
 	if (!strncmp(LOCAL_KEY_MMS_ROOT, cmd->path, mms_root_len)) {
 		plugin_id = modem->mms_context;
 		local_prop = cmd->path + mms_root_len;
+		if (!plugin_id) {
+			PROVMAN_LOG("No MMS context");
+			goto err;
+		}
 	} else {	
 		context = 
 			provman_utils_get_context_from_key(
@@ -1375,7 +2084,7 @@ static bool prv_sync_context_set_prop(ofono_plugin_t *plugin_instance,
 		ofono_context = 
 			provman_map_file_find_plugin_id(
 				plugin_instance->map_file,
-				plugin_instance->imsi,
+				modem->imsi,
 				context);
 		if (!ofono_context) {
 			PROVMAN_LOGF("Unable to locate ofono context from %s",
@@ -1419,14 +2128,13 @@ static bool prv_sync_context_set_prop(ofono_plugin_t *plugin_instance,
 
 	PROVMAN_LOGF("Setting %s=%s on Path %s", prop, value, plugin_id);
 
-	plugin_instance->current_ctx_proxy = proxy;
-	plugin_instance->cancellable = g_cancellable_new();
+	chain->proxy = proxy;
 	g_dbus_proxy_call(proxy, OFONO_SET_PROP,
 			  g_variant_new("(sv)", prop, 
 					g_variant_new_string(value)),
 			  G_DBUS_CALL_FLAGS_NONE,
 			  -1, plugin_instance->cancellable,
-			  prv_prop_set_cb, plugin_instance);
+			  prv_prop_set_cb, chain);
 
 	g_free(ofono_context);
 
@@ -1436,35 +2144,32 @@ err:
 
 	g_free(ofono_context);	
 	g_free(context);
-	++plugin_instance->current_cmd;
 
 	return false;
 }
 
-static bool prv_delete_internet_context(ofono_plugin_t *plugin_instance,
-					ofono_plugin_modem_t *modem,
-					ofono_plugin_cmd_t *cmd)
+static bool prv_delete_internet_context(ofono_plugin_chain_t *chain)
 {
+	ofono_plugin_t *plugin_instance = chain->plugin_instance;
 	bool retval = false;
 	gchar *plugin_id;
 
 	plugin_id = 
 		provman_map_file_find_plugin_id(plugin_instance->map_file,
-						plugin_instance->imsi,
-						cmd->path);
+						chain->modem->imsi,
+						chain->cmd->path);
 	if (!plugin_id)
 		goto err;
 
 	syslog(LOG_INFO, "oFono Plugin: Deleting Internet Context %s",
 	       plugin_id);
 	
-	plugin_instance->cancellable = g_cancellable_new();
-	g_dbus_proxy_call(modem->cm_proxy,
+	g_dbus_proxy_call(chain->modem->cm_proxy,
 			  OFONO_CONNMAN_REMOVE_CONTEXT,
 			  g_variant_new("(o)", plugin_id),
 			  G_DBUS_CALL_FLAGS_NONE,
 			  -1, plugin_instance->cancellable,
-			  prv_context_deleted_cb, plugin_instance);
+			  prv_context_deleted_cb, chain);
 	g_free(plugin_id);
 
 	retval = true;
@@ -1474,66 +2179,87 @@ err:
 	return retval;
 }
 
+/*
+ * Issues the next command of a chain.  Commands that cannot be issued
+ * are skipped.  Returns false if the chain has no more commands to
+ * execute.
+ */
 
-static void prv_sync_out_step(ofono_plugin_t *plugin_instance, bool *again)
+static bool prv_chain_step(ofono_plugin_chain_t *chain)
 {
-	ofono_plugin_modem_t *modem;
+	ofono_plugin_t *plugin_instance = chain->plugin_instance;
+	ofono_plugin_modem_t *modem = chain->modem;
 	ofono_plugin_cmd_t *cmd;
-	bool recall = false;
+	bool issued = false;
 
-	modem = g_hash_table_lookup(plugin_instance->modems, 
-				    plugin_instance->imsi);
-
-	if (plugin_instance->current_cmd < plugin_instance->cmds->len) {
-		cmd = plugin_instance->cmds->pdata[plugin_instance->current_cmd];
+	while (!issued && chain->next < chain->cmds->len) {
+		cmd = chain->cmds->pdata[chain->next++];
+		chain->cmd = cmd;
+		issued = true;
 		if (cmd->type == OFONO_PLUGIN_DELETE) {
-			recall = !prv_delete_internet_context(plugin_instance,
-							      modem, cmd);
+			issued = prv_delete_internet_context(chain);
 		} else if (cmd->type == OFONO_PLUGIN_DELETE_MMS) {
 			syslog(LOG_INFO,
 			       "oFono Plugin: Deleting MMS Context %s",
 			       modem->mms_context);
-			plugin_instance->cancellable = g_cancellable_new();
 			g_dbus_proxy_call(modem->cm_proxy,
 					  OFONO_CONNMAN_REMOVE_CONTEXT,
 					  g_variant_new("(o)", modem->mms_context),
 					  G_DBUS_CALL_FLAGS_NONE,
 					  -1, plugin_instance->cancellable,
-					  prv_mms_context_deleted_cb, plugin_instance);
+					  prv_mms_context_deleted_cb, chain);
 		}
 		else if (cmd->type == OFONO_PLUGIN_ADD) {
 			syslog(LOG_INFO,
 			       "oFono Plugin: Creating Internet Context");
-			plugin_instance->cancellable = g_cancellable_new();
 			g_dbus_proxy_call(modem->cm_proxy,
 					  OFONO_CONNMAN_ADD_CONTEXT,
 					  g_variant_new("(s)", "internet"),
 					  G_DBUS_CALL_FLAGS_NONE,
 					  -1, plugin_instance->cancellable,
-					  prv_context_added_cb, plugin_instance);
+					  prv_context_added_cb, chain);
 		} else if (cmd->type == OFONO_PLUGIN_ADD_MMS) {
 			syslog(LOG_INFO,
 			       "oFono Plugin: Creating MMS Context");
-			plugin_instance->cancellable = g_cancellable_new();
 			g_dbus_proxy_call(modem->cm_proxy,
 					  OFONO_CONNMAN_ADD_CONTEXT,
 					  g_variant_new("(s)", "mms"),
 					  G_DBUS_CALL_FLAGS_NONE,
 					  -1, plugin_instance->cancellable,
-					  prv_mms_context_added_cb, plugin_instance);
+					  prv_mms_context_added_cb, chain);
 		}
 		else if (cmd->type == OFONO_PLUGIN_SET) {
-			recall = !prv_sync_context_set_prop(plugin_instance,
-							    modem, cmd);
+			issued = prv_sync_context_set_prop(chain);
 		}
 	}
-	else {
-		plugin_instance->cb_err = PROVMAN_ERR_NONE;
-		plugin_instance->completion_source = 
-			g_idle_add(prv_complete_sync_out, plugin_instance);
+
+	return issued;
+}
+
+static void prv_start_chains(ofono_plugin_t *plugin_instance)
+{
+	ofono_plugin_chain_t *chain;
+
+	while (plugin_instance->cb_err == PROVMAN_ERR_NONE &&
+	       plugin_instance->pending_chains < OFONO_MAX_PENDING_CMDS &&
+	       plugin_instance->next_chain < plugin_instance->chains->len) {
+		chain = plugin_instance->chains->pdata[
+			plugin_instance->next_chain];
+		if (prv_is_add_chain(chain) &&
+		    plugin_instance->pending_deletes > 0)
+			break;
+		++plugin_instance->next_chain;
+		if (prv_chain_step(chain))
+			++plugin_instance->pending_chains;
+		else if (prv_is_delete_chain(chain))
+			--plugin_instance->pending_deletes;
 	}
 
-	*again = recall;
+	if (plugin_instance->pending_chains == 0 &&
+	    (plugin_instance->cb_err != PROVMAN_ERR_NONE ||
+	     plugin_instance->next_chain == plugin_instance->chains->len))
+		plugin_instance->completion_source = 
+			g_idle_add(prv_complete_sync_out, plugin_instance);
 }
 
 int ofono_plugin_sync_out(provman_plugin_instance instance, 
@@ -1543,12 +2269,8 @@ int ofono_plugin_sync_out(provman_plugin_instance instance,
 {
 	int err = PROVMAN_ERR_NONE;
 	ofono_plugin_t *plugin_instance = instance;
-	bool again;
-	ofono_plugin_modem_t *modem;
 
-	modem = g_hash_table_lookup(plugin_instance->modems, 
-				    plugin_instance->imsi);
-	if (!modem) {
+	if (plugin_instance->active_modems->len == 0) {
 		err = PROVMAN_ERR_NOT_FOUND;
 		goto on_error;
 	}
@@ -1560,11 +2282,11 @@ int ofono_plugin_sync_out(provman_plugin_instance instance,
 	plugin_instance->sync_out_cb = callback;
 	plugin_instance->sync_out_user_data = user_data;
 
-	prv_ofono_plugin_anaylse(plugin_instance, modem, settings);
+	prv_ofono_plugin_plan(plugin_instance, settings);
 
-	do 
-		prv_sync_out_step(plugin_instance, &again);
-	while (again);
+	plugin_instance->cb_err = PROVMAN_ERR_NONE;
+	plugin_instance->cancellable = g_cancellable_new();
+	prv_start_chains(plugin_instance);
 	
 	return PROVMAN_ERR_NONE;
 
@@ -1589,27 +2311,76 @@ static bool prv_valid_context_prop(const char *local_prop)
 		 strcmp(local_prop, LOCAL_PROP_PASSWORD));		 
 }
 
+/*
+ * In a session that manages all the modems, the keys of a modem are
+ * located under /telephony/<imsi>/.  This function returns the key
+ * that the modem's settings tree uses, or NULL if the key does not
+ * refer to a modem of the session.  Keys located outside of
+ * /telephony/ are returned unchanged.  The caller must free the
+ * returned key.
+ */
+
+static gchar *prv_get_local_key(ofono_plugin_t *plugin_instance,
+				const char *key)
+{
+	const char *imsi;
+	const char *end;
+	gchar *modem_imsi;
+	gchar *local_key = NULL;
+	size_t tel_root_len = sizeof(LOCAL_KEY_TEL_ROOT) - 1;
+
+	if (!plugin_instance->all_modems ||
+	    strncmp(LOCAL_KEY_TEL_ROOT, key, tel_root_len))
+		return g_strdup(key);
+
+	imsi = key + tel_root_len;
+	end = strchr(imsi, '/');
+	if (!end)
+		end = imsi + strlen(imsi);
+
+	modem_imsi = g_strndup(imsi, end - imsi);
+	if (g_hash_table_lookup(plugin_instance->modems, modem_imsi))
+		local_key = g_strconcat(LOCAL_KEY_TEL_ROOT, *end ? end + 1 : "",
+					NULL);
+	g_free(modem_imsi);
+
+	/* /telephony/<imsi> maps to /telephony */
+
+	if (local_key && !*end)
+		local_key[tel_root_len - 1] = 0;
+
+	return local_key;
+}
+
 int ofono_plugin_validate_set(provman_plugin_instance instance, 
 			      const char *key, const char* value)
 {
 	int err = PROVMAN_ERR_NONE;
+	ofono_plugin_t *plugin_instance = instance;
 	const char *local_prop;
 	size_t mms_root_len = sizeof(LOCAL_KEY_MMS_ROOT) - 1;
+	gchar *local_key;
+
+	local_key = prv_get_local_key(plugin_instance, key);
+	if (!local_key) {
+		err = PROVMAN_ERR_BAD_KEY;
+		goto on_error;
+	}
 
-	if (!strncmp(LOCAL_KEY_MMS_ROOT, key, mms_root_len)) {
-		local_prop = key + mms_root_len;
+	if (!strncmp(LOCAL_KEY_MMS_ROOT, local_key, mms_root_len)) {
+		local_prop = local_key + mms_root_len;
 		if (strcmp(local_prop, LOCAL_PROP_MMS_PROXY) &&
 		    strcmp(local_prop, LOCAL_PROP_MMSC) &&
 		    !prv_valid_context_prop(local_prop)) {
 			err = PROVMAN_ERR_BAD_KEY;
 			goto on_error;
 		}
-	} else if (strncmp(LOCAL_KEY_CONTEXT_ROOT, key, 
+	} else if (strncmp(LOCAL_KEY_CONTEXT_ROOT, local_key, 
 			   sizeof(LOCAL_KEY_CONTEXT_ROOT) - 1)) {
 		err = PROVMAN_ERR_BAD_KEY;
 		goto on_error;
 	} else {
-		local_prop = strrchr(key + 
+		local_prop = strrchr(local_key + 
 				     sizeof(LOCAL_KEY_CONTEXT_ROOT) - 1, '/');
 		if (!local_prop) {
 			err = PROVMAN_ERR_BAD_KEY;
@@ -1624,11 +2395,15 @@ int ofono_plugin_validate_set(provman_plugin_instance instance,
 		}
 	}
 
+	g_free(local_key);
+
 	return PROVMAN_ERR_NONE;
 
 on_error:
 
 	PROVMAN_LOGF("Unsupported key %s", key);	
+
+	g_free(local_key);
 	
 	return err;
 }
@@ -1637,25 +2412,36 @@ int ofono_plugin_validate_del(provman_plugin_instance instance,
 			      const char* key, bool *leaf)
 {
 	int err = PROVMAN_ERR_NONE;
+	ofono_plugin_t *plugin_instance = instance;
 	size_t tel_root_len = sizeof(LOCAL_KEY_TEL_ROOT) - 2;
 	size_t mms_root_len = sizeof(LOCAL_KEY_MMS_ROOT) - 2;
 	size_t contexts_root_len = sizeof(LOCAL_KEY_CONTEXT_ROOT) - 2;
-	size_t key_len = strlen(key);
+	size_t key_len;
+	gchar *local_key;
+
+	local_key = prv_get_local_key(plugin_instance, key);
+	if (!local_key) {
+		err = PROVMAN_ERR_BAD_KEY;
+		goto on_error;
+	}
+
+	key_len = strlen(local_key);
 	
 	if (key_len != tel_root_len) {
-		if (!strncmp(LOCAL_KEY_MMS_ROOT, key, mms_root_len)) {
+		if (!strncmp(LOCAL_KEY_MMS_ROOT, local_key, mms_root_len)) {
 			if (key_len != mms_root_len) {
 				err = PROVMAN_ERR_BAD_KEY;
 				goto on_error;
 			}
-		} else if (!strncmp(LOCAL_KEY_CONTEXT_ROOT, key,
+		} else if (!strncmp(LOCAL_KEY_CONTEXT_ROOT, local_key,
 				    contexts_root_len)) {
 			if (key_len > contexts_root_len) {
-				if (key[contexts_root_len] != '/')  {
+				if (local_key[contexts_root_len] != '/')  {
 					err = PROVMAN_ERR_BAD_KEY;
 					goto on_error;
 				}							
-				if (strchr(&key[contexts_root_len + 1],'/')) {
+				if (strchr(&local_key[contexts_root_len + 1],
+					   '/')) {
 					err = PROVMAN_ERR_BAD_KEY;
 					goto on_error;
 				}
@@ -1668,11 +2454,15 @@ int ofono_plugin_validate_del(provman_plugin_instance instance,
 	
 	*leaf = false;
 
+	g_free(local_key);
+
 	return PROVMAN_ERR_NONE;
 
 on_error:
 
 	PROVMAN_LOGF("Cannot delete key %s", key);	
+
+	g_free(local_key);
 	
 	return err;		
 }
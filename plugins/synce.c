@@ -125,7 +125,7 @@ typedef struct synce_plugin_t_ synce_plugin_t;
 typedef void (*session_command_t)(synce_plugin_t *);
 
 struct synce_plugin_t_ {
-	GHashTable *settings;
+	provman_settings_tree_t *settings;
 	provman_plugin_sync_in_cb sync_in_cb;
 	void *sync_in_user_data;
 	provman_plugin_sync_out_cb sync_out_cb; 
@@ -180,6 +180,7 @@ static const size_t g_synce_source_map_len =
 
 static void prv_get_config(synce_plugin_t *plugin_instance);
 static void prv_step_sync_out(synce_plugin_t *plugin_instance);
+static void prv_invalidate_settings(synce_plugin_t *plugin_instance);
 
 static void prv_g_hash_table_unref(gpointer object)
 {
@@ -198,8 +199,7 @@ int synce_plugin_new(provman_plugin_instance *instance)
 {
 	synce_plugin_t *plugin_instance = g_new0(synce_plugin_t, 1);
 
-	plugin_instance->settings = 
-		g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+	provman_settings_tree_new(&plugin_instance->settings);
 
 	*instance = plugin_instance;
 
@@ -212,8 +212,7 @@ void synce_plugin_delete(provman_plugin_instance instance)
 
 	if (instance) {
 		plugin_instance = instance;
-		if (plugin_instance->settings)
-			g_hash_table_unref(plugin_instance->settings);
+		provman_settings_tree_delete(plugin_instance->settings);
 		if (plugin_instance->accounts)
 			g_hash_table_unref(plugin_instance->accounts);
 		if (plugin_instance->cancellable)
@@ -227,7 +226,7 @@ void synce_plugin_delete(provman_plugin_instance instance)
 static gboolean prv_complete_sync_in(gpointer user_data)
 {
 	synce_plugin_t *plugin_instance = user_data;
-	GHashTable *copy = NULL;
+	provman_settings_tree_t *copy = NULL;
 
 	if (plugin_instance->cancellable) {
 		g_object_unref(plugin_instance->cancellable);
@@ -236,9 +235,9 @@ static gboolean prv_complete_sync_in(gpointer user_data)
 
 	if (plugin_instance->cb_err == PROVMAN_ERR_NONE) {
 #ifdef PROVMAN_LOGGING
-		provman_utils_dump_hash_table(plugin_instance->settings);
+		provman_settings_tree_dump(plugin_instance->settings);
 #endif	
-		copy = provman_utils_dup_settings(plugin_instance->settings);
+		copy = provman_settings_tree_snapshot(plugin_instance->settings);
 	}
 
 	plugin_instance->sync_in_cb(plugin_instance->cb_err, copy,
@@ -331,8 +330,9 @@ static void prv_add_general_param(synce_plugin_t *plugin_instance,
 	g_string_append(key, id);
 	g_string_append(key, "/");
 	g_string_append(key, prop_name);
-	g_hash_table_insert(plugin_instance->settings,
-			    g_string_free(key, FALSE), g_strdup(value));	
+	(void) provman_settings_tree_insert(plugin_instance->settings,
+					    key->str, value);
+	g_string_free(key, TRUE);
 }
 
 static void prv_add_source_param(synce_plugin_t *plugin_instance,
@@ -346,8 +346,9 @@ static void prv_add_source_param(synce_plugin_t *plugin_instance,
 	g_string_append(key, source);
 	g_string_append(key, "/");
 	g_string_append(key, prop_name);
-	g_hash_table_insert(plugin_instance->settings,
-			    g_string_free(key, FALSE), g_strdup(value));	
+	(void) provman_settings_tree_insert(plugin_instance->settings,
+					    key->str, value);
+	g_string_free(key, TRUE);
 }
 
 static void prv_map_source_settings(synce_plugin_t *plugin_instance, 
@@ -623,28 +624,24 @@ int synce_plugin_sync_in(provman_plugin_instance instance,
 	plugin_instance->sync_in_cb = callback;
 	plugin_instance->sync_in_user_data = user_data;
 
-	if (!plugin_instance->accounts) {
-		plugin_instance->accounts = 
-			g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
-					      prv_g_object_unref);	
-		
-		plugin_instance->cancellable = g_cancellable_new();
-		
-		g_dbus_proxy_new_for_bus(
-			G_BUS_TYPE_SESSION, 
-			G_DBUS_PROXY_FLAGS_DO_NOT_LOAD_PROPERTIES,
-			NULL, 
-			SYNCE_SERVER_NAME, 
-			SYNCE_SERVER_OBJECT,
-			SYNCE_SERVER_INTERFACE,
-			plugin_instance->cancellable,
-			prv_server_proxy_created,
-			plugin_instance);
-	} else {
-		plugin_instance->cb_err = PROVMAN_ERR_NONE;
-		plugin_instance->completion_source = 
-			g_idle_add(prv_complete_sync_in, plugin_instance);		
-	}
+	prv_invalidate_settings(plugin_instance);
+
+	plugin_instance->accounts = 
+		g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+				      prv_g_object_unref);	
+	
+	plugin_instance->cancellable = g_cancellable_new();
+	
+	g_dbus_proxy_new_for_bus(
+		G_BUS_TYPE_SESSION, 
+		G_DBUS_PROXY_FLAGS_DO_NOT_LOAD_PROPERTIES,
+		NULL, 
+		SYNCE_SERVER_NAME, 
+		SYNCE_SERVER_OBJECT,
+		SYNCE_SERVER_INTERFACE,
+		plugin_instance->cancellable,
+		prv_server_proxy_created,
+		plugin_instance);
 		
 	return PROVMAN_ERR_NONE;
 }
@@ -658,6 +655,31 @@ void synce_plugin_sync_in_cancel(provman_plugin_instance instance)
 		g_cancellable_cancel(plugin_instance->cancellable);
 }
 
+/*
+ * SyncEvolution offers no cheap way of telling whether its configuration
+ * has changed since the plugin last read it, so the plugin cannot provide
+ * a validation token.  Its configuration is therefore read again at the
+ * start of each sync_in, even when provman is resident.  The settings are
+ * also discarded after a sync_out, as the plugin does not record which of
+ * its changes succeeded.
+ */
+
+static void prv_invalidate_settings(synce_plugin_t *plugin_instance)
+{
+	if (plugin_instance->accounts) {
+		g_hash_table_unref(plugin_instance->accounts);
+		plugin_instance->accounts = NULL;
+	}
+
+	if (plugin_instance->server_proxy) {
+		g_object_unref(plugin_instance->server_proxy);
+		plugin_instance->server_proxy = NULL;
+	}
+
+	provman_settings_tree_delete(plugin_instance->settings);
+	provman_settings_tree_new(&plugin_instance->settings);
+}
+
 static gboolean prv_complete_sync_out(gpointer user_data)
 {
 	synce_plugin_t *plugin_instance = user_data;
@@ -667,6 +689,8 @@ static gboolean prv_complete_sync_out(gpointer user_data)
 		plugin_instance->cancellable = NULL;
 	}
 
+	prv_invalidate_settings(plugin_instance);
+
 	plugin_instance->sync_out_cb(plugin_instance->cb_err,
 				     plugin_instance->sync_out_user_data);
 
@@ -758,7 +782,7 @@ static void prv_analyse(synce_plugin_t *plugin_instance, GHashTable* new_setting
 	GHashTableIter iter;
 	gpointer key;
 	gpointer value;
-	gpointer old_value;
+	const gchar *old_value;
 	GHashTable *changed;
 	GHashTable *added;
 
@@ -773,9 +797,8 @@ static void prv_analyse(synce_plugin_t *plugin_instance, GHashTable* new_setting
 				      g_free, prv_g_hash_table_unref);
 
 	in_contexts =
-		provman_utils_get_contexts(plugin_instance->settings,
-					   LOCAL_KEY_SYNC_ROOT,
-					   sizeof(LOCAL_KEY_SYNC_ROOT) - 1);
+		provman_settings_tree_get_children(plugin_instance->settings,
+						   LOCAL_KEY_SYNC_ROOT);
 	out_contexts =
 		provman_utils_get_contexts(new_settings,
 					   LOCAL_KEY_SYNC_ROOT,
@@ -802,8 +825,9 @@ static void prv_analyse(synce_plugin_t *plugin_instance, GHashTable* new_setting
 
 	g_hash_table_iter_init(&iter, new_settings);
 	while (g_hash_table_iter_next(&iter, &key, &value)) {
-		old_value = g_hash_table_lookup(plugin_instance->settings, key);
-		if (!old_value || strcmp(value, old_value))
+		old_value = provman_settings_tree_lookup(
+			plugin_instance->settings, key);
+		if (old_value != value)
 			prv_context_changed(changed, key);
 	}
 
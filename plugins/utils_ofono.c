@@ -59,7 +59,24 @@ struct utils_ofono_modems_context_ {
 	int result;
 	GHashTable *modems;
 	GPtrArray *modem_paths;
-	unsigned int current_modem;
+	GPtrArray *imsis;
+	unsigned int pending;
+};
+
+/*
+ * The IMSI numbers of all the modems are retrieved concurrently.  Each
+ * modem has its own request, which creates a proxy for the modem's
+ * SimManager and then retrieves its properties.  The IMSI found for the
+ * modem at position index in modem_paths is stored at the same position
+ * in imsis.  pending counts the requests that have not completed.  They
+ * share the context's cancellable.
+ */
+
+typedef struct utils_ofono_sim_request_ utils_ofono_sim_request;
+struct utils_ofono_sim_request_ {
+	utils_ofono_modems_context *task_context;
+	unsigned int index;
+	GDBusProxy *proxy;
 };
 
 static void prv_utils_ofono_modems_context_free(
@@ -79,14 +96,14 @@ static void prv_utils_ofono_modems_context_free(
 
 		if (task_context->modem_paths)
 			g_ptr_array_unref(task_context->modem_paths);
+
+		if (task_context->imsis)
+			g_ptr_array_unref(task_context->imsis);
 				
 		g_free(task_context);
 	}
 }
 
-static void prv_get_sim_manager_proxy(
-			utils_ofono_modems_context *task_context);
-
 static gboolean prv_imsi_task_finished(gpointer user_data)
 {
 	utils_ofono_modems_context *task_context = user_data;
@@ -135,119 +152,154 @@ static gboolean prv_imsi_task_finished(gpointer user_data)
 	return FALSE;
 }
 
-static void prv_get_imsi_numbers(utils_ofono_modems_context *task_context)
+static void prv_sim_request_failed(utils_ofono_modems_context *task_context,
+				   int err)
 {
-	PROVMAN_LOG("Any more modems to check?");
-	PROVMAN_LOGF("current_modem %p", task_context->current_modem);
+	if (task_context->result == PROVMAN_ERR_NONE ||
+	    err == PROVMAN_ERR_CANCELLED)
+		task_context->result = err;
+}
 
-	if (task_context->current_modem == task_context->modem_paths->len) {
-		task_context->result = PROVMAN_ERR_NONE;		
-		(void) g_idle_add(prv_imsi_task_finished, task_context);
-	} else
-		prv_get_sim_manager_proxy(task_context);
+/*
+ * Once all the requests have completed, the IMSI numbers found are
+ * added to the modems table in the order in which the modems were
+ * reported by oFono, as if they had been retrieved one after the other.
+ */
+
+static void prv_sim_request_done(utils_ofono_sim_request *request)
+{
+	utils_ofono_modems_context *task_context = request->task_context;
+	unsigned int i;
+	gchar *imsi;
+
+	if (request->proxy)
+		g_object_unref(request->proxy);
+	g_free(request);
+
+	if (--task_context->pending > 0)
+		return;
+
+	if (task_context->result == PROVMAN_ERR_NONE) {
+		for (i = 0; i < task_context->imsis->len; ++i) {
+			imsi = g_ptr_array_index(task_context->imsis, i);
+			if (!imsi)
+				continue;
+			g_hash_table_insert(task_context->modems,
+					    g_strdup(imsi),
+					    g_strdup(g_ptr_array_index(
+						    task_context->modem_paths,
+						    i)));
+		}
+	}
+
+	(void) g_idle_add(prv_imsi_task_finished, task_context);
 }
 
 static void prv_get_sim_properties_cb(GObject *source_object, 
 				      GAsyncResult *result,
 				      gpointer user_data)
 {
-	utils_ofono_modems_context *task_context = user_data;
+	utils_ofono_sim_request *request = user_data;
+	utils_ofono_modems_context *task_context = request->task_context;
 	GVariant *retvals;
 	GVariant *dictionary;
 	GVariant *value;
-	gchar *imsi;
+	gchar *imsi = NULL;
 	const gchar *prop_name;
 	GVariantIter *iter;
-	gboolean found;
-	gchar *path;
 
-	retvals = g_dbus_proxy_call_finish(task_context->proxy, result, NULL);
+	retvals = g_dbus_proxy_call_finish(request->proxy, result, NULL);
 
 	if (g_cancellable_is_cancelled(task_context->cancellable)) {
 		PROVMAN_LOG("Sim Property Get Cancelled");
-		task_context->result = PROVMAN_ERR_CANCELLED;
-		(void) g_idle_add(prv_imsi_task_finished, user_data);
+		prv_sim_request_failed(task_context, PROVMAN_ERR_CANCELLED);
 	} else if (!retvals) {
-		PROVMAN_LOG("Sim Property Get Failed");
-		
-		++task_context->current_modem;
-		prv_get_imsi_numbers(task_context);
+		PROVMAN_LOGF("Sim Property Get Failed for %s",
+			     g_ptr_array_index(task_context->modem_paths,
+					       request->index));
 	} else {
 		dictionary = g_variant_get_child_value(retvals, 0);
 		iter = g_variant_iter_new(dictionary);
-		while ((found = g_variant_iter_next(iter, "{&sv}", &prop_name,
-						    &value))
-		       &&
-		       (!prop_name || strcmp(prop_name, OFONO_IMSI_PROP_NAME)));
-
+		while (g_variant_iter_next(iter, "{&sv}", &prop_name,
+					   &value)) {
+			if (!imsi && !strcmp(prop_name, OFONO_IMSI_PROP_NAME))
+				g_variant_get(value, "s", &imsi);
+			g_variant_unref(value);
+		}
 		g_variant_iter_free(iter);
+		g_variant_unref(dictionary);
 
-		if (found && value) {
-			g_variant_get(value, "s", &imsi);			
+		if (imsi) {
 			PROVMAN_LOGF("Found IMSI: %s", imsi);
-			path = g_strdup(g_ptr_array_index(
-						task_context->modem_paths,
-						task_context->current_modem));
-
-			g_hash_table_insert(task_context->modems, imsi, path);
+			g_ptr_array_index(task_context->imsis,
+					  request->index) = imsi;
 		}
-
-		++task_context->current_modem;
-		
-		prv_get_imsi_numbers(task_context);
 	}
+
+	if (retvals)
+		g_variant_unref(retvals);
+
+	prv_sim_request_done(request);
 }
 
 static void prv_sim_manager_proxy_created(GObject *source_object, 
 					  GAsyncResult *result,
 					  gpointer user_data)
 {
-	utils_ofono_modems_context *task_context = user_data;
+	utils_ofono_sim_request *request = user_data;
+	utils_ofono_modems_context *task_context = request->task_context;
 
-	task_context->proxy = g_dbus_proxy_new_finish(result, NULL);
+	request->proxy = g_dbus_proxy_new_finish(result, NULL);
 
 	if (g_cancellable_is_cancelled(task_context->cancellable)) {
 		PROVMAN_LOG("SIM Manager Proxy creation Cancelled");
-		task_context->result = PROVMAN_ERR_CANCELLED;
-		(void) g_idle_add(prv_imsi_task_finished, user_data);
-	} else if (!task_context->proxy) {
+		prv_sim_request_failed(task_context, PROVMAN_ERR_CANCELLED);
+		prv_sim_request_done(request);
+	} else if (!request->proxy) {
 		PROVMAN_LOG("Unable to create SIM Manager Proxy");
-		task_context->result = PROVMAN_ERR_IO;
-		(void) g_idle_add(prv_imsi_task_finished, user_data);
+		prv_sim_request_failed(task_context, PROVMAN_ERR_IO);
+		prv_sim_request_done(request);
 	} else {
 		PROVMAN_LOG("Invoking SimManager.GetProperties");
 
-		g_object_unref(task_context->cancellable);
-
-		task_context->cancellable = g_cancellable_new();
-
-		g_dbus_proxy_call(task_context->proxy,
+		g_dbus_proxy_call(request->proxy,
 				  OFONO_SIM_MANAGER_GET_PROPERTIES,
 				  NULL, G_DBUS_CALL_FLAGS_NONE,
 				  -1, task_context->cancellable,
 				  prv_get_sim_properties_cb,
-				  task_context);
+				  request);
 	}
 }
 
-static void prv_get_sim_manager_proxy(utils_ofono_modems_context *task_context)
+static void prv_get_imsi_numbers(utils_ofono_modems_context *task_context)
 {
-	const gchar *path;
-
-	g_object_unref(task_context->cancellable);
-	task_context->cancellable = g_cancellable_new();
-	g_object_unref(task_context->proxy);
-	task_context->proxy = NULL;
+	utils_ofono_sim_request *request;
+	unsigned int count = task_context->modem_paths->len;
+	unsigned int i;
 
-	path = g_ptr_array_index(task_context->modem_paths,
-				 task_context->current_modem);
+	if (count == 0) {
+		(void) g_idle_add(prv_imsi_task_finished, task_context);
+		return;
+	}
 
-	g_dbus_proxy_new_for_bus(G_BUS_TYPE_SYSTEM, 
-				 G_DBUS_PROXY_FLAGS_DO_NOT_LOAD_PROPERTIES,
-				 NULL, OFONO_SERVER_NAME, path,
-				 OFONO_SIM_MANAGER_INTERFACE, 
-				 task_context->cancellable,
-				 prv_sim_manager_proxy_created, task_context);
+	task_context->imsis = g_ptr_array_new_with_free_func(g_free);
+	g_ptr_array_set_size(task_context->imsis, count);
+	task_context->pending = count;
+
+	for (i = 0; i < count; ++i) {
+		request = g_new0(utils_ofono_sim_request, 1);
+		request->task_context = task_context;
+		request->index = i;
+
+		g_dbus_proxy_new_for_bus(
+			G_BUS_TYPE_SYSTEM, 
+			G_DBUS_PROXY_FLAGS_DO_NOT_LOAD_PROPERTIES,
+			NULL, OFONO_SERVER_NAME,
+			g_ptr_array_index(task_context->modem_paths, i),
+			OFONO_SIM_MANAGER_INTERFACE, 
+			task_context->cancellable,
+			prv_sim_manager_proxy_created, request);
+	}
 }
 
 static void prv_get_modems_cb(GObject *source_object, GAsyncResult *result,
@@ -284,10 +336,9 @@ static void prv_get_modems_cb(GObject *source_object, GAsyncResult *result,
 
 		g_variant_iter_free(iter);
 
-		PROVMAN_LOGF("Found %d modem(s)", 
-			 g_hash_table_size(task_context->modems));
+		PROVMAN_LOGF("Found %u modem(s)", 
+			     task_context->modem_paths->len);
 
-		task_context->current_modem = 0;			 
 		prv_get_imsi_numbers(task_context);
 	}
 }
@@ -0,0 +1,360 @@
+/*
+ * Provman
+ *
+ * Copyright (C) 2011 Intel Corporation. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ *
+ *
+ * Mark Ryan <mark.d.ryan@intel.com>
+ *
+ */
+
+
+/*!
+ * @file bulk.c
+ *
+ * @brief contains functions for exchanging large sets of settings over
+ *        file descriptors
+ *
+ *****************************************************************************/
+
+#include "config.h"
+
+#include <stdbool.h>
+#include <string.h>
+
+#include <glib.h>
+
+#include "error.h"
+#include "log.h"
+
+#include "plugin_manager.h"
+#include "bulk.h"
+
+#define PROVMAN_BULK_CHUNK (64 * 1024)
+#define PROVMAN_BULK_MAX_STRING (1024 * 1024)
+
+/*
+ * The stream is read in chunks from a watch on the main loop, so that
+ * the main loop can process other events while a large import is in
+ * progress.  Records are parsed in place.  Any incomplete record at the
+ * end of a chunk is kept in buffer until the next chunk arrives.
+ */
+
+typedef struct prv_import_t_ prv_import_t;
+struct prv_import_t_ {
+	GIOChannel *channel;
+	guint watch_id;
+	GByteArray *buffer;
+	provman_bulk_record_cb_t record_cb;
+	provman_bulk_finished_cb_t finished_cb;
+	void *user_data;
+};
+
+static void prv_import_delete(prv_import_t *import)
+{
+	if (import->watch_id)
+		(void) g_source_remove(import->watch_id);
+	if (import->channel)
+		g_io_channel_unref(import->channel);
+	g_byte_array_unref(import->buffer);
+	g_free(import);
+}
+
+static bool prv_get_string(GByteArray *buffer, gsize *offset,
+			   const gchar **str, int *err)
+{
+	guint32 len;
+	const guint8 *data;
+	gsize avail = buffer->len - *offset;
+
+	if (avail < sizeof(len))
+		return false;
+
+	memcpy(&len, buffer->data + *offset, sizeof(len));
+	len = GUINT32_FROM_BE(len);
+	if (len > PROVMAN_BULK_MAX_STRING) {
+		*err = PROVMAN_ERR_CORRUPT;
+		return false;
+	}
+
+	if (avail - sizeof(len) < (gsize) len + 1)
+		return false;
+
+	data = buffer->data + *offset + sizeof(len);
+	if (data[len] != 0 || memchr(data, 0, len)) {
+		*err = PROVMAN_ERR_CORRUPT;
+		return false;
+	}
+
+	*str = (const gchar *) data;
+	*offset += sizeof(len) + len + 1;
+
+	return true;
+}
+
+static int prv_parse(prv_import_t *import)
+{
+	int err = PROVMAN_ERR_NONE;
+	gsize offset = 0;
+	gsize next;
+	const gchar *key;
+	const gchar *value;
+
+	for (;;) {
+		next = offset;
+		if (!prv_get_string(import->buffer, &next, &key, &err) ||
+		    !prv_get_string(import->buffer, &next, &value, &err))
+			break;
+		import->record_cb(key, value, import->user_data);
+		offset = next;
+	}
+
+	g_byte_array_remove_range(import->buffer, 0, offset);
+
+	return err;
+}
+
+static gboolean prv_read_cb(GIOChannel *source, GIOCondition condition,
+			    gpointer user_data)
+{
+	prv_import_t *import = user_data;
+	int err = PROVMAN_ERR_NONE;
+	GIOStatus status;
+	gsize read = 0;
+	guint len;
+
+	len = import->buffer->len;
+	g_byte_array_set_size(import->buffer, len + PROVMAN_BULK_CHUNK);
+	status = g_io_channel_read_chars(source,
+					 (gchar *) import->buffer->data + len,
+					 PROVMAN_BULK_CHUNK, &read, NULL);
+	g_byte_array_set_size(import->buffer, len + read);
+
+	if (status == G_IO_STATUS_AGAIN)
+		return TRUE;
+
+	if (status == G_IO_STATUS_ERROR) {
+		err = PROVMAN_ERR_READ;
+	} else {
+		err = prv_parse(import);
+		if (err == PROVMAN_ERR_NONE && status == G_IO_STATUS_EOF &&
+		    import->buffer->len > 0)
+			err = PROVMAN_ERR_CORRUPT;
+	}
+
+	if (err == PROVMAN_ERR_NONE && status != G_IO_STATUS_EOF)
+		return TRUE;
+
+	PROVMAN_LOGF("Import finished with error %d", err);
+
+	import->watch_id = 0;
+	import->finished_cb(err, import->user_data);
+	prv_import_delete(import);
+
+	return FALSE;
+}
+
+int provman_bulk_import(gint fd, provman_bulk_record_cb_t record_cb,
+			provman_bulk_finished_cb_t finished_cb,
+			void *user_data)
+{
+	int err = PROVMAN_ERR_NONE;
+	prv_import_t *retval = g_new0(prv_import_t, 1);
+
+	retval->buffer = g_byte_array_sized_new(PROVMAN_BULK_CHUNK);
+	retval->record_cb = record_cb;
+	retval->finished_cb = finished_cb;
+	retval->user_data = user_data;
+
+	retval->channel = g_io_channel_unix_new(fd);
+	g_io_channel_set_close_on_unref(retval->channel, TRUE);
+
+	if (g_io_channel_set_encoding(retval->channel, NULL, NULL) !=
+	    G_IO_STATUS_NORMAL) {
+		err = PROVMAN_ERR_IO;
+		goto on_error;
+	}
+
+	if (g_io_channel_set_flags(retval->channel, G_IO_FLAG_NONBLOCK, NULL) !=
+	    G_IO_STATUS_NORMAL) {
+		err = PROVMAN_ERR_IO;
+		goto on_error;
+	}
+
+	retval->watch_id = g_io_add_watch(retval->channel,
+					  G_IO_IN | G_IO_HUP | G_IO_ERR,
+					  prv_read_cb, retval);
+
+	return err;
+
+on_error:
+
+	prv_import_delete(retval);
+
+	return err;
+}
+
+static void prv_append_string(GByteArray *buffer, const gchar *str)
+{
+	guint32 len = strlen(str);
+	guint32 be_len = GUINT32_TO_BE(len);
+
+	g_byte_array_append(buffer, (const guint8 *) &be_len, sizeof(be_len));
+	g_byte_array_append(buffer, (const guint8 *) str, len + 1);
+}
+
+typedef struct prv_encode_t_ prv_encode_t;
+struct prv_encode_t_ {
+	GByteArray *buffer;
+	guint count;
+};
+
+static void prv_encode_setting(const gchar *key, const gchar *value,
+			       void *user_data)
+{
+	prv_encode_t *encode = user_data;
+
+	prv_append_string(encode->buffer, key);
+	prv_append_string(encode->buffer, value);
+	++encode->count;
+}
+
+GByteArray *provman_bulk_encode(provman_settings_tree_t **trees,
+				const gchar *prefix, guint *count)
+{
+	prv_encode_t encode;
+
+	encode.buffer = g_byte_array_sized_new(PROVMAN_BULK_CHUNK);
+	encode.count = 0;
+
+	plugin_manager_snapshot_foreach(trees, prefix, prv_encode_setting,
+					&encode);
+
+	PROVMAN_LOGF("Encoded %u settings under %s in %u bytes",
+		     encode.count, prefix, encode.buffer->len);
+
+	*count = encode.count;
+
+	return encode.buffer;
+}
+
+/*
+ * The encoded settings are written from a watch on the main loop, so
+ * that a client that does not read its end of the file descriptor only
+ * delays its own Export call.  offset is the number of bytes of buffer
+ * that have already been written.
+ */
+
+typedef struct prv_export_t_ prv_export_t;
+struct prv_export_t_ {
+	GIOChannel *channel;
+	guint watch_id;
+	GByteArray *buffer;
+	gsize offset;
+	provman_bulk_finished_cb_t finished_cb;
+	void *user_data;
+};
+
+static void prv_export_delete(prv_export_t *export)
+{
+	if (export->watch_id)
+		(void) g_source_remove(export->watch_id);
+	if (export->channel)
+		g_io_channel_unref(export->channel);
+	g_byte_array_unref(export->buffer);
+	g_free(export);
+}
+
+static gboolean prv_write_cb(GIOChannel *source, GIOCondition condition,
+			     gpointer user_data)
+{
+	prv_export_t *export = user_data;
+	int err = PROVMAN_ERR_NONE;
+	GIOStatus status;
+	gsize written = 0;
+	gsize len;
+
+	if (condition & (G_IO_HUP | G_IO_ERR | G_IO_NVAL)) {
+		err = PROVMAN_ERR_WRITE;
+		goto on_error;
+	}
+
+	len = MIN(export->buffer->len - export->offset, PROVMAN_BULK_CHUNK);
+	status = g_io_channel_write_chars(
+		source, (const gchar *) export->buffer->data + export->offset,
+		len, &written, NULL);
+	export->offset += written;
+
+	if (status == G_IO_STATUS_ERROR) {
+		err = PROVMAN_ERR_WRITE;
+		goto on_error;
+	}
+
+	if (export->offset < export->buffer->len)
+		return TRUE;
+
+on_error:
+
+	PROVMAN_LOGF("Export finished with error %d", err);
+
+	export->watch_id = 0;
+	export->finished_cb(err, export->user_data);
+	prv_export_delete(export);
+
+	return FALSE;
+}
+
+int provman_bulk_export(gint fd, GByteArray *buffer,
+			provman_bulk_finished_cb_t finished_cb,
+			void *user_data)
+{
+	int err = PROVMAN_ERR_NONE;
+	prv_export_t *retval = g_new0(prv_export_t, 1);
+
+	retval->buffer = buffer;
+	retval->finished_cb = finished_cb;
+	retval->user_data = user_data;
+
+	retval->channel = g_io_channel_unix_new(fd);
+	g_io_channel_set_close_on_unref(retval->channel, TRUE);
+
+	if (g_io_channel_set_encoding(retval->channel, NULL, NULL) !=
+	    G_IO_STATUS_NORMAL) {
+		err = PROVMAN_ERR_IO;
+		goto on_error;
+	}
+
+	g_io_channel_set_buffered(retval->channel, FALSE);
+
+	if (g_io_channel_set_flags(retval->channel, G_IO_FLAG_NONBLOCK, NULL) !=
+	    G_IO_STATUS_NORMAL) {
+		err = PROVMAN_ERR_IO;
+		goto on_error;
+	}
+
+	retval->watch_id = g_io_add_watch(retval->channel,
+					  G_IO_OUT | G_IO_HUP | G_IO_ERR,
+					  prv_write_cb, retval);
+
+	return err;
+
+on_error:
+
+	prv_export_delete(retval);
+
+	return err;
+}
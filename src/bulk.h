@@ -0,0 +1,92 @@
+/*
+ * Provman
+ *
+ * Copyright (C) 2011 Intel Corporation. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ *
+ *
+ * Mark Ryan <mark.d.ryan@intel.com>
+ *
+ */
+
+
+/*!
+ * @file bulk.h
+ *
+ * @brief contains functions for exchanging large sets of settings over
+ *        file descriptors
+ *
+ * Settings are exchanged as a stream of records.  Each record consists of
+ * a key followed by its value.  Each string is encoded as a 32 bit big
+ * endian length, followed by the bytes of the string and a terminating
+ * nul byte, which is not included in the length.  The stream ends when
+ * the end of the file is reached.
+ *
+ *****************************************************************************/
+
+#ifndef PROVMAN_BULK_H
+#define PROVMAN_BULK_H
+
+#include <glib.h>
+
+#include "settings_tree.h"
+
+/*
+ * Called on the main loop thread for each record read from the stream.
+ * key and value are only valid for the duration of the call.
+ */
+
+typedef void (*provman_bulk_record_cb_t)(const gchar *key, const gchar *value,
+					 void *user_data);
+
+/*
+ * Called once the end of the stream has been reached or an error has
+ * occurred.
+ */
+
+typedef void (*provman_bulk_finished_cb_t)(int result, void *user_data);
+
+/*
+ * Reads settings from fd asynchronously.  provman_bulk_import takes
+ * ownership of fd and closes it once the import has finished, or
+ * straight away if the import cannot be started.
+ */
+
+int provman_bulk_import(gint fd, provman_bulk_record_cb_t record_cb,
+			provman_bulk_finished_cb_t finished_cb,
+			void *user_data);
+
+/*
+ * Encodes the settings under prefix in the snapshot trees into a new
+ * buffer, which the caller must release with g_byte_array_unref.  Like
+ * plugin_manager_snapshot_foreach, it can be called on any thread.
+ */
+
+GByteArray *provman_bulk_encode(provman_settings_tree_t **trees,
+				const gchar *prefix, guint *count);
+
+/*
+ * Writes buffer to fd asynchronously from the main loop.
+ * provman_bulk_export takes ownership of fd and buffer.  fd is closed
+ * once the export has finished, or straight away if the export cannot
+ * be started, in which case finished_cb is not called.
+ */
+
+int provman_bulk_export(gint fd, GByteArray *buffer,
+			provman_bulk_finished_cb_t finished_cb,
+			void *user_data);
+
+#endif
@@ -0,0 +1,196 @@
+/*
+ * Provman
+ *
+ * Copyright (C) 2011 Intel Corporation. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ *
+ *
+ * Mark Ryan <mark.d.ryan@intel.com>
+ *
+ */
+
+
+/*!
+ * @file dispatch.c
+ *
+ * @brief contains functions for running work on a pool of dispatch threads
+ *
+ *****************************************************************************/
+
+#include "config.h"
+
+#include <stdbool.h>
+#include <glib.h>
+
+#include "error.h"
+#include "log.h"
+
+#include "dispatch.h"
+
+typedef struct prv_job_t_ prv_job_t;
+struct prv_job_t_ {
+	prv_job_t *next;
+	provman_dispatch_work_t work;
+	provman_dispatch_done_t done;
+	void *data;
+};
+
+/*
+ * Completed jobs are handed back to the main loop through a lock free
+ * multiple producer, single consumer queue.  The dispatch threads push
+ * jobs onto the head of a singly linked list with a compare and swap.
+ * The main loop takes the entire list in one go by swapping the head
+ * with NULL and then reverses it to recover the order in which the jobs
+ * completed.  As the consumer never removes individual jobs, the list is
+ * not subject to the ABA problem.  The thread that pushes a job onto an
+ * empty list schedules the main loop to drain it.
+ */
+
+struct provman_dispatch_t_ {
+	GThreadPool *pool;
+	volatile gpointer completed;
+};
+
+static bool prv_push_completed(provman_dispatch_t *dispatch, prv_job_t *job)
+{
+	prv_job_t *head;
+
+	do {
+		head = g_atomic_pointer_get(&dispatch->completed);
+		job->next = head;
+	} while (!g_atomic_pointer_compare_and_exchange(&dispatch->completed,
+							head, job));
+
+	return head == NULL;
+}
+
+static prv_job_t *prv_pop_completed(provman_dispatch_t *dispatch)
+{
+	prv_job_t *head;
+	prv_job_t *fifo = NULL;
+	prv_job_t *next;
+
+	do {
+		head = g_atomic_pointer_get(&dispatch->completed);
+	} while (head &&
+		 !g_atomic_pointer_compare_and_exchange(&dispatch->completed,
+							head, NULL));
+
+	while (head) {
+		next = head->next;
+		head->next = fifo;
+		fifo = head;
+		head = next;
+	}
+
+	return fifo;
+}
+
+static void prv_run_done(provman_dispatch_t *dispatch)
+{
+	prv_job_t *job;
+	prv_job_t *next;
+
+	job = prv_pop_completed(dispatch);
+	while (job) {
+		next = job->next;
+		job->done(job->data);
+		g_free(job);
+		job = next;
+	}
+}
+
+static gboolean prv_drain(gpointer user_data)
+{
+	prv_run_done(user_data);
+
+	return FALSE;
+}
+
+static void prv_work(gpointer data, gpointer user_data)
+{
+	prv_job_t *job = data;
+	provman_dispatch_t *dispatch = user_data;
+
+	job->work(job->data);
+
+	if (prv_push_completed(dispatch, job))
+		(void) g_idle_add(prv_drain, dispatch);
+}
+
+int provman_dispatch_new(unsigned int threads, provman_dispatch_t **dispatch)
+{
+	int err = PROVMAN_ERR_NONE;
+	provman_dispatch_t *retval = g_new0(provman_dispatch_t, 1);
+
+	/* With no threads all work is performed synchronously by
+	   provman_dispatch_push. */
+
+	if (threads > 0) {
+		retval->pool = g_thread_pool_new(prv_work, retval, threads,
+						 FALSE, NULL);
+		if (!retval->pool) {
+			err = PROVMAN_ERR_UNKNOWN;
+			goto on_error;
+		}
+	}
+
+	PROVMAN_LOGF("Created %u dispatch threads", threads);
+
+	*dispatch = retval;
+
+	return err;
+
+on_error:
+
+	g_free(retval);
+
+	return err;
+}
+
+void provman_dispatch_push(provman_dispatch_t *dispatch,
+			   provman_dispatch_work_t work,
+			   provman_dispatch_done_t done, void *data)
+{
+	prv_job_t *job;
+
+	if (!dispatch->pool) {
+		work(data);
+		done(data);
+	} else {
+		job = g_new0(prv_job_t, 1);
+		job->work = work;
+		job->done = done;
+		job->data = data;
+		g_thread_pool_push(dispatch->pool, job, NULL);
+	}
+}
+
+void provman_dispatch_delete(provman_dispatch_t *dispatch)
+{
+	if (dispatch) {
+		if (dispatch->pool) {
+
+			/* Wait for the outstanding jobs to complete and then
+			   run their done functions ourselves. */
+
+			g_thread_pool_free(dispatch->pool, FALSE, TRUE);
+			(void) g_source_remove_by_user_data(dispatch);
+			prv_run_done(dispatch);
+		}
+		g_free(dispatch);
+	}
+}
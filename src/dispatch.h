@@ -0,0 +1,68 @@
+/*
+ * Provman
+ *
+ * Copyright (C) 2011 Intel Corporation. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ *
+ *
+ * Mark Ryan <mark.d.ryan@intel.com>
+ *
+ */
+
+
+/*!
+ * @file dispatch.h
+ *
+ * @brief contains functions for running work on a pool of dispatch threads
+ *
+ * Provman's plugins, caches and task queue are only ever accessed from the
+ * thread that runs the main loop.  Work that does not touch any of these,
+ * such as decoding the parameters of a method call or serializing its
+ * reply, can be handed to a dispatch thread instead, so that the main
+ * loop remains responsive while large requests are processed.
+ *
+ * The intern pool is not locked either.  Work functions may read the
+ * settings trees and interned strings they are given, but they must not
+ * intern strings or take or release references to them.  In particular,
+ * they must not call provman_utils_intern, provman_settings_tree_insert,
+ * provman_utils_dup_settings or free a settings tree.  Such calls belong
+ * in the done function, which runs on the main loop thread.
+ *
+ *****************************************************************************/
+
+#ifndef PROVMAN_DISPATCH_H
+#define PROVMAN_DISPATCH_H
+
+typedef struct provman_dispatch_t_ provman_dispatch_t;
+
+/*
+ * A work function is called on a dispatch thread.  Once it has returned
+ * the corresponding done function is called on the main loop thread.
+ * Done functions are called in the order in which their work functions
+ * complete.  This is not necessarily the order in which the work was
+ * pushed.
+ */
+
+typedef void (*provman_dispatch_work_t)(void *data);
+typedef void (*provman_dispatch_done_t)(void *data);
+
+int provman_dispatch_new(unsigned int threads, provman_dispatch_t **dispatch);
+void provman_dispatch_push(provman_dispatch_t *dispatch,
+			   provman_dispatch_work_t work,
+			   provman_dispatch_done_t done, void *data);
+void provman_dispatch_delete(provman_dispatch_t *dispatch);
+
+#endif
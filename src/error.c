@@ -59,6 +59,12 @@ const gchar* provman_err_to_dbus(int error)
 	case PROVMAN_ERR_BAD_ARGS:
 		err_str = PROVMAN_DBUS_ERR_BAD_ARGS;
 		break;
+	case PROVMAN_ERR_EXPIRED:
+		err_str = PROVMAN_DBUS_ERR_EXPIRED;
+		break;
+	case PROVMAN_ERR_CONFLICT:
+		err_str = PROVMAN_DBUS_ERR_CONFLICT;
+		break;
 	case PROVMAN_ERR_UNKNOWN:
 	default:
 		err_str = PROVMAN_DBUS_ERR_UNKNOWN;
@@ -43,7 +43,8 @@ provman_plugin g_provman_plugins[] = {
 	  ofono_plugin_new, ofono_plugin_delete, 
 	  ofono_plugin_sync_in, ofono_plugin_sync_in_cancel,
 	  ofono_plugin_sync_out, ofono_plugin_sync_out_cancel,
-	  ofono_plugin_validate_set, ofono_plugin_validate_del
+	  ofono_plugin_validate_set, ofono_plugin_validate_del,
+	  NULL
 	}
 #endif
 };
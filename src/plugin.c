@@ -96,53 +96,189 @@ const provman_plugin *provman_plugin_get(unsigned int i)
 		&g_provman_plugins[i] : NULL;
 }
 
-int provman_plugin_find_index(const char *uri, unsigned int *index)
+/*
+ * The plugin roots are compiled into a trie of key segments the first
+ * time a key needs to be dispatched, so that the plugin that owns a key
+ * can be located with a single pass over the key.  Each node of the trie
+ * represents one segment.  The node representing the last segment of a
+ * root, ignoring its trailing '/', stores the index of the plugin.  The
+ * segments are not copied.  They point into the roots of the plugins.
+ */
+
+typedef struct prv_root_node_t_ prv_root_node_t;
+struct prv_root_node_t_ {
+	const char *segment;
+	unsigned int segment_len;
+	int index;
+	GPtrArray *children;
+};
+
+static prv_root_node_t *g_root_trie;
+
+static prv_root_node_t *prv_root_node_new(const char *segment,
+					  unsigned int segment_len)
+{
+	prv_root_node_t *node = g_new0(prv_root_node_t, 1);
+
+	node->segment = segment;
+	node->segment_len = segment_len;
+	node->index = -1;
+	node->children = g_ptr_array_new();
+
+	return node;
+}
+
+static prv_root_node_t *prv_root_node_find(prv_root_node_t *node,
+					   const char *segment,
+					   unsigned int segment_len)
 {
-	unsigned int i = 0;
-	provman_plugin *plugin;
+	unsigned int i;
+	prv_root_node_t *child;
 
-	unsigned int plugin_uri_len = 0;
+	for (i = 0; i < node->children->len; ++i) {
+		child = g_ptr_array_index(node->children, i);
+		if (child->segment_len == segment_len &&
+		    !strncmp(child->segment, segment, segment_len))
+			return child;
+	}
+
+	return NULL;
+}
+
+static unsigned int prv_segment_len(const char *segment)
+{
+	const char *end = strchr(segment, '/');
+
+	return end ? end - segment : strlen(segment);
+}
+
+static prv_root_node_t *prv_get_root_trie(void)
+{
+	unsigned int i;
+	prv_root_node_t *node;
+	prv_root_node_t *child;
+	const char *root;
+	unsigned int segment_len;
+
+	if (g_root_trie)
+		goto done;
+
+	g_root_trie = prv_root_node_new(NULL, 0);
 
 	for (i = 0; i < g_provman_plugins_count; ++i) {
-		plugin = &g_provman_plugins[i];
-		plugin_uri_len = strlen(plugin->root);
+		node = g_root_trie;
+		root = g_provman_plugins[i].root;
+		for (;;) {
+			segment_len = prv_segment_len(root);
+			child = prv_root_node_find(node, root, segment_len);
+			if (!child) {
+				child = prv_root_node_new(root, segment_len);
+				g_ptr_array_add(node->children, child);
+			}
+			node = child;
+			root += segment_len;
+			if (root[0] == 0 || (root[0] == '/' && root[1] == 0))
+				break;
+			++root;
+		}
+		node->index = i;
+	}
 
-		if ((plugin_uri_len == strlen(uri) + 1)
-		    && !strncmp(plugin->root, uri, plugin_uri_len - 1)) {
-			*index = i;
-			break;
-		} else if (strstr(uri, plugin->root)) {
-			*index = i;
+done:
+
+	return g_root_trie;
+}
+
+/*
+ * Walks the trie along the segments of uri, ignoring any trailing '/'.
+ * Returns the node representing the last segment of uri or the first
+ * node that identifies a plugin root, whichever comes first.  complete
+ * is set to true in the first case.  NULL is returned if uri is neither
+ * located under a plugin root nor a parent of one.
+ */
+
+static prv_root_node_t *prv_walk_root_trie(const char *uri, bool *complete)
+{
+	prv_root_node_t *node = prv_get_root_trie();
+	prv_root_node_t *child;
+	unsigned int i;
+
+	for (;;) {
+		for (i = 0; i < node->children->len; ++i) {
+			child = g_ptr_array_index(node->children, i);
+			if (!strncmp(child->segment, uri, child->segment_len) &&
+			    (uri[child->segment_len] == '/' ||
+			     uri[child->segment_len] == 0))
+				break;
+		}
+
+		if (i == node->children->len) {
+			node = NULL;
 			break;
 		}
+
+		node = child;
+		uri += node->segment_len;
+		*complete = uri[0] == 0 || (uri[0] == '/' && uri[1] == 0);
+		if (*complete || node->index != -1)
+			break;
+		++uri;
 	}
 
-	return i < g_provman_plugins_count ? PROVMAN_ERR_NONE : 
-		PROVMAN_ERR_NOT_FOUND;
+	return node;
+}
+
+/*
+ * A uri belongs to a plugin if the plugin's root is a prefix of the uri
+ * or if the uri is equal to the plugin's root minus its trailing '/'.
+ */
+
+int provman_plugin_find_index(const char *uri, unsigned int *index)
+{
+	int err = PROVMAN_ERR_NONE;
+	prv_root_node_t *node;
+	bool complete;
+
+	node = prv_walk_root_trie(uri, &complete);
+	if (!node || node->index == -1) {
+		err = PROVMAN_ERR_NOT_FOUND;
+		goto on_error;
+	}
+
+	*index = node->index;
+
+on_error:
+
+	return err;
+}
+
+static void prv_add_children(prv_root_node_t *node, GPtrArray *children)
+{
+	unsigned int i;
+
+	if (node->index != -1)
+		g_ptr_array_add(children,
+				(gpointer) g_provman_plugins[node->index].root);
+
+	for (i = 0; i < node->children->len; ++i)
+		prv_add_children(g_ptr_array_index(node->children, i),
+				 children);
 }
 
+/*
+ * Returns the roots of all the plugins whose roots are located under
+ * the directory uri.
+ */
+
 GPtrArray *provman_plugin_find_children(const char *uri)
 {
 	GPtrArray *children = g_ptr_array_new();
-	unsigned int uri_len = strlen(uri);
-	provman_plugin *plugin;
-	unsigned int plugin_uri_len = 0;
-	unsigned int i;
+	prv_root_node_t *node;
+	bool complete;
 
-	for (i = 0; i < g_provman_plugins_count; ++i) {
-		plugin = &g_provman_plugins[i];
-		plugin_uri_len = strlen(plugin->root);
-		
-		if (uri_len >  plugin_uri_len)
-			continue;
-		
-		if (!strncmp(plugin->root, uri, uri_len))
-			if ((uri_len == plugin_uri_len) ||
-			    (uri[uri_len - 1] == '/') ||
-			    (plugin->root[uri_len] == '/'))
-				g_ptr_array_add(children, 
-						(gpointer) plugin->root);
-	}
+	node = prv_walk_root_trie(uri, &complete);
+	if (node && complete)
+		prv_add_children(node, children);
 
 	return children;
 }
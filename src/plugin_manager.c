@@ -36,9 +36,12 @@
 
 #include "error.h"
 #include "log.h"
+#include "utils.h"
 
 #include "plugin_manager.h"
 #include "plugin.h"
+#include "settings_tree.h"
+#include "snapshot.h"
 
 enum plugin_manager_state_t_ {
 	PLUGIN_MANAGER_STATE_IDLE,
@@ -47,22 +50,397 @@ enum plugin_manager_state_t_ {
 };
 typedef enum plugin_manager_state_t_ plugin_manager_state_t;
 
+/*
+ * Each plugin keeps a journal of the keys modified in its cache, ordered
+ * by generation.  Only the latest change to each key is of interest.
+ * Earlier changes are superseded, their keys are freed, and they are
+ * dropped when the journal is compacted.  Deleted keys are kept as
+ * tombstones so that they can be reported by plugin_manager_get_changes.
+ *
+ * base is the generation at which the plugin's settings were first
+ * loaded.  Nothing is known about the changes made before then.
+ * previous holds the last contents of the cache once it has been
+ * cleared at the end of a session.  When the plugin is next synced in,
+ * the settings read are compared with it, so that changes made to the
+ * middleware in the meantime are journaled.
+ */
+
+typedef struct plugin_manager_change_t_ plugin_manager_change_t;
+struct plugin_manager_change_t_ {
+	guint64 generation;
+	gchar *key;
+	bool removed;
+};
+
+typedef struct plugin_manager_journal_t_ plugin_manager_journal_t;
+struct plugin_manager_journal_t_ {
+	GPtrArray *changes;
+	GHashTable *latest;
+	unsigned int superseded;
+	guint64 base;
+	guint64 generation;
+	provman_settings_tree_t *previous;
+};
+
+#define PLUGIN_MANAGER_MIN_COMPACT 64
+
+/*
+ * Cache generations must keep on increasing across restarts.  Rather than
+ * writing the current generation to disk each time it changes, provman
+ * reserves blocks of generations by storing the upper bound of the block
+ * in the generation file.  The next instance of provman starts from the
+ * bound, which is never lower than any generation issued before.
+ */
+
+#define PLUGIN_MANAGER_GENERATION_FILE "generation.dat"
+#define PLUGIN_MANAGER_GENERATION_BLOCK 4096
+
+/*
+ * Each plugin owns a slot.  The address of the slot is passed to the
+ * plugin as the user_data of its sync_in and sync_out callbacks so that
+ * we know which plugin is reporting back when several of them are
+ * running at the same time.  err holds the result of the last sync
+ * operation performed by the plugin.  dirty is set when the contents
+ * of the plugin's cache are modified during a session.  Plugins whose
+ * caches are not dirty are not synced out.  settings holds the copy
+ * of the plugin's cache that is passed to its sync_out function.
+ *
+ * loaded is set once the plugin instance has read its settings from the
+ * middleware.  Until then its cache may be loaded from a snapshot file,
+ * in which case from_snapshot is set, and the plugin must be synced in
+ * before it can be synced out.  token is the plugin's validation token
+ * for the sync_in in progress.  valid_token is the token that was
+ * current when the plugin instance last read its settings.  The plugin
+ * instance keeps these settings between sessions, so at the start of
+ * each session the token is computed again and, if it no longer
+ * matches valid_token, the plugin instance is recreated to discard them.
+ *
+ * materialized is set once the plugin has been asked to sync_in during
+ * the current session.  In lazy mode plugins are not synced in at the
+ * start of a session but when a task first accesses one of their keys.
+ * wanted marks the plugins that need to be synced in for such a task.
+ * journal records the changes made to the plugin's cache.
+ */
+
+typedef struct plugin_manager_slot_t_ plugin_manager_slot_t;
+struct plugin_manager_slot_t_ {
+	plugin_manager_t *manager;
+	unsigned int index;
+	bool in_flight;
+	bool dirty;
+	bool loaded;
+	bool from_snapshot;
+	bool materialized;
+	bool wanted;
+	int err;
+	GHashTable *settings;
+	gchar *token;
+	gchar *valid_token;
+	plugin_manager_journal_t journal;
+};
+
 struct plugin_manager_t_ {
 	plugin_manager_state_t state;
 	provman_plugin_instance *plugin_instances;	
-	GHashTable **kv_caches;
-	unsigned int synced;
+	provman_settings_tree_t **kv_caches;
+	plugin_manager_slot_t *slots;
+	unsigned int pending;
+	bool cancelled;
 	plugin_manager_cb_t callback;
 	void *user_data;
 	int err;
 	guint completion_source;
 	gchar *imsi;
+	bool lazy;
+	provman_settings_tree_t **committed;
+	guint64 generation;
+	unsigned int *order;
+	GHashTable *changed;
+	GHashTable *removed;
+	guint64 cache_generation;
+	guint64 generation_limit;
+	provman_settings_tree_t **shared_caches;
+	plugin_manager_view_t *view;
+};
+
+/*
+ * A view gives a session private copies of the plugins' caches.  While
+ * it is active, kv_caches points to its trees instead of shared_caches
+ * and modifications are neither journaled nor mark the slots dirty.
+ * base holds the caches as they were when the view was created, at
+ * cache generation generation.  The changes made in the view are found
+ * by comparing its trees with base when it is committed.
+ */
+
+struct plugin_manager_view_t_ {
+	provman_settings_tree_t **base;
+	provman_settings_tree_t **trees;
+	guint64 generation;
 };
 
-static void prv_sync_in_next_plugin(plugin_manager_t *manager);
-static void prv_sync_out_next_plugin(plugin_manager_t *manager);
+/*
+ * committed holds, for each plugin, a snapshot of the last settings known
+ * to be stored in the middleware, i.e., those read by its last sync_in or
+ * written by its last successful sync_out.  The snapshots are never
+ * modified so they can be read while a sync is in progress.  generation
+ * is incremented each time one of them is replaced.
+ */
+
+static void prv_record_changed(const gchar *key, const gchar *value,
+			       void *user_data)
+{
+	plugin_manager_t *manager = user_data;
+
+	(void) g_hash_table_remove(manager->removed, key);
+	g_hash_table_insert(manager->changed, g_strdup(key),
+			    (gpointer) provman_utils_intern_ref(value));
+}
 
-int plugin_manager_new(plugin_manager_t **manager)
+static void prv_record_removed(const gchar *key, const gchar *value,
+			       void *user_data)
+{
+	plugin_manager_t *manager = user_data;
+
+	(void) g_hash_table_remove(manager->changed, key);
+	g_hash_table_insert(manager->removed, g_strdup(key), NULL);
+}
+
+/*
+ * When changes are being tracked, the settings that differ between the
+ * old and the new committed trees are accumulated in changed and removed
+ * until they are collected by plugin_manager_take_changes.  The first
+ * commit of a plugin is not reported as there is nothing to compare it
+ * with.  As the new tree is a snapshot of the cache, which was itself
+ * derived from the old committed tree when the settings were written,
+ * the comparison usually only visits the modified branches.
+ */
+
+static void prv_commit(plugin_manager_t *manager, unsigned int index)
+{
+	provman_settings_tree_t *committed;
+
+	committed = provman_settings_tree_snapshot(manager->kv_caches[index]);
+	if (manager->changed && manager->committed[index])
+		provman_settings_tree_diff(manager->committed[index],
+					   committed, prv_record_changed,
+					   prv_record_removed, manager);
+
+	provman_settings_tree_delete(manager->committed[index]);
+	manager->committed[index] = committed;
+	++manager->generation;
+}
+
+static void prv_reserve_generations(plugin_manager_t *manager)
+{
+	gchar *path = NULL;
+	gchar *data;
+	guint64 limit = manager->cache_generation +
+		PLUGIN_MANAGER_GENERATION_BLOCK;
+
+	/* The block is used even if it cannot be saved, in which case
+	   saving it is attempted again when the block runs out. */
+
+	manager->generation_limit = limit;
+
+	if (provman_utils_make_file_path(PLUGIN_MANAGER_GENERATION_FILE,
+					 &path) != PROVMAN_ERR_NONE)
+		goto on_error;
+
+	data = g_strdup_printf("%" G_GUINT64_FORMAT "\n", limit);
+	if (!g_file_set_contents(path, data, -1, NULL))
+		PROVMAN_LOGF("Unable to save generation limit to %s", path);
+	g_free(data);
+
+on_error:
+
+	g_free(path);
+}
+
+static void prv_load_generation(plugin_manager_t *manager)
+{
+	gchar *path = NULL;
+	gchar *data = NULL;
+
+	if (provman_utils_make_file_path(PLUGIN_MANAGER_GENERATION_FILE,
+					 &path) != PROVMAN_ERR_NONE)
+		goto on_error;
+
+	if (g_file_get_contents(path, &data, NULL, NULL))
+		manager->cache_generation = g_ascii_strtoull(data, NULL, 10);
+
+on_error:
+
+	PROVMAN_LOGF("Cache generations start at %" G_GUINT64_FORMAT,
+		     manager->cache_generation);
+
+	prv_reserve_generations(manager);
+	g_free(data);
+	g_free(path);
+}
+
+static guint64 prv_next_generation(plugin_manager_t *manager)
+{
+	if (manager->cache_generation >= manager->generation_limit)
+		prv_reserve_generations(manager);
+
+	return ++manager->cache_generation;
+}
+
+static void prv_journal_free(plugin_manager_journal_t *journal)
+{
+	unsigned int i;
+	plugin_manager_change_t *change;
+
+	if (journal->changes) {
+		for (i = 0; i < journal->changes->len; ++i) {
+			change = g_ptr_array_index(journal->changes, i);
+			g_free(change->key);
+			g_free(change);
+		}
+		g_ptr_array_unref(journal->changes);
+		g_hash_table_unref(journal->latest);
+	}
+
+	provman_settings_tree_delete(journal->previous);
+	memset(journal, 0, sizeof(*journal));
+}
+
+static void prv_journal_compact(plugin_manager_journal_t *journal)
+{
+	unsigned int i;
+	unsigned int j = 0;
+	plugin_manager_change_t *change;
+
+	for (i = 0; i < journal->changes->len; ++i) {
+		change = g_ptr_array_index(journal->changes, i);
+		if (change->key)
+			g_ptr_array_index(journal->changes, j++) = change;
+		else
+			g_free(change);
+	}
+
+	g_ptr_array_set_size(journal->changes, j);
+	journal->superseded = 0;
+}
+
+static void prv_journal_add(plugin_manager_t *manager, unsigned int index,
+			    const gchar *key, bool removed)
+{
+	plugin_manager_journal_t *journal = &manager->slots[index].journal;
+	plugin_manager_change_t *change;
+
+	if (!journal->changes)
+		return;
+
+	change = g_hash_table_lookup(journal->latest, key);
+	if (change) {
+		(void) g_hash_table_steal(journal->latest, key);
+		g_free(change->key);
+		change->key = NULL;
+		++journal->superseded;
+	}
+
+	change = g_new(plugin_manager_change_t, 1);
+	change->generation = prv_next_generation(manager);
+	change->key = g_strdup(key);
+	change->removed = removed;
+	g_ptr_array_add(journal->changes, change);
+	g_hash_table_insert(journal->latest, change->key, change);
+	journal->generation = change->generation;
+
+	if (journal->superseded >= PLUGIN_MANAGER_MIN_COMPACT &&
+	    journal->superseded * 2 > journal->changes->len)
+		prv_journal_compact(journal);
+}
+
+typedef struct plugin_manager_journal_diff_t_ plugin_manager_journal_diff_t;
+struct plugin_manager_journal_diff_t_ {
+	plugin_manager_t *manager;
+	unsigned int index;
+};
+
+static void prv_journal_changed(const gchar *key, const gchar *value,
+				void *user_data)
+{
+	plugin_manager_journal_diff_t *diff = user_data;
+
+	prv_journal_add(diff->manager, diff->index, key, false);
+}
+
+static void prv_journal_removed(const gchar *key, const gchar *value,
+				void *user_data)
+{
+	plugin_manager_journal_diff_t *diff = user_data;
+
+	prv_journal_add(diff->manager, diff->index, key, true);
+}
+
+/*
+ * Journals the differences between old_tree and the cache of a plugin.
+ * Unmodified subtrees are shared and are not visited.
+ */
+
+static void prv_journal_diff(plugin_manager_t *manager, unsigned int index,
+			     provman_settings_tree_t *old_tree)
+{
+	plugin_manager_journal_diff_t diff;
+
+	diff.manager = manager;
+	diff.index = index;
+	provman_settings_tree_diff(old_tree, manager->kv_caches[index],
+				   prv_journal_changed, prv_journal_removed,
+				   &diff);
+}
+
+/*
+ * Called when a plugin's cache has been loaded from the middleware or
+ * from a snapshot.
+ */
+
+static void prv_journal_refresh(plugin_manager_t *manager, unsigned int index)
+{
+	plugin_manager_journal_t *journal = &manager->slots[index].journal;
+
+	if (journal->changes && journal->previous) {
+		prv_journal_diff(manager, index, journal->previous);
+		provman_settings_tree_delete(journal->previous);
+		journal->previous = NULL;
+	} else {
+		prv_journal_free(journal);
+		journal->changes = g_ptr_array_new();
+		journal->latest = g_hash_table_new(g_str_hash, g_str_equal);
+		journal->base = prv_next_generation(manager);
+		journal->generation = journal->base;
+	}
+}
+
+/*
+ * Returns the indices of the plugins sorted by their roots in key order.
+ * As plugin roots cannot overlap, visiting the plugins in this order
+ * visits their settings in key order.
+ */
+
+static unsigned int *prv_plugin_order(void)
+{
+	unsigned int count = provman_plugin_get_count();
+	unsigned int *order = g_new(unsigned int, count);
+	unsigned int i;
+	unsigned int j;
+	const gchar *root;
+
+	for (i = 0; i < count; ++i) {
+		root = provman_plugin_get(i)->root;
+		for (j = i; j > 0 && provman_settings_tree_key_cmp(
+			     provman_plugin_get(order[j - 1])->root, root) > 0;
+		     --j)
+			order[j] = order[j - 1];
+		order[j] = i;
+	}
+
+	return order;
+}
+
+int plugin_manager_new(plugin_manager_t **manager, bool lazy)
 {
 	int err = PROVMAN_ERR_NONE;
 
@@ -78,7 +456,19 @@ int plugin_manager_new(plugin_manager_t **manager)
 		goto on_error;
 	
 	retval->state = PLUGIN_MANAGER_STATE_IDLE;
+	retval->lazy = lazy;
 	retval->plugin_instances = g_new0(provman_plugin_instance, count);
+	retval->kv_caches = g_new0(provman_settings_tree_t*, count);
+	retval->shared_caches = retval->kv_caches;
+	retval->committed = g_new0(provman_settings_tree_t*, count);
+	retval->slots = g_new0(plugin_manager_slot_t, count);
+	for (i = 0; i < count; ++i) {
+		retval->slots[i].manager = retval;
+		retval->slots[i].index = i;
+	}
+	retval->order = prv_plugin_order();
+
+	prv_load_generation(retval);
 	
 	for (i = 0; i < count; ++i) {
 		plugin = provman_plugin_get(i);
@@ -90,7 +480,6 @@ int plugin_manager_new(plugin_manager_t **manager)
 		}
 	}
 
-	retval->kv_caches = g_new0(GHashTable*, count);
 	*manager = retval;
 
 	return err;
@@ -108,10 +497,13 @@ static void prv_clear_cache(plugin_manager_t *manager)
 {
 	unsigned int i;
 	unsigned int count = provman_plugin_get_count();
+	plugin_manager_journal_t *journal;
 	
 	for (i = 0; i < count; ++i) {
 		if (manager->kv_caches[i]) {
-			g_hash_table_unref(manager->kv_caches[i]);
+			journal = &manager->slots[i].journal;
+			provman_settings_tree_delete(journal->previous);
+			journal->previous = manager->kv_caches[i];
 			manager->kv_caches[i] = NULL;
 		}
 	}
@@ -125,15 +517,26 @@ void plugin_manager_delete(plugin_manager_t *manager)
 	const provman_plugin *plugin;
 
 	if (manager) {
+		plugin_manager_set_view(manager, NULL);
 		count = provman_plugin_get_count();
-		for (i = 0; i < count; ++i) {
+		for (i = 0; manager->slots && i < count; ++i) {
 			plugin = provman_plugin_get(i);
 			plugin->delete_fn(manager->plugin_instances[i]);
-			if (manager->kv_caches[i])
-				g_hash_table_unref(manager->kv_caches[i]);
+			provman_settings_tree_delete(manager->kv_caches[i]);
+			provman_settings_tree_delete(manager->committed[i]);
+			g_free(manager->slots[i].token);
+			g_free(manager->slots[i].valid_token);
+			if (manager->slots[i].settings)
+				g_hash_table_unref(manager->slots[i].settings);
+			prv_journal_free(&manager->slots[i].journal);
 		}
 		g_free(manager->plugin_instances);
 		g_free(manager->kv_caches);
+		g_free(manager->committed);
+		g_free(manager->slots);
+		g_free(manager->order);
+		plugin_manager_track_changes(manager, false);
+		g_free(manager->imsi);
 		g_free(manager);
 	}
 }
@@ -142,8 +545,8 @@ static gboolean prv_complete_callback(gpointer user_data)
 {
 	plugin_manager_t *manager = user_data;
 
-	manager->callback(manager->err, manager->user_data);
 	manager->completion_source = 0;
+	manager->callback(manager->err, manager->user_data);
 
 	return FALSE;
 }
@@ -155,307 +558,931 @@ static void prv_schedule_completion(plugin_manager_t *manager, int err)
 	if (!manager->completion_source) 
 		manager->completion_source = 
 			g_idle_add(prv_complete_callback, manager);
-	g_free(manager->imsi);
-	manager->imsi = NULL;
 	manager->state = PLUGIN_MANAGER_STATE_IDLE;
 }
 
-static void prv_plugin_sync_in_cb(int err, GHashTable *settings, void *user_data)
+static void prv_cancel_in_flight(plugin_manager_t *manager);
+
+static int prv_summarise_results(plugin_manager_t *manager)
 {
-	plugin_manager_t *manager = user_data;
+	unsigned int i;
+	unsigned int count = provman_plugin_get_count();
+	int err = PROVMAN_ERR_NONE;
+#ifdef PROVMAN_LOGGING
+	unsigned int failed = 0;
+#endif
 
-	PROVMAN_LOGF("Plugin %s sync_in completed with error %d",
-		      provman_plugin_get(manager->synced)->name, err);
+	for (i = 0; i < count; ++i) {
+		if (manager->slots[i].err == PROVMAN_ERR_NONE)
+			continue;
+		PROVMAN_LOGF("Plugin %s failed with error %d",
+			     provman_plugin_get(i)->name,
+			     manager->slots[i].err);
+		if (err == PROVMAN_ERR_NONE)
+			err = manager->slots[i].err;
+#ifdef PROVMAN_LOGGING
+		++failed;
+#endif
+	}
+
+	PROVMAN_LOGF("%s: %u of %u plugins failed",
+		     manager->state == PLUGIN_MANAGER_STATE_SYNC_IN ?
+		     "sync_in" : "sync_out", failed, count);
+#ifdef PROVMAN_LOGGING
+	provman_utils_log_intern_stats();
+#endif
+
+	return err;
+}
+
+static void prv_release(plugin_manager_t *manager)
+{
+	int err;
+
+	if (--manager->pending > 0)
+		return;
+
+	err = prv_summarise_results(manager);
+
+	if (manager->cancelled) {
+		prv_clear_cache(manager);
+		prv_schedule_completion(manager, PROVMAN_ERR_CANCELLED);
+	} else if (manager->state == PLUGIN_MANAGER_STATE_SYNC_OUT) {
+
+		/* TODO: We may want to re-schedule fail sync out
+		   attempts */
 
-	if (err == PROVMAN_ERR_CANCELLED) {
 		prv_clear_cache(manager);
 		prv_schedule_completion(manager, err);
 	} else {
-		if (err == PROVMAN_ERR_NONE) {
-			manager->kv_caches[manager->synced] = settings;
+
+		/* Plugins that fail to sync_in are simply left without
+		   a cache.  The session can still be used to modify the
+		   settings of the other plugins. */
+
+		prv_schedule_completion(manager, PROVMAN_ERR_NONE);
+	}
+}
+
+static void prv_slot_completed(plugin_manager_slot_t *slot, int err)
+{
+	plugin_manager_t *manager = slot->manager;
+
+	slot->in_flight = false;
+	slot->err = err;
+
+	if (err == PROVMAN_ERR_CANCELLED && !manager->cancelled) {
+
+		/* There is no point in waiting for the other plugins
+		   if one of them has been cancelled. */
+
+		manager->cancelled = true;
+		prv_cancel_in_flight(manager);
+	}
+
+	prv_release(manager);
+}
+
+static void prv_plugin_sync_in_cb(int err, provman_settings_tree_t *settings,
+				  void *user_data)
+{
+	plugin_manager_slot_t *slot = user_data;
+	plugin_manager_t *manager = slot->manager;
+	const provman_plugin *plugin = provman_plugin_get(slot->index);
+
+	PROVMAN_LOGF("Plugin %s sync_in completed with error %d",
+		      plugin->name, err);
+
+	if (err == PROVMAN_ERR_NONE) {
+		manager->kv_caches[slot->index] = settings;
+		prv_journal_refresh(manager, slot->index);
+		prv_commit(manager, slot->index);
+		slot->loaded = true;
+		if (slot->token &&
+		    g_strcmp0(slot->token, slot->valid_token))
+			provman_snapshot_save(plugin->name, manager->imsi,
+					      slot->token, settings);
+		g_free(slot->valid_token);
+		slot->valid_token = slot->token;
+	} else {
+		g_free(slot->token);
+	}
+
+	slot->token = NULL;
+
+	prv_slot_completed(slot, err);
+}
+
+static void prv_plugin_sync_out_cb(int err, void *user_data)
+{
+	plugin_manager_slot_t *slot = user_data;
+
+	PROVMAN_LOGF("Plugin %s sync_out completed with error %d",
+		 provman_plugin_get(slot->index)->name, err);
+
+	/* TOOD.  If we are cancelled does the client
+	   still have the connection open.  Does it
+	   need to send another end command before
+	   it releases its lock on the provisioning process. */
+
+	g_hash_table_unref(slot->settings);
+	slot->settings = NULL;
+
+	if (err == PROVMAN_ERR_NONE)
+		prv_commit(slot->manager, slot->index);
+
+	/* The middleware has been modified, so the plugin's snapshot, if
+	   any, is out of date.  Some plugins also discard the settings they
+	   have read after a sync_out. */
+
+	slot->loaded = false;
+	g_free(slot->valid_token);
+	slot->valid_token = NULL;
+	if (provman_plugin_get(slot->index)->get_token_fn)
+		provman_snapshot_remove(provman_plugin_get(slot->index)->name);
+
+	prv_slot_completed(slot, err);
+}
+
+static int prv_start_sync_out(plugin_manager_t *manager, unsigned int index)
+{
+	const provman_plugin *plugin = provman_plugin_get(index);
+	plugin_manager_slot_t *slot = &manager->slots[index];
+	provman_plugin_instance pi = manager->plugin_instances[index];
+	int err;
+
+	slot->settings =
+		provman_settings_tree_to_hash(manager->kv_caches[index]);
+	err = plugin->sync_out_fn(pi, slot->settings,
+				  prv_plugin_sync_out_cb, slot);
+	if (err != PROVMAN_ERR_NONE) {
+		PROVMAN_LOGF("Unable to sync out plugin %s", plugin->name);
+		g_hash_table_unref(slot->settings);
+		slot->settings = NULL;
+	}
+
+	return err;
+}
+
+/*
+ * Called when a plugin whose cache was loaded from a snapshot has read its
+ * settings from the middleware, just before it is synced out.  The
+ * settings it returns are not needed as the cache already contains the
+ * settings to be written.
+ */
+
+static void prv_plugin_primed_cb(int err, provman_settings_tree_t *settings,
+				 void *user_data)
+{
+	plugin_manager_slot_t *slot = user_data;
+
+	PROVMAN_LOGF("Plugin %s primed for sync_out with error %d",
+		      provman_plugin_get(slot->index)->name, err);
+
+	provman_settings_tree_delete(settings);
+	slot->from_snapshot = false;
+
+	if (err == PROVMAN_ERR_NONE) {
+		slot->loaded = true;
+		if (slot->manager->cancelled)
+			err = PROVMAN_ERR_CANCELLED;
+		else
+			err = prv_start_sync_out(slot->manager, slot->index);
+	}
+
+	if (err != PROVMAN_ERR_NONE)
+		prv_slot_completed(slot, err);
+}
+
+/*
+ * Replaces the instance of a plugin whose settings are out of date with a
+ * new one.  The old instance is only deleted once the new one has been
+ * created, so that the plugin remains usable if this fails.
+ */
+
+static int prv_reset_plugin(plugin_manager_t *manager, unsigned int index)
+{
+	const provman_plugin *plugin = provman_plugin_get(index);
+	plugin_manager_slot_t *slot = &manager->slots[index];
+	provman_plugin_instance pi;
+	int err;
+
+	err = plugin->new_fn(&pi);
+	if (err != PROVMAN_ERR_NONE) {
+		PROVMAN_LOGF("Unable to instantiate plugin %s", plugin->name);
+		goto on_error;
+	}
+
+	plugin->delete_fn(manager->plugin_instances[index]);
+	manager->plugin_instances[index] = pi;
+
+	slot->loaded = false;
+	g_free(slot->valid_token);
+	slot->valid_token = NULL;
+
+on_error:
+
+	return err;
+}
+
+static int prv_start_sync_in(plugin_manager_t *manager, unsigned int index)
+{
+	const provman_plugin *plugin = provman_plugin_get(index);
+	plugin_manager_slot_t *slot = &manager->slots[index];
+	provman_plugin_instance pi = manager->plugin_instances[index];
+	int err;
+
+	g_free(slot->token);
+	slot->token = NULL;
+
+	if (plugin->get_token_fn)
+		slot->token = plugin->get_token_fn(pi, manager->imsi);
+
+	if (slot->loaded && plugin->get_token_fn &&
+	    (!slot->token || g_strcmp0(slot->token, slot->valid_token))) {
+		PROVMAN_LOGF("Plugin %s is out of date", plugin->name);
+		err = prv_reset_plugin(manager, index);
+		if (err != PROVMAN_ERR_NONE)
+			goto on_error;
+		pi = manager->plugin_instances[index];
+	}
+
+	if (!slot->loaded) {
+		if (slot->token &&
+		    provman_snapshot_load(plugin->name, manager->imsi,
+					  slot->token,
+					  &manager->kv_caches[index]) ==
+		    PROVMAN_ERR_NONE) {
+			PROVMAN_LOGF("Plugin %s loaded from snapshot",
+				     plugin->name);
+			prv_journal_refresh(manager, index);
+			prv_commit(manager, index);
+			g_free(slot->token);
+			slot->token = NULL;
+			slot->from_snapshot = true;
+			prv_slot_completed(slot, PROVMAN_ERR_NONE);
+			return PROVMAN_ERR_NONE;
+		}
+	}
+
+	err = plugin->sync_in_fn(pi, manager->imsi, prv_plugin_sync_in_cb,
+				 slot);
+	if (err != PROVMAN_ERR_NONE) {
+		PROVMAN_LOGF("Unable to instantiate plugin %s", plugin->name);
+		goto on_error;
+	}
+
+	return err;
+
+on_error:
+
+	g_free(slot->token);
+	slot->token = NULL;
+
+	return err;
+}
+
+static int prv_start_plugin(plugin_manager_t *manager, unsigned int index)
+{
+	const provman_plugin *plugin = provman_plugin_get(index);
+	plugin_manager_slot_t *slot = &manager->slots[index];
+	provman_plugin_instance pi = manager->plugin_instances[index];
+	int err;
+
+	if (manager->state == PLUGIN_MANAGER_STATE_SYNC_IN) {
+		err = prv_start_sync_in(manager, index);
+	} else if (slot->from_snapshot) {
+		err = plugin->sync_in_fn(pi, manager->imsi,
+					 prv_plugin_primed_cb, slot);
+		if (err != PROVMAN_ERR_NONE)
+			PROVMAN_LOGF("Unable to prime plugin %s",
+				     plugin->name);
+	} else {
+		err = prv_start_sync_out(manager, index);
+	}
+
+	return err;
+}
+
+static void prv_start_all_plugins(plugin_manager_t *manager)
+{
+	plugin_manager_slot_t *slot;
+	unsigned int count = provman_plugin_get_count();
+	unsigned int i;
+
+	/* The extra reference prevents a plugin that completes
+	   synchronously from completing the whole operation before
+	   the remaining plugins have been started. */
+
+	manager->pending = 1;
+
+	for (i = 0; i < count; ++i) {
+		slot = &manager->slots[i];
+		slot->in_flight = false;
+		slot->err = PROVMAN_ERR_NONE;
+	}
+
+	for (i = 0; i < count && !manager->cancelled; ++i) {
+		slot = &manager->slots[i];
+
+		if (manager->state == PLUGIN_MANAGER_STATE_SYNC_IN) {
+			if (slot->materialized ||
+			    (manager->lazy && !slot->wanted))
+				continue;
+			slot->wanted = false;
+			slot->materialized = true;
+		} else if (!manager->kv_caches[i] || !slot->dirty) {
+
+			/* There is nothing to write back for plugins that
+			   were never synced in, failed to sync_in or whose
+			   settings have not been modified. */
+
+			PROVMAN_LOGF("Skipping sync out of unmodified plugin %s",
+				     provman_plugin_get(i)->name);
+			continue;
+		}
+
+		slot->in_flight = true;
+		++manager->pending;
+
+		slot->err = prv_start_plugin(manager, i);
+		if (slot->err != PROVMAN_ERR_NONE) {
+			slot->in_flight = false;
+			--manager->pending;
 		}
-		++manager->synced;
-		prv_sync_in_next_plugin(manager);       
 	}
+
+	prv_release(manager);
 }
 
-static void prv_sync_in_next_plugin(plugin_manager_t *manager)
+static int prv_sync_common(plugin_manager_t *manager,
+			   plugin_manager_state_t state,
+			   plugin_manager_cb_t callback, void *user_data)
 {
-	const provman_plugin *plugin;
+	int err = PROVMAN_ERR_NONE;
+
+	if (manager->state != PLUGIN_MANAGER_STATE_IDLE) {
+		err = PROVMAN_ERR_DENIED;
+		goto on_error;
+	}
+	
+	manager->state = state;
+	manager->err = PROVMAN_ERR_NONE;
+	manager->cancelled = false;
+	
+	manager->callback = callback;
+	manager->user_data = user_data;
+	
+	prv_start_all_plugins(manager);
+	
+on_error:
+
+	return err;
+}
+
+int plugin_manager_sync_in(plugin_manager_t *manager, const char *imsi,
+			   plugin_manager_cb_t callback, void *user_data)
+{
+	int err = PROVMAN_ERR_NONE;
+	plugin_manager_slot_t *slot;
 	unsigned int count = provman_plugin_get_count();
-	const char *imsi;
-	int err;
+	unsigned int i;
+
+	if (manager->state != PLUGIN_MANAGER_STATE_IDLE) {
+		err = PROVMAN_ERR_DENIED;
+		goto on_error;
+	}
+
+	g_free(manager->imsi);
+	manager->imsi = g_strdup(imsi);
+
+	for (i = 0; i < count; ++i) {
+		slot = &manager->slots[i];
+		slot->dirty = false;
+		slot->from_snapshot = false;
+		slot->materialized = false;
+		slot->wanted = false;
+	}
+
+	if (manager->lazy) {
+		PROVMAN_LOG("Lazy sync_in.  Plugins will be synced in on demand");
+		manager->callback = callback;
+		manager->user_data = user_data;
+		prv_schedule_completion(manager, PROVMAN_ERR_NONE);
+	} else {
+		err = prv_sync_common(manager, PLUGIN_MANAGER_STATE_SYNC_IN,
+				      callback, user_data);
+	}
+
+on_error:
+
+	return err;
+}
+
+/*
+ * Determines whether any of the plugins that own key, or whose roots lie
+ * under key, still need to be synced in.  If mark is true these plugins
+ * are marked as wanted.
+ */
+
+static void prv_want_plugin(plugin_manager_t *manager, const gchar *key,
+			    bool mark, bool *wanted)
+{
+	unsigned int index;
+	GPtrArray *children;
+	unsigned int i;
+
+	if (provman_plugin_find_index(key, &index) == PROVMAN_ERR_NONE) {
+		if (!manager->slots[index].materialized) {
+			if (mark)
+				manager->slots[index].wanted = true;
+			*wanted = true;
+		}
+		return;
+	}
+
+	children = provman_plugin_find_children(key);
+	for (i = 0; i < children->len && (mark || !*wanted); ++i)
+		prv_want_plugin(manager, g_ptr_array_index(children, i),
+				mark, wanted);
+	g_ptr_array_unref(children);
+}
+
+int plugin_manager_materialize(plugin_manager_t *manager,
+			       const gchar *const *keys,
+			       plugin_manager_cb_t callback, void *user_data)
+{
+	int err = PROVMAN_ERR_NONE;
+	bool wanted = false;
+	unsigned int i;
+
+	if (manager->state != PLUGIN_MANAGER_STATE_IDLE) {
+		err = PROVMAN_ERR_DENIED;
+		goto on_error;
+	}
+
+	/* All the plugins are synced in at the start of the session
+	   unless we are in lazy mode. */
+
+	if (manager->lazy)
+		for (i = 0; keys[i]; ++i)
+			prv_want_plugin(manager, keys[i], true, &wanted);
+
+	if (!wanted) {
+		err = PROVMAN_ERR_NOT_FOUND;
+		goto on_error;
+	}
+
+	err = prv_sync_common(manager, PLUGIN_MANAGER_STATE_SYNC_IN,
+			      callback, user_data);
+
+on_error:
+
+	return err;
+}
+
+int plugin_manager_sync_out(plugin_manager_t *manager, 
+			    plugin_manager_cb_t callback, void *user_data)
+{
+	return prv_sync_common(manager, PLUGIN_MANAGER_STATE_SYNC_OUT,
+			       callback, user_data);
+}
+
+static void prv_cancel_in_flight(plugin_manager_t *manager)
+{
+	const provman_plugin *plugin;
+	provman_plugin_instance pi;
+	unsigned int count;
+	unsigned int i;
+
+	/* A plugin may invoke its callback from within its cancel
+	   function so we need to hold a reference while we iterate. */
+
+	++manager->pending;
+
+	count = provman_plugin_get_count();
+	for (i = 0; i < count; ++i) {
+		if (!manager->slots[i].in_flight)
+			continue;
+
+		plugin = provman_plugin_get(i);
+		pi = manager->plugin_instances[i];
+		PROVMAN_LOGF("Cancelling %s ", plugin->root);
+
+		if (manager->state == PLUGIN_MANAGER_STATE_SYNC_IN ||
+		    manager->slots[i].from_snapshot)
+			plugin->sync_in_cancel_fn(pi);
+		else
+			plugin->sync_out_cancel_fn(pi);
+	}
+
+	prv_release(manager);
+}
+
+bool plugin_manager_cancel(plugin_manager_t *manager)
+{
+	bool retval = false;
+
+	PROVMAN_LOGF("%s called ", __FUNCTION__);
+
+	if (!manager->completion_source) {
+		if (manager->state != PLUGIN_MANAGER_STATE_IDLE) {
+			if (!manager->cancelled) {
+				manager->cancelled = true;
+				prv_cancel_in_flight(manager);
+			}
+			retval = true;
+		}
+	} else {
+		retval = true;
+	}
+	return retval;
+}
+
+void plugin_manager_track_changes(plugin_manager_t *manager, bool track)
+{
+	if (track && !manager->changed) {
+		manager->changed = g_hash_table_new_full(
+			g_str_hash, g_str_equal, g_free,
+			provman_utils_intern_unref);
+		manager->removed = g_hash_table_new_full(
+			g_str_hash, g_str_equal, g_free, NULL);
+	} else if (!track && manager->changed) {
+		g_hash_table_unref(manager->changed);
+		g_hash_table_unref(manager->removed);
+		manager->changed = NULL;
+		manager->removed = NULL;
+	}
+}
+
+bool plugin_manager_take_changes(plugin_manager_t *manager,
+				 GHashTable **changed, GHashTable **removed)
+{
+	if (!manager->changed || (g_hash_table_size(manager->changed) == 0 &&
+				  g_hash_table_size(manager->removed) == 0))
+		return false;
+
+	*changed = manager->changed;
+	*removed = manager->removed;
+	manager->changed = NULL;
+	plugin_manager_track_changes(manager, true);
+
+	return true;
+}
+
+bool plugin_manager_busy(plugin_manager_t *manager)
+{
+	return manager->state != PLUGIN_MANAGER_STATE_IDLE ||
+		manager->completion_source;
+}
+
+bool plugin_manager_ready(plugin_manager_t *manager, const gchar *key)
+{
+	bool wanted = false;
 
-	while (manager->synced < count) {
-		plugin = provman_plugin_get(manager->synced);
-		imsi = (const char*) manager->imsi;
-		err = plugin->sync_in_fn(
-			manager->plugin_instances[manager->synced], imsi, 
-			prv_plugin_sync_in_cb, manager);
-		if (err == PROVMAN_ERR_NONE)
-			break;
-		PROVMAN_LOGF("Unable to instantiate plugin %s",
-				      plugin->name);
+	if (plugin_manager_busy(manager))
+		return false;
 
-		++manager->synced;
-	}
+	if (manager->lazy)
+		prv_want_plugin(manager, key, false, &wanted);
 
-	if (manager->synced == count)
-		prv_schedule_completion(manager, PROVMAN_ERR_NONE);
+	return !wanted;
 }
 
-int plugin_manager_sync_in(plugin_manager_t *manager, const char *imsi,
-			   plugin_manager_cb_t callback, void *user_data)
+int plugin_manager_get(plugin_manager_t* manager, const gchar* key,
+		       gchar** value)
 {
 	int err = PROVMAN_ERR_NONE;
+	unsigned int index;
+	const gchar *val;
 
 	if (manager->state != PLUGIN_MANAGER_STATE_IDLE) {
 		err = PROVMAN_ERR_DENIED;
 		goto on_error;
 	}
 	
-	manager->synced = 0;
-	manager->state = PLUGIN_MANAGER_STATE_SYNC_IN;
-	manager->err = PROVMAN_ERR_NONE;
-	manager->imsi = g_strdup(imsi);
-	
-	manager->callback = callback;
-	manager->user_data = user_data;
-	
-	prv_sync_in_next_plugin(manager);
-	
+	err = provman_plugin_find_index(key, &index);
+	if (err != PROVMAN_ERR_NONE)
+		goto on_error;
+
+	if (!manager->kv_caches[index]) {
+		err = PROVMAN_ERR_CORRUPT;
+		goto on_error;
+	}
+
+	val = provman_settings_tree_lookup(manager->kv_caches[index], key);
+	if (!val) {
+		err = PROVMAN_ERR_DENIED;
+		goto on_error;
+	}
+
+	*value = g_strdup(val);
+
 on_error:
 
 	return err;
 }
 
-static void prv_sync_in_cancel(plugin_manager_t *manager)
+static void prv_add_to_builder(const gchar *key, const gchar *value,
+			       void *user_data)
 {
-	const provman_plugin *plugin;
-	unsigned int count;
-
-	PROVMAN_LOGF("%s called ", __FUNCTION__);
+	GVariantBuilder *vb = user_data;
 
-	count = provman_plugin_get_count();
-	if (manager->synced < count) {
-		plugin = provman_plugin_get(manager->synced);
-		PROVMAN_LOGF("Cancelling %s ", plugin->root);	
-		plugin->sync_in_cancel_fn(
-			manager->plugin_instances[manager->synced]);
-	}
+	g_variant_builder_add(vb, "{ss}", key, value);
+	PROVMAN_LOGF("Get %s=%s", key, value);
 }
 
-static void prv_plugin_sync_out_cb(int err, void *user_data)
+void plugin_manager_snapshot_foreach(provman_settings_tree_t **trees,
+				     const gchar *search_key,
+				     provman_settings_tree_cb_t cb,
+				     void *user_data)
 {
-	plugin_manager_t *manager = user_data;
-
-	PROVMAN_LOGF("Plugin %s sync_out completed with error %d",
-		 provman_plugin_get(manager->synced)->name, err);
-
-	if (err == PROVMAN_ERR_CANCELLED) {
-		/* TOOD.  If we are cancelled does the client
-		   still have the connection open.  Does it
-		   need to send another end command before
-		   it releases its lock on the provisioning process. */
+	unsigned int i;
+	unsigned int count = provman_plugin_get_count();
 
-		prv_clear_cache(manager);				
-		prv_schedule_completion(manager, err);
-	} else {
-		++manager->synced;
-		prv_sync_out_next_plugin(manager);       
-	}
+	for (i = 0; i < count; ++i)
+		if (trees[i])
+			provman_settings_tree_foreach(trees[i], search_key,
+						      cb, user_data);
 }
 
-static void prv_sync_out_next_plugin(plugin_manager_t *manager)
+GVariant *plugin_manager_snapshot_to_variant(provman_settings_tree_t **trees,
+					     const gchar *search_key)
 {
-	const provman_plugin *plugin;
-	unsigned int count = provman_plugin_get_count();
-	int err;
+	GVariantBuilder vb;
 
-	while (manager->synced < count) {
-		plugin = provman_plugin_get(manager->synced);
-		if (manager->kv_caches[manager->synced]) {
-			err = plugin->sync_out_fn(
-				manager->plugin_instances[manager->synced], 
-				manager->kv_caches[manager->synced],
-				prv_plugin_sync_out_cb, manager);
-			
-			if (err == PROVMAN_ERR_NONE)
-				break;
-		}
+	g_variant_builder_init(&vb, G_VARIANT_TYPE("a{ss}"));	
+	plugin_manager_snapshot_foreach(trees, search_key, prv_add_to_builder,
+					&vb);
 
-		PROVMAN_LOGF("Unable to sync out plugin %s", plugin->name);
+	return g_variant_builder_end(&vb);
+}
 
-		++manager->synced;
-	}
+/*
+ * One more setting than was asked for is visited, so that we know
+ * whether another page follows this one.
+ */
 
-	if (manager->synced == count) {
+typedef struct plugin_manager_page_t_ plugin_manager_page_t;
+struct plugin_manager_page_t_ {
+	GVariantBuilder vb;
+	unsigned int page_size;
+	unsigned int count;
+	gchar *last;
+};
 
-		/* TODO: We may want to re-schedule fail sync out
-		   attempts */
-		
-		prv_clear_cache(manager);
-		prv_schedule_completion(manager, PROVMAN_ERR_NONE);
+static void prv_add_to_page(const gchar *key, const gchar *value,
+			    void *user_data)
+{
+	plugin_manager_page_t *page = user_data;
+
+	if (page->count++ < page->page_size) {
+		g_variant_builder_add(&page->vb, "{ss}", key, value);
+		if (page->count == page->page_size)
+			page->last = g_strdup(key);
 	}
 }
 
-
-int plugin_manager_sync_out(plugin_manager_t *manager, 
-			    plugin_manager_cb_t callback, void *user_data)
+int plugin_manager_get_page(plugin_manager_t *manager, const gchar *key,
+			    const gchar *cursor, unsigned int page_size,
+			    GVariant **settings, gchar **next_cursor)
 {
 	int err = PROVMAN_ERR_NONE;
+	unsigned int count = provman_plugin_get_count();
+	unsigned int i;
+	unsigned int index;
+	plugin_manager_page_t page;
 
 	if (manager->state != PLUGIN_MANAGER_STATE_IDLE) {
 		err = PROVMAN_ERR_DENIED;
 		goto on_error;
 	}
-	
-	manager->synced = 0;
-	manager->state = PLUGIN_MANAGER_STATE_SYNC_OUT;
-	manager->err = PROVMAN_ERR_NONE;
-	
-	manager->callback = callback;
-	manager->user_data = user_data;
-	
-	prv_sync_out_next_plugin(manager);
-	
-on_error:
-
-	return err;
-}
 
-static void prv_sync_out_cancel(plugin_manager_t *manager)
-{
-	const provman_plugin *plugin;
-	unsigned int count;
+	if (page_size == 0 || page_size == G_MAXUINT) {
+		err = PROVMAN_ERR_BAD_ARGS;
+		goto on_error;
+	}
 
-	PROVMAN_LOGF("%s called ", __FUNCTION__);
+	g_variant_builder_init(&page.vb, G_VARIANT_TYPE("a{ss}"));
+	page.page_size = page_size;
+	page.count = 0;
+	page.last = NULL;
+
+	if (!cursor[0])
+		cursor = NULL;
+
+	for (i = 0; i < count && page.count <= page_size; ++i) {
+		index = manager->order[i];
+		if (manager->kv_caches[index])
+			(void) provman_settings_tree_foreach_after(
+				manager->kv_caches[index], key, cursor,
+				page_size + 1 - page.count, prv_add_to_page,
+				&page);
+	}
 
-	count = provman_plugin_get_count();
-	if (manager->synced < count) {
-		plugin = provman_plugin_get(manager->synced);
-		PROVMAN_LOGF("Cancelling %s ", plugin->root);	
-		plugin->sync_out_cancel_fn(
-			manager->plugin_instances[manager->synced]);
+	*settings = g_variant_builder_end(&page.vb);
+	if (page.count > page_size) {
+		*next_cursor = page.last;
+	} else {
+		*next_cursor = g_strdup("");
+		g_free(page.last);
 	}
+
+on_error:
+
+	return err;
 }
 
-bool plugin_manager_cancel(plugin_manager_t *manager)
+/*
+ * Returns the position of the first change in the journal made after
+ * generation.  The changes are sorted by generation.
+ */
+
+static unsigned int prv_journal_find(plugin_manager_journal_t *journal,
+				     guint64 generation)
 {
-	bool retval = false;
-	if (!manager->completion_source) {
-		if (manager->state == PLUGIN_MANAGER_STATE_SYNC_IN) {
-			prv_sync_in_cancel(manager);
-			retval = true;
-		} else if (manager->state == PLUGIN_MANAGER_STATE_SYNC_OUT) {
-			prv_sync_out_cancel(manager);
-			retval = true;
-		}		
-	} else {
-		retval = true;
+	unsigned int low = 0;
+	unsigned int high = journal->changes->len;
+	unsigned int mid;
+	plugin_manager_change_t *change;
+
+	while (low < high) {
+		mid = low + (high - low) / 2;
+		change = g_ptr_array_index(journal->changes, mid);
+		if (change->generation <= generation)
+			low = mid + 1;
+		else
+			high = mid;
 	}
-	return retval;
+
+	return low;
 }
 
-bool plugin_manager_busy(plugin_manager_t *manager)
+static bool prv_root_overlaps(const gchar *root, const gchar *key)
 {
-	return manager->state != PLUGIN_MANAGER_STATE_IDLE;
+	gsize root_len = strlen(root);
+	gsize key_len = strlen(key);
+
+	return !strncmp(root, key, MIN(root_len, key_len));
 }
 
-int plugin_manager_get(plugin_manager_t* manager, const gchar* key,
-		       gchar** value)
+int plugin_manager_get_changes(plugin_manager_t *manager, const gchar *key,
+			       guint64 since, GVariant **set,
+			       GVariant **removed, guint64 *generation)
 {
 	int err = PROVMAN_ERR_NONE;
+	unsigned int count = provman_plugin_get_count();
+	unsigned int i;
+	unsigned int j;
 	unsigned int index;
-	gchar *val;
+	plugin_manager_journal_t *journal;
+	plugin_manager_change_t *change;
+	const gchar *value;
+	GVariantBuilder set_vb;
+	GVariantBuilder removed_vb;
 
 	if (manager->state != PLUGIN_MANAGER_STATE_IDLE) {
 		err = PROVMAN_ERR_DENIED;
 		goto on_error;
 	}
-	
-	err = provman_plugin_find_index(key, &index);
-	if (err != PROVMAN_ERR_NONE)
-		goto on_error;
 
-	if (!manager->kv_caches[index]) {
-		err = PROVMAN_ERR_CORRUPT;
+	/* G_MAXUINT64 asks for the current generation alone.  Any other
+	   generation that has not been issued yet was not returned by
+	   this instance of provman, so nothing is known about it. */
+
+	if (since > manager->cache_generation && since != G_MAXUINT64) {
+		err = PROVMAN_ERR_EXPIRED;
 		goto on_error;
 	}
 
-	val = g_hash_table_lookup(manager->kv_caches[index], key);
-	if (!val) {
-		err = PROVMAN_ERR_DENIED;
-		goto on_error;
+	g_variant_builder_init(&set_vb, G_VARIANT_TYPE("a{ss}"));
+	g_variant_builder_init(&removed_vb, G_VARIANT_TYPE("as"));
+
+	for (i = 0; i < count; ++i) {
+		index = manager->order[i];
+		journal = &manager->slots[index].journal;
+		if (!manager->shared_caches[index] || !journal->changes ||
+		    !prv_root_overlaps(provman_plugin_get(index)->root, key))
+			continue;
+
+		if (since < journal->base) {
+			g_variant_builder_clear(&set_vb);
+			g_variant_builder_clear(&removed_vb);
+			err = PROVMAN_ERR_EXPIRED;
+			goto on_error;
+		}
+
+		if (journal->generation <= since)
+			continue;
+
+		for (j = prv_journal_find(journal, since);
+		     j < journal->changes->len; ++j) {
+			change = g_ptr_array_index(journal->changes, j);
+			if (!change->key ||
+			    !provman_utils_key_matches(key, change->key))
+				continue;
+
+			value = change->removed ? NULL :
+				provman_settings_tree_lookup(
+					manager->shared_caches[index],
+					change->key);
+			if (value)
+				g_variant_builder_add(&set_vb, "{ss}",
+						      change->key, value);
+			else
+				g_variant_builder_add(&removed_vb, "s",
+						      change->key);
+		}
 	}
 
-	*value = g_strdup(val);
+	*set = g_variant_builder_end(&set_vb);
+	*removed = g_variant_builder_end(&removed_vb);
+	*generation = manager->cache_generation;
 
 on_error:
 
 	return err;
 }
 
-static bool prv_key_matches_search(const gchar *search_key, const gchar *key)
+static provman_settings_tree_t **prv_snapshot(provman_settings_tree_t **trees)
 {
-	bool retval = false;
-	unsigned int search_key_len = strlen(search_key);
-	unsigned int key_len = strlen(key);
-
-	if (key_len >= search_key_len) {
-		if (!strncmp(search_key, key, search_key_len)) {
-			if (key_len == search_key_len)
-				retval = true;
-			else if (search_key[search_key_len-1] == '/')
-				retval = true;
-			else if (key[search_key_len] == '/')
-				retval = true;
-		}
-	}
+	unsigned int i;
+	unsigned int count = provman_plugin_get_count();
+	provman_settings_tree_t **snapshot =
+		g_new0(provman_settings_tree_t*, count);
 
-	return retval;
+	for (i = 0; i < count; ++i)
+		if (trees[i])
+			snapshot[i] = provman_settings_tree_snapshot(trees[i]);
+
+	return snapshot;
 }
 
-int plugin_manager_get_all(plugin_manager_t* manager, const gchar* search_key,
-			   GVariant** values)
+int plugin_manager_snapshot(plugin_manager_t* manager,
+			    provman_settings_tree_t ***trees)
 {
 	int err = PROVMAN_ERR_NONE;
-	unsigned int i;
-	unsigned int count = provman_plugin_get_count();
-	GHashTable *ht;
-	GHashTableIter iter;
-	gpointer key;
-	gpointer value;
-	GVariantBuilder vb;
 
 	if (manager->state != PLUGIN_MANAGER_STATE_IDLE) {
 		err = PROVMAN_ERR_DENIED;
 		goto on_error;
 	}
 
-	g_variant_builder_init(&vb, G_VARIANT_TYPE("a{ss}"));	
+	*trees = prv_snapshot(manager->kv_caches);
 
-	for (i = 0; i < count; ++i) {
-		ht = manager->kv_caches[i];
-		if (ht) {
-			g_hash_table_iter_init(&iter, ht);
-			while (g_hash_table_iter_next(&iter, &key, &value)) {
-				if (prv_key_matches_search(search_key, key)) {
-					g_variant_builder_add(&vb, "{ss}", key,
-							      value);
-					PROVMAN_LOGF("Get %s=%s",key,value);
-				}
-			}
-		}
+on_error:
+       
+	return err;
+}
+
+void plugin_manager_free_snapshot(provman_settings_tree_t **trees)
+{
+	unsigned int i;
+	unsigned int count = provman_plugin_get_count();
+
+	for (i = 0; i < count; ++i)
+		provman_settings_tree_delete(trees[i]);
+	g_free(trees);
+}
+
+int plugin_manager_get_committed(plugin_manager_t* manager, const gchar* key,
+				 gchar** value, guint64 *generation)
+{
+	int err = PROVMAN_ERR_NONE;
+	unsigned int index;
+	const gchar *val;
+
+	err = provman_plugin_find_index(key, &index);
+	if (err != PROVMAN_ERR_NONE)
+		goto on_error;
+
+	if (!manager->committed[index]) {
+		err = PROVMAN_ERR_NOT_FOUND;
+		goto on_error;
+	}
+
+	val = provman_settings_tree_lookup(manager->committed[index], key);
+	if (!val) {
+		err = PROVMAN_ERR_NOT_FOUND;
+		goto on_error;
 	}
 
-	*values = g_variant_builder_end(&vb);
+	*value = g_strdup(val);
+	*generation = manager->generation;
 
 on_error:
-       
+
 	return err;
 }
 
+provman_settings_tree_t **plugin_manager_snapshot_committed(
+	plugin_manager_t* manager, guint64 *generation)
+{
+	*generation = manager->generation;
+
+	return prv_snapshot(manager->committed);
+}
+
 
 static int prv_set_common(plugin_manager_t* manager, const gchar* key,
 			  const gchar* value)
@@ -481,8 +1508,11 @@ static int prv_set_common(plugin_manager_t* manager, const gchar* key,
 	if (err != PROVMAN_ERR_NONE)
 		goto on_error;
 
-	g_hash_table_insert(manager->kv_caches[index], 
-			    g_strdup(key), g_strdup(value));
+	if (provman_settings_tree_insert(manager->kv_caches[index], key,
+					 value) && !manager->view) {
+		manager->slots[index].dirty = true;
+		prv_journal_add(manager, index, key, false);
+	}
 	
 on_error:
 
@@ -506,12 +1536,12 @@ on_error:
 	return err;
 }
 
-int plugin_manager_set_all(plugin_manager_t* manager, GVariant* settings,
+int plugin_manager_set_all(plugin_manager_t* manager, GPtrArray* settings,
 			   GVariant **errors)
 {
 	int err = PROVMAN_ERR_NONE;
-	GVariantIter *iter = NULL;
-	gchar *key;
+	unsigned int i;
+	const gchar *key;
 	const gchar *value;
 	int err2;
 	GVariantBuilder vb;
@@ -523,9 +1553,9 @@ int plugin_manager_set_all(plugin_manager_t* manager, GVariant* settings,
 
 	g_variant_builder_init(&vb, G_VARIANT_TYPE("as"));
 
-	iter = g_variant_iter_new(settings);
-	while (g_variant_iter_next(iter,"{s&s}", &key, &value)) {
-		g_strstrip(key);			
+	for (i = 0; i < settings->len; i += 2) {
+		key = g_ptr_array_index(settings, i);
+		value = g_ptr_array_index(settings, i + 1);
 		err2 = prv_set_common(manager, key, value);
 		if (err2 != PROVMAN_ERR_NONE) {
 			g_variant_builder_add(&vb, "s", key);			
@@ -535,10 +1565,8 @@ int plugin_manager_set_all(plugin_manager_t* manager, GVariant* settings,
 		else {
 			PROVMAN_LOGF("Set %s = %s", key, value);
 		}
-		g_free(key);
 #endif
 	}
-	g_variant_iter_free(iter);
 
 	*errors = g_variant_builder_end(&vb);
 	
@@ -554,11 +1582,9 @@ static int prv_delete_key(plugin_manager_t* manager, const gchar* raw_key,
 	const provman_plugin *plugin;
 	provman_plugin_instance pi;
 	bool leaf;
-	unsigned int deleted;
-	GHashTableIter iter;
-	gpointer existing_key;
 	unsigned int key_length;
 	gchar *key;
+	provman_settings_tree_t *old_tree = NULL;
 
 	key = g_strdup(raw_key);
 	key_length = strlen(key);
@@ -581,28 +1607,37 @@ static int prv_delete_key(plugin_manager_t* manager, const gchar* raw_key,
 		goto on_error;
 
 	if (leaf) {
-		if (!g_hash_table_remove(manager->kv_caches[index], key)) {
+		if (!provman_settings_tree_remove(manager->kv_caches[index],
+						  key)) {
 			err = PROVMAN_ERR_NOT_FOUND;
 			goto on_error;
 		}
+		if (!manager->view)
+			prv_journal_add(manager, index, key, true);
 	} else {
-		deleted = 0;			
-		g_hash_table_iter_init(&iter, manager->kv_caches[index]);
-		while (g_hash_table_iter_next(&iter, &existing_key, NULL)) {
-			if (!strncmp(existing_key, key, key_length) && 
-			    ((gchar*) existing_key)[key_length] == '/') {				
-				g_hash_table_iter_remove(&iter);
-				++deleted;
-			}
-		}
-		if (deleted == 0) {
+
+		/* The snapshot shares all of the cache's nodes, so only the
+		   removed branch is visited when journaling the keys it
+		   contained. */
+
+		if (!manager->view)
+			old_tree = provman_settings_tree_snapshot(
+				manager->kv_caches[index]);
+		if (provman_settings_tree_remove_dir(manager->kv_caches[index],
+						     raw_key) == 0) {
 			err = PROVMAN_ERR_NOT_FOUND;
 			goto on_error;
 		}
+		if (old_tree)
+			prv_journal_diff(manager, index, old_tree);
 	}
 
+	if (!manager->view)
+		manager->slots[index].dirty = true;
+
 on_error:
 
+	provman_settings_tree_delete(old_tree);
 	g_free(key);
 
 	return err;
@@ -652,4 +1687,155 @@ on_error:
 	return err;
 }
 
+plugin_manager_view_t *plugin_manager_view_new(plugin_manager_t *manager)
+{
+	plugin_manager_view_t *view = g_new0(plugin_manager_view_t, 1);
+
+	view->base = prv_snapshot(manager->shared_caches);
+	view->trees = prv_snapshot(manager->shared_caches);
+	view->generation = manager->cache_generation;
+
+	return view;
+}
+
+void plugin_manager_view_delete(plugin_manager_view_t *view)
+{
+	if (view) {
+		plugin_manager_free_snapshot(view->base);
+		plugin_manager_free_snapshot(view->trees);
+		g_free(view);
+	}
+}
+
+void plugin_manager_set_view(plugin_manager_t *manager,
+			     plugin_manager_view_t *view)
+{
+	manager->view = view;
+	manager->kv_caches = view ? view->trees : manager->shared_caches;
+}
+
+plugin_manager_view_t *plugin_manager_get_view(plugin_manager_t *manager)
+{
+	return manager->view;
+}
+
+typedef struct plugin_manager_write_t_ plugin_manager_write_t;
+struct plugin_manager_write_t_ {
+	unsigned int index;
+	gchar *key;
+	const gchar *value;
+};
+
+typedef struct plugin_manager_write_set_t_ plugin_manager_write_set_t;
+struct plugin_manager_write_set_t_ {
+	GArray *writes;
+	unsigned int index;
+};
+
+static void prv_write_changed(const gchar *key, const gchar *value,
+			      void *user_data)
+{
+	plugin_manager_write_set_t *write_set = user_data;
+	plugin_manager_write_t write;
+
+	write.index = write_set->index;
+	write.key = g_strdup(key);
+	write.value = value;
+	g_array_append_val(write_set->writes, write);
+}
+
+static void prv_write_removed(const gchar *key, const gchar *value,
+			      void *user_data)
+{
+	prv_write_changed(key, NULL, user_data);
+}
+
+/*
+ * A write conflicts if the key has been modified in the shared cache
+ * since the view was created.  The journal only holds the latest change
+ * to each key so a single lookup is needed.
+ */
+
+static bool prv_write_conflicts(plugin_manager_t *manager,
+				plugin_manager_view_t *view,
+				plugin_manager_write_t *write)
+{
+	plugin_manager_journal_t *journal;
+	plugin_manager_change_t *change;
+
+	journal = &manager->slots[write->index].journal;
+	if (!journal->changes || journal->base > view->generation)
+		return true;
+
+	change = g_hash_table_lookup(journal->latest, write->key);
+
+	return change && change->generation > view->generation;
+}
+
+int plugin_manager_view_commit(plugin_manager_t *manager,
+			       plugin_manager_view_t *view)
+{
+	int err = PROVMAN_ERR_NONE;
+	unsigned int count = provman_plugin_get_count();
+	unsigned int i;
+	plugin_manager_write_set_t write_set;
+	plugin_manager_write_t *write;
+	provman_settings_tree_t *cache;
+
+	write_set.writes = g_array_new(FALSE, FALSE,
+				       sizeof(plugin_manager_write_t));
+
+	if (manager->state != PLUGIN_MANAGER_STATE_IDLE) {
+		err = PROVMAN_ERR_DENIED;
+		goto on_error;
+	}
+
+	plugin_manager_set_view(manager, NULL);
+
+	for (i = 0; i < count; ++i) {
+		if (!view->base[i] || !view->trees[i])
+			continue;
+		write_set.index = i;
+		provman_settings_tree_diff(view->base[i], view->trees[i],
+					   prv_write_changed, prv_write_removed,
+					   &write_set);
+	}
+
+	for (i = 0; i < write_set.writes->len; ++i) {
+		write = &g_array_index(write_set.writes,
+				       plugin_manager_write_t, i);
+		if (prv_write_conflicts(manager, view, write)) {
+			PROVMAN_LOGF("%s modified by another session",
+				     write->key);
+			err = PROVMAN_ERR_CONFLICT;
+			goto on_error;
+		}
+	}
+
+	for (i = 0; i < write_set.writes->len; ++i) {
+		write = &g_array_index(write_set.writes,
+				       plugin_manager_write_t, i);
+		cache = manager->kv_caches[write->index];
+		if (!cache)
+			continue;
+		if (write->value)
+			(void) provman_settings_tree_insert(cache, write->key,
+							    write->value);
+		else
+			(void) provman_settings_tree_remove(cache, write->key);
+		manager->slots[write->index].dirty = true;
+		prv_journal_add(manager, write->index, write->key,
+				!write->value);
+	}
+
+	PROVMAN_LOGF("Committed %u changes", write_set.writes->len);
+
+on_error:
+
+	for (i = 0; i < write_set.writes->len; ++i)
+		g_free(g_array_index(write_set.writes,
+				     plugin_manager_write_t, i).key);
+	g_array_unref(write_set.writes);
 
+	return err;
+}
@@ -36,26 +36,110 @@
 
 #include <glib.h>
 
+#include "settings_tree.h"
+
 typedef struct plugin_manager_t_ plugin_manager_t;
+typedef struct plugin_manager_view_t_ plugin_manager_view_t;
 
 typedef void (*plugin_manager_cb_t)(int result, void *user_data);
 
-int plugin_manager_new(plugin_manager_t **manager);
+int plugin_manager_new(plugin_manager_t **manager, bool lazy);
 int plugin_manager_sync_in(plugin_manager_t *manager, const char *imsi,
 			   plugin_manager_cb_t callback, void *user_data);
+int plugin_manager_materialize(plugin_manager_t *manager,
+			       const gchar *const *keys,
+			       plugin_manager_cb_t callback, void *user_data);
 int plugin_manager_sync_out(plugin_manager_t *manager,
 			    plugin_manager_cb_t callback, void *user_data);
 bool plugin_manager_cancel(plugin_manager_t *manager);
 int plugin_manager_get(plugin_manager_t* manager, const gchar* key,
 		       gchar** value);
-int plugin_manager_get_all(plugin_manager_t* manager, const gchar* key,
-			   GVariant** values);
+
+/*
+ * Retrieves at most page_size of the settings matched by key, starting
+ * after cursor, an empty string or a cursor returned by a previous call.
+ * Settings are returned in key order, across all plugins.  next_cursor is
+ * set to the empty string once the last matching setting has been
+ * returned.
+ */
+
+int plugin_manager_get_page(plugin_manager_t *manager, const gchar *key,
+			    const gchar *cursor, unsigned int page_size,
+			    GVariant **settings, gchar **next_cursor);
+int plugin_manager_snapshot(plugin_manager_t* manager,
+			    provman_settings_tree_t ***trees);
+
+/*
+ * Every modification of a plugin's cache, whether made by the client or
+ * detected when the plugin is synced in, is assigned a new generation.
+ * plugin_manager_get_changes retrieves the settings matched by key that
+ * have been set or removed after the generation since, together with the
+ * current generation.  PROVMAN_ERR_EXPIRED is returned if since predates
+ * the loading of one of the plugins concerned or if it is greater than
+ * the current generation.  A since of G_MAXUINT64 only retrieves the
+ * current generation.
+ */
+
+int plugin_manager_get_changes(plugin_manager_t *manager, const gchar *key,
+			       guint64 since, GVariant **set,
+			       GVariant **removed, guint64 *generation);
+int plugin_manager_get_committed(plugin_manager_t* manager, const gchar* key,
+				 gchar** value, guint64 *generation);
+provman_settings_tree_t **plugin_manager_snapshot_committed(
+	plugin_manager_t* manager, guint64 *generation);
+
+/*
+ * Snapshots are arrays of settings trees, one per plugin.  They are
+ * created and freed on the main loop thread but
+ * plugin_manager_snapshot_foreach and plugin_manager_snapshot_to_variant
+ * can be called on any thread while the snapshot exists.
+ */
+
+void plugin_manager_snapshot_foreach(provman_settings_tree_t **trees,
+				     const gchar *search_key,
+				     provman_settings_tree_cb_t cb,
+				     void *user_data);
+GVariant *plugin_manager_snapshot_to_variant(provman_settings_tree_t **trees,
+					     const gchar *search_key);
+void plugin_manager_free_snapshot(provman_settings_tree_t **trees);
 int plugin_manager_set(plugin_manager_t* manager, const gchar* key,
 		       const gchar* value);
-int plugin_manager_set_all(plugin_manager_t* manager, GVariant* settings,
+int plugin_manager_set_all(plugin_manager_t* manager, GPtrArray* settings,
 			   GVariant** errors);
 int plugin_manager_remove(plugin_manager_t* manager, const gchar* key);
 void plugin_manager_delete(plugin_manager_t *manager);
+
+/*
+ * While changes are tracked, the settings modified or removed by each
+ * commit, i.e., each successful sync_in or sync_out of a plugin, are
+ * accumulated.  plugin_manager_take_changes passes them to the caller,
+ * returning false if there are none.  changed maps keys to their new
+ * interned values and removed contains the keys that were removed.
+ */
+
+void plugin_manager_track_changes(plugin_manager_t *manager, bool track);
+bool plugin_manager_take_changes(plugin_manager_t *manager,
+				 GHashTable **changed, GHashTable **removed);
+
+/*
+ * Views provide concurrent sessions with private copies of the caches,
+ * taken when the view is created.  Once a view has been set, all the
+ * functions that access the caches operate on the view until the view
+ * is unset by passing NULL.  plugin_manager_view_commit copies the
+ * settings modified in a view to the caches, provided that none of them
+ * have been modified in the caches since the view was created.  If they
+ * have, nothing is copied and PROVMAN_ERR_CONFLICT is returned.  The
+ * view is unset by plugin_manager_view_commit but it is not deleted.
+ */
+
+plugin_manager_view_t *plugin_manager_view_new(plugin_manager_t *manager);
+void plugin_manager_view_delete(plugin_manager_view_t *view);
+void plugin_manager_set_view(plugin_manager_t *manager,
+			     plugin_manager_view_t *view);
+plugin_manager_view_t *plugin_manager_get_view(plugin_manager_t *manager);
+int plugin_manager_view_commit(plugin_manager_t *manager,
+			       plugin_manager_view_t *view);
 bool plugin_manager_busy(plugin_manager_t *manager);
+bool plugin_manager_ready(plugin_manager_t *manager, const gchar *key);
 
 #endif
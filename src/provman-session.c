@@ -34,5 +34,5 @@
 
 int main(int argc, char *argv[])
 {
-	return provman_run(G_BUS_TYPE_SESSION, PROVMAN_SESSION_LOG);
+	return provman_run(G_BUS_TYPE_SESSION, PROVMAN_SESSION_LOG, argc, argv);
 }
@@ -39,13 +39,20 @@
 #include <sys/signalfd.h>
 #include <signal.h>
 #include <syslog.h>
+#include <unistd.h>
+#ifdef HAVE_MALLOC_TRIM
+#include <malloc.h>
+#endif
 
 #include "log.h"
 #include "error.h"
 
+#include <gio/gunixfdlist.h>
+
 #include "tasks.h"
 #include "utils.h"
 #include "plugin_manager.h"
+#include "dispatch.h"
 
 #define PROVMAN_INTERFACE_START "Start"
 #define PROVMAN_INTERFACE_SET "Set"
@@ -54,14 +61,37 @@
 #define PROVMAN_INTERFACE_VALUE "value"
 #define PROVMAN_INTERFACE_GET "Get"
 #define PROVMAN_INTERFACE_GET_ALL "GetAll"
+#define PROVMAN_INTERFACE_GET_ALL_PAGED "GetAllPaged"
+#define PROVMAN_INTERFACE_PAGE_SIZE "page_size"
+#define PROVMAN_INTERFACE_CURSOR "cursor"
+#define PROVMAN_INTERFACE_GET_CHANGES_SINCE "GetChangesSince"
+#define PROVMAN_INTERFACE_REMOVED "removed"
 #define PROVMAN_INTERFACE_DICT "dict"
 #define PROVMAN_INTERFACE_ERRORS "errors"
 #define PROVMAN_INTERFACE_PROP "prop"
 #define PROVMAN_INTERFACE_DELETE "Delete"
 #define PROVMAN_INTERFACE_IMSI "imsi"
 #define PROVMAN_INTERFACE_END "End"
+#define PROVMAN_INTERFACE_GET_COMMITTED "GetCommitted"
+#define PROVMAN_INTERFACE_GET_ALL_COMMITTED "GetAllCommitted"
+#define PROVMAN_INTERFACE_GENERATION "generation"
+#define PROVMAN_INTERFACE_EXECUTE "Execute"
+#define PROVMAN_INTERFACE_OPERATIONS "operations"
+#define PROVMAN_INTERFACE_RESULTS "results"
+#define PROVMAN_INTERFACE_IMPORT "Import"
+#define PROVMAN_INTERFACE_EXPORT "Export"
+#define PROVMAN_INTERFACE_FD "fd"
+#define PROVMAN_INTERFACE_COUNT "count"
+#define PROVMAN_INTERFACE_WATCH "Watch"
+#define PROVMAN_INTERFACE_UNWATCH "Unwatch"
+#define PROVMAN_INTERFACE_PREFIX "prefix"
+#define PROVMAN_INTERFACE_SETTINGS_CHANGED "SettingsChanged"
+#define PROVMAN_INTERFACE_SET_ARG "set"
 
 #define PROVMAN_TIMEOUT 30*1000
+#define PROVMAN_TRIM_DELAY 60
+#define PROVMAN_DISPATCH_THREADS 2
+#define PROVMAN_TASK_BUDGET 10*1000
 
 typedef struct provman_context_ provman_context;
 struct provman_context_ {
@@ -74,13 +104,54 @@ struct provman_context_ {
 	GMainLoop *main_loop;
 	GDBusConnection *connection;
 	guint timeout_id;
-	GPtrArray *tasks;
+	provman_task_queue *tasks;
 	guint idle_id;
 	bool quitting;
 	gchar *holder;
 	guint holder_watcher;
 	GSList *queued_clients;
 	plugin_manager_t *plugin_manager;
+	gboolean resident;
+	gboolean lazy;
+	gint trim_delay;
+	guint trim_id;
+	gint dispatch_threads;
+	provman_dispatch_t *dispatch;
+	bool importing;
+	GHashTable *watchers;
+	gboolean concurrent;
+	GHashTable *sessions;
+	gchar *session_imsi;
+	plugin_manager_view_t *orphan_view;
+};
+
+/*
+ * In concurrent mode, several clients can hold a session at the same
+ * time, provided that they manage the same IMSI.  sessions maps their
+ * unique bus names to their sessions and holder is not used.  Each
+ * session is given its own view of the settings when its first task is
+ * executed.  ending is set when the client calls End, which queues a
+ * PROVMAN_TASK_COMMIT task to merge the view into the shared caches.
+ * The plugins are synced in when the first session starts and synced
+ * out when the last one ends.
+ */
+
+typedef struct provman_session_ provman_session;
+struct provman_session_ {
+	guint name_watch;
+	plugin_manager_view_t *view;
+	bool ending;
+};
+
+/*
+ * Clients that have called Watch, indexed by their unique bus names.
+ * prefixes contains the keys passed to Watch.
+ */
+
+typedef struct provman_watcher_ provman_watcher;
+struct provman_watcher_ {
+	guint name_watch;
+	GPtrArray *prefixes;
 };
 
 static const gchar g_provman_introspection[] = 
@@ -116,10 +187,84 @@ static const gchar g_provman_introspection[] =
 	"      <arg type='a{ss}' name='"PROVMAN_INTERFACE_DICT"'"
 	"           direction='out'/>"
 	"    </method>"
+	"    <method name='"PROVMAN_INTERFACE_GET_ALL_PAGED"'>"
+	"      <arg type='s' name='"PROVMAN_INTERFACE_KEY"'"
+	"           direction='in'/>"
+	"      <arg type='u' name='"PROVMAN_INTERFACE_PAGE_SIZE"'"
+	"           direction='in'/>"
+	"      <arg type='s' name='"PROVMAN_INTERFACE_CURSOR"'"
+	"           direction='in'/>"
+	"      <arg type='a{ss}' name='"PROVMAN_INTERFACE_DICT"'"
+	"           direction='out'/>"
+	"      <arg type='s' name='"PROVMAN_INTERFACE_CURSOR"'"
+	"           direction='out'/>"
+	"    </method>"
+	"    <method name='"PROVMAN_INTERFACE_GET_CHANGES_SINCE"'>"
+	"      <arg type='s' name='"PROVMAN_INTERFACE_KEY"'"
+	"           direction='in'/>"
+	"      <arg type='t' name='"PROVMAN_INTERFACE_GENERATION"'"
+	"           direction='in'/>"
+	"      <arg type='a{ss}' name='"PROVMAN_INTERFACE_SET_ARG"'"
+	"           direction='out'/>"
+	"      <arg type='as' name='"PROVMAN_INTERFACE_REMOVED"'"
+	"           direction='out'/>"
+	"      <arg type='t' name='"PROVMAN_INTERFACE_GENERATION"'"
+	"           direction='out'/>"
+	"    </method>"
 	"    <method name='"PROVMAN_INTERFACE_DELETE"'>"
 	"      <arg type='s' name='"PROVMAN_INTERFACE_KEY"'"
 	"           direction='in'/>"
 	"    </method>"
+	"    <method name='"PROVMAN_INTERFACE_EXECUTE"'>"
+	"      <arg type='a(sss)' name='"PROVMAN_INTERFACE_OPERATIONS"'"
+	"           direction='in'/>"
+	"      <arg type='a(sa{ss})' name='"PROVMAN_INTERFACE_RESULTS"'"
+	"           direction='out'/>"
+	"    </method>"
+	"    <method name='"PROVMAN_INTERFACE_IMPORT"'>"
+	"      <arg type='h' name='"PROVMAN_INTERFACE_FD"'"
+	"           direction='in'/>"
+	"      <arg type='u' name='"PROVMAN_INTERFACE_COUNT"'"
+	"           direction='out'/>"
+	"      <arg type='as' name='"PROVMAN_INTERFACE_ERRORS"'"
+	"           direction='out'/>"
+	"    </method>"
+	"    <method name='"PROVMAN_INTERFACE_EXPORT"'>"
+	"      <arg type='s' name='"PROVMAN_INTERFACE_KEY"'"
+	"           direction='in'/>"
+	"      <arg type='h' name='"PROVMAN_INTERFACE_FD"'"
+	"           direction='in'/>"
+	"      <arg type='u' name='"PROVMAN_INTERFACE_COUNT"'"
+	"           direction='out'/>"
+	"    </method>"
+	"    <method name='"PROVMAN_INTERFACE_GET_COMMITTED"'>"
+	"      <arg type='s' name='"PROVMAN_INTERFACE_KEY"'"
+	"           direction='in'/>"
+	"      <arg type='s' name='"PROVMAN_INTERFACE_VALUE"'"
+	"           direction='out'/>"
+	"      <arg type='t' name='"PROVMAN_INTERFACE_GENERATION"'"
+	"           direction='out'/>"
+	"    </method>"
+	"    <method name='"PROVMAN_INTERFACE_GET_ALL_COMMITTED"'>"
+	"      <arg type='s' name='"PROVMAN_INTERFACE_KEY"'"
+	"           direction='in'/>"
+	"      <arg type='a{ss}' name='"PROVMAN_INTERFACE_DICT"'"
+	"           direction='out'/>"
+	"      <arg type='t' name='"PROVMAN_INTERFACE_GENERATION"'"
+	"           direction='out'/>"
+	"    </method>"
+	"    <method name='"PROVMAN_INTERFACE_WATCH"'>"
+	"      <arg type='s' name='"PROVMAN_INTERFACE_PREFIX"'"
+	"           direction='in'/>"
+	"    </method>"
+	"    <method name='"PROVMAN_INTERFACE_UNWATCH"'>"
+	"      <arg type='s' name='"PROVMAN_INTERFACE_PREFIX"'"
+	"           direction='in'/>"
+	"    </method>"
+	"    <signal name='"PROVMAN_INTERFACE_SETTINGS_CHANGED"'>"
+	"      <arg type='a{ss}' name='"PROVMAN_INTERFACE_SET_ARG"'/>"
+	"      <arg type='as' name='"PROVMAN_INTERFACE_REMOVED"'/>"
+	"    </signal>"
 	"  </interface>"
 	"</node>";
 
@@ -127,7 +272,7 @@ static gboolean prv_process_task(gpointer user_data);
 
 static bool prv_async_in_progress(provman_context *context)
 {
-	return plugin_manager_busy(context->plugin_manager);
+	return context->importing || plugin_manager_busy(context->plugin_manager);
 }
 
 static void prv_provman_key_free(provman_key *key)
@@ -143,7 +288,23 @@ static void prv_provman_key_value_free(provman_key_value *key_value)
 
 static void prv_provman_variant_free(provman_variant *variant)
 {
-	g_variant_unref(variant->variant);
+	if (variant->variant)
+		g_variant_unref(variant->variant);
+	if (variant->settings)
+		g_ptr_array_unref(variant->settings);
+}
+
+static void prv_provman_page_free(provman_page *page)
+{
+	g_free(page->key);
+	g_free(page->cursor);
+}
+
+static void prv_provman_fd_free(provman_fd *fd)
+{
+	g_free(fd->key);
+	if (fd->fd >= 0)
+		(void) close(fd->fd);
 }
 
 static void prv_free_provman_task(gpointer data)
@@ -163,10 +324,22 @@ static void prv_free_provman_task(gpointer data)
 		prv_provman_key_free(&task->key);
 		break;
 	case PROVMAN_TASK_SET_ALL:
+	case PROVMAN_TASK_EXECUTE:
 		prv_provman_variant_free(&task->variant);
+		break;
+	case PROVMAN_TASK_GET_ALL_PAGED:
+		prv_provman_page_free(&task->page);
+		break;
+	case PROVMAN_TASK_GET_CHANGES:
+		g_free(task->changes.key);
+		break;
+	case PROVMAN_TASK_IMPORT:
+	case PROVMAN_TASK_EXPORT:
+		prv_provman_fd_free(&task->fd);
 		break;			
 	case PROVMAN_TASK_SYNC_IN:
 	case PROVMAN_TASK_SYNC_OUT:
+	case PROVMAN_TASK_COMMIT:
 		break;
 	}
 
@@ -174,12 +347,15 @@ static void prv_free_provman_task(gpointer data)
 	g_free(task);
 }
 
+static void prv_emit_changes(provman_context *context);
+
 static void prv_sync_in_task_finished(int result, void *user_data)
 {
 	provman_context *context = user_data;
 
 	PROVMAN_LOGF("%s called", __FUNCTION__);
 
+	prv_emit_changes(context);
 	context->idle_id = g_idle_add(prv_process_task, context);
 }
 
@@ -189,62 +365,268 @@ static void prv_sync_out_task_finished(int result, void *user_data)
 
 	PROVMAN_LOGF("%s called", __FUNCTION__);
 
+	prv_emit_changes(context);
+	context->idle_id = g_idle_add(prv_process_task, context);
+}
+
+static void prv_import_task_finished(int result, void *user_data)
+{
+	provman_context *context = user_data;
+
+	PROVMAN_LOGF("%s called", __FUNCTION__);
+
+	context->importing = false;
+
+	/* The view of a concurrent session remains set until its import
+	   has completed, even if the session has been closed since. */
+
+	plugin_manager_set_view(context->plugin_manager, NULL);
+	plugin_manager_view_delete(context->orphan_view);
+	context->orphan_view = NULL;
+
 	context->idle_id = g_idle_add(prv_process_task, context);
 }
 
+/*
+ * A resident provman does not exit when it runs out of tasks.  Instead,
+ * once it has been idle for trim_delay seconds, it returns as much of its
+ * free heap as it can to the system.  The plugins and their settings are
+ * kept, so the next session does not need to reload them.
+ */
+
+static gboolean prv_trim(gpointer user_data)
+{
+	provman_context *context = user_data;
+
+	PROVMAN_LOG("Idle.  Trimming memory");
+
+	context->trim_id = 0;
+
+#ifdef PROVMAN_LOGGING
+	provman_utils_log_intern_stats();
+#endif
+
+#ifdef HAVE_MALLOC_TRIM
+	(void) malloc_trim(0);
+#endif
+
+	return FALSE;
+}
+
+static void prv_schedule_trim(provman_context *context)
+{
+	if (!context->trim_id)
+		context->trim_id = g_timeout_add_seconds(context->trim_delay,
+							 prv_trim, context);
+}
+
+static bool prv_in_session(provman_context *context)
+{
+	return context->holder || g_hash_table_size(context->sessions) > 0;
+}
+
+/*
+ * Sets the view of the concurrent session to which a task belongs.
+ * Tasks that do not belong to a session, and commits, operate on the
+ * shared caches.  Returns false if the task was queued by a client
+ * whose session has since been closed.
+ */
+
+static bool prv_set_session_view(provman_context *context,
+				 provman_task *task)
+{
+	provman_session *session = NULL;
+
+	if (context->concurrent && task->invocation &&
+	    task->type != PROVMAN_TASK_COMMIT) {
+		session = g_hash_table_lookup(
+			context->sessions,
+			g_dbus_method_invocation_get_sender(task->invocation));
+		if (!session)
+			return false;
+		if (!session->view)
+			session->view = plugin_manager_view_new(
+				context->plugin_manager);
+	}
+
+	plugin_manager_set_view(context->plugin_manager,
+				session ? session->view : NULL);
+
+	return true;
+}
+
+static void prv_close_session(provman_context *context, const gchar *name);
+
+/*
+ * Executes the task at the head of the queue and removes it.  Returns
+ * false if the task cannot be executed yet, in which case it is left at
+ * the head of the queue.
+ */
+
+static bool prv_execute_task(provman_context *context, provman_task *task,
+			     bool *async_task)
+{
+	provman_session *session;
+	gchar *name;
+
+	/* Tasks are executed in the order in which they were
+	   received, so the queue stalls until the task at its head
+	   has been decoded. */
+
+	if (task->decoding)
+		return false;
+
+	/* In lazy mode the plugins that own the keys accessed by the
+	   task may not have been synced in yet.  If so, the task
+	   is left at the head of the queue and is retried once
+	   they have been. */
+
+	if (context->lazy &&
+	    task->type != PROVMAN_TASK_SYNC_IN &&
+	    task->type != PROVMAN_TASK_SYNC_OUT &&
+	    task->type != PROVMAN_TASK_COMMIT &&
+	    provman_task_materialize(context->plugin_manager, task,
+				     prv_sync_in_task_finished, context))
+		return false;
+
+	if (!prv_set_session_view(context, task)) {
+		PROVMAN_LOG("Discarding task of closed session");
+		g_dbus_method_invocation_return_dbus_error(
+			task->invocation, PROVMAN_DBUS_ERR_UNEXPECTED, "");
+		task->invocation = NULL;
+		provman_task_queue_remove_head(context->tasks);
+		return true;
+	}
+
+	switch (task->type) {
+	case PROVMAN_TASK_SYNC_IN:
+		*async_task = provman_task_sync_in(
+			context->plugin_manager, task,
+			prv_sync_in_task_finished, context);
+		break;
+	case PROVMAN_TASK_SYNC_OUT:
+		*async_task = provman_task_sync_out(
+			context->plugin_manager,
+			task, prv_sync_out_task_finished,
+			context);
+		break;
+	case PROVMAN_TASK_SET:
+		provman_task_set(context->plugin_manager, task);
+		break;
+	case PROVMAN_TASK_SET_ALL:
+		provman_task_set_all(context->plugin_manager, task);
+		break;
+	case PROVMAN_TASK_GET:
+		provman_task_get(context->plugin_manager, task);
+		break;
+	case PROVMAN_TASK_GET_ALL:
+		provman_task_get_all(context->plugin_manager,
+				     context->dispatch, task);
+		break;
+	case PROVMAN_TASK_GET_ALL_PAGED:
+		provman_task_get_all_paged(context->plugin_manager, task);
+		break;
+	case PROVMAN_TASK_GET_CHANGES:
+		provman_task_get_changes(context->plugin_manager, task);
+		break;
+	case PROVMAN_TASK_DELETE:
+		provman_task_delete(context->plugin_manager,task);
+		break;
+	case PROVMAN_TASK_EXECUTE:
+		provman_task_execute(context->plugin_manager, task);
+		break;
+	case PROVMAN_TASK_IMPORT:
+		*async_task = provman_task_import(context->plugin_manager,
+						  task,
+						  prv_import_task_finished,
+						  context);
+		context->importing = *async_task;
+		break;
+	case PROVMAN_TASK_EXPORT:
+		provman_task_export(context->plugin_manager,
+				    context->dispatch, task);
+		break;
+	case PROVMAN_TASK_COMMIT:
+		name = g_strdup(g_dbus_method_invocation_get_sender(
+					task->invocation));
+		session = g_hash_table_lookup(context->sessions, name);
+		provman_task_commit(context->plugin_manager, task,
+				    session->view);
+		prv_close_session(context, name);
+		g_free(name);
+		break;
+	default:
+		break;
+	}
+
+	if (!context->importing)
+		plugin_manager_set_view(context->plugin_manager, NULL);
+
+	provman_task_queue_remove_head(context->tasks);
+
+	return true;
+}
+
+/*
+ * Executes queued tasks until the queue is empty, a task needs to wait
+ * for an asynchronous operation or PROVMAN_TASK_BUDGET microseconds have
+ * elapsed.  In the last case we return to the main loop, so that it can
+ * dispatch other events, and we are called again once it is idle.
+ */
+
 static gboolean prv_process_task(gpointer user_data)
 {
 	provman_context *context = user_data;
 	provman_task *task;
 	bool async_task = false;
+	gint64 deadline;
+#ifdef PROVMAN_LOGGING
+	unsigned int executed = 0;
+#endif
 
 	PROVMAN_LOGF("%s called", __FUNCTION__);
 
-	if (!context->quitting && context->tasks->len > 0) {
-		task = g_ptr_array_index(context->tasks, 0);
+	deadline = g_get_monotonic_time() + PROVMAN_TASK_BUDGET;
 
-		switch (task->type) {
-		case PROVMAN_TASK_SYNC_IN:
-			async_task = provman_task_sync_in(
-				context->plugin_manager, task,
-				prv_sync_in_task_finished, user_data);
-			break;
-		case PROVMAN_TASK_SYNC_OUT:
-			async_task = provman_task_sync_out(
-				context->plugin_manager,
-				task, prv_sync_out_task_finished,
-				user_data);
-			break;
-		case PROVMAN_TASK_SET:
-			provman_task_set(context->plugin_manager, task);
-			break;
-		case PROVMAN_TASK_SET_ALL:
-			provman_task_set_all(context->plugin_manager, task);
-			break;
-		case PROVMAN_TASK_GET:
-			provman_task_get(context->plugin_manager, task);
-			break;
-		case PROVMAN_TASK_GET_ALL:
-			provman_task_get_all(context->plugin_manager, task);
-			break;
-		case PROVMAN_TASK_DELETE:
-			provman_task_delete(context->plugin_manager,task);
-			break;
-		default:
-			break;
+	while (!context->quitting && context->tasks->len > 0) {
+		task = provman_task_queue_index(context->tasks, 0);
+		if (!prv_execute_task(context, task, &async_task)) {
+			context->idle_id = 0;
+			return FALSE;
 		}
 
-		g_ptr_array_remove_index(context->tasks, 0);
+#ifdef PROVMAN_LOGGING
+		++executed;
+#endif
+
+		if (async_task)
+			break;
+
+		if (context->tasks->len > 0 &&
+		    g_get_monotonic_time() >= deadline) {
+			PROVMAN_LOGF("Executed %u tasks.  Yielding with %u "
+				     "tasks queued", executed,
+				     context->tasks->len);
+			return TRUE;
+		}
 	}
 
 	if (!async_task) {
-		if (context->quitting || 
-		    ((context->tasks->len == 0) && !context->holder)) {
+		if (!context->quitting &&
+		    (context->resident ||
+		     g_hash_table_size(context->watchers) > 0) &&
+		    (context->tasks->len == 0) && !prv_in_session(context)) {
+			PROVMAN_LOG("No tasks left to execute. Going idle");
+			prv_schedule_trim(context);
+			context->idle_id = 0;
+			return FALSE;
+		} else if (context->quitting || 
+		    ((context->tasks->len == 0) && !prv_in_session(context))) {
 			PROVMAN_LOG("No tasks left to execute. Exiting");
 			g_main_loop_quit(context->main_loop);
 			context->idle_id = 0;
 			return FALSE;
-		} else if (context->holder) {
+		} else if (prv_in_session(context)) {
 			context->idle_id = 0;
 			return FALSE;
 		}
@@ -294,12 +676,26 @@ static void prv_provman_context_free(provman_context *context)
 {
 	GSList *ptr;
 
+	/* Any work still running on the dispatch threads may refer to
+	   the tasks, so it needs to complete before they are freed. */
+
+	provman_dispatch_delete(context->dispatch);
+
 	if (context->holder)
 		g_free(context->holder);
 
 	if (context->holder_watcher)
 		g_bus_unwatch_name(context->holder_watcher);
 
+	if (context->watchers)
+		g_hash_table_unref(context->watchers);
+
+	if (context->sessions)
+		g_hash_table_unref(context->sessions);
+
+	g_free(context->session_imsi);
+	plugin_manager_view_delete(context->orphan_view);
+
 	ptr = context->queued_clients;
 
 	while (ptr) {
@@ -312,8 +708,7 @@ static void prv_provman_context_free(provman_context *context)
 
 	g_slist_free(context->queued_clients);
 
-	if (context->tasks)
-		g_ptr_array_unref(context->tasks);
+	provman_task_queue_delete(context->tasks);
 
 	if (context->idle_id)
 		(void) g_source_remove(context->idle_id);
@@ -330,6 +725,9 @@ static void prv_provman_context_free(provman_context *context)
 	if (context->timeout_id)
 		(void) g_source_remove(context->timeout_id);
 
+	if (context->trim_id)
+		(void) g_source_remove(context->trim_id);
+
 	if (context->main_loop)
 		g_main_loop_unref(context->main_loop);
 
@@ -345,14 +743,24 @@ static void prv_provman_context_free(provman_context *context)
 	plugin_manager_delete(context->plugin_manager);
 }
 
-static void prv_add_task(provman_context *context, provman_task *task)
+static void prv_schedule_tasks(provman_context *context)
 {
-	g_ptr_array_add(context->tasks, task);	
-
 	if (!context->idle_id && !prv_async_in_progress(context))
 		context->idle_id = g_idle_add(prv_process_task, context);
 }
 
+static void prv_add_task(provman_context *context, provman_task *task)
+{
+	provman_task_queue_push(context->tasks, task);
+
+	prv_schedule_tasks(context);
+}
+
+static void prv_task_decoded(void *user_data)
+{
+	prv_schedule_tasks(user_data);
+}
+
 static void prv_add_sync_in_task(provman_context *context,
 				 const gchar *imsi)
 {
@@ -411,6 +819,42 @@ static void prv_add_get_all_task(provman_context *context,
 	prv_add_task(context, task);
 }
 
+static void prv_add_get_all_paged_task(provman_context *context,
+				       GDBusMethodInvocation *invocation,
+				       const gchar *key, guint32 page_size,
+				       const gchar *cursor)
+{
+	provman_task *task = g_new0(provman_task, 1);
+
+	PROVMAN_LOG("Add Task Get All Paged");
+
+	task->type = PROVMAN_TASK_GET_ALL_PAGED;
+	task->invocation = invocation;
+	task->page.key = g_strdup(key);
+	task->page.cursor = g_strdup(cursor);
+	task->page.page_size = page_size;
+	g_strstrip(task->page.key);
+
+	prv_add_task(context, task);
+}
+
+static void prv_add_get_changes_task(provman_context *context,
+				     GDBusMethodInvocation *invocation,
+				     const gchar *key, guint64 generation)
+{
+	provman_task *task = g_new0(provman_task, 1);
+
+	PROVMAN_LOG("Add Task Get Changes Since");
+
+	task->type = PROVMAN_TASK_GET_CHANGES;
+	task->invocation = invocation;
+	task->changes.key = g_strdup(key);
+	task->changes.generation = generation;
+	g_strstrip(task->changes.key);
+
+	prv_add_task(context, task);
+}
+
 static void prv_add_set_task(provman_context *context,
 			     GDBusMethodInvocation *invocation,
 			     const gchar *key, const gchar *value)
@@ -440,6 +884,82 @@ static void prv_add_set_all_task(provman_context *context,
 	task->invocation = invocation;
 	task->variant.variant = g_variant_ref_sink(variant);
 
+	prv_add_task(context, task);
+	provman_task_decode(context->dispatch, task, prv_task_decoded,
+			    context);
+}
+
+static void prv_add_execute_task(provman_context *context,
+				 GDBusMethodInvocation *invocation,
+				 GVariant *variant)
+{
+	provman_task *task = g_new0(provman_task, 1);
+
+	PROVMAN_LOG("Add Execute");
+
+	task->type = PROVMAN_TASK_EXECUTE;
+	task->invocation = invocation;
+	task->variant.variant = g_variant_ref_sink(variant);
+
+	prv_add_task(context, task);
+	provman_task_decode(context->dispatch, task, prv_task_decoded,
+			    context);
+}
+
+/*
+ * The file descriptors passed to Import and Export are duplicated, so
+ * that they remain valid once the method call has been freed.
+ */
+
+static gint prv_get_fd(GDBusMethodInvocation *invocation, gint32 handle)
+{
+	GUnixFDList *fd_list;
+
+	fd_list = g_dbus_message_get_unix_fd_list(
+		g_dbus_method_invocation_get_message(invocation));
+	if (!fd_list)
+		return -1;
+
+	return g_unix_fd_list_get(fd_list, handle, NULL);
+}
+
+static void prv_add_fd_task(provman_context *context,
+			    provman_task_type type,
+			    GDBusMethodInvocation *invocation,
+			    const gchar *key, gint32 handle)
+{
+	provman_task *task;
+	gint fd;
+
+	fd = prv_get_fd(invocation, handle);
+	if (fd < 0) {
+		PROVMAN_LOG("Unable to retrieve file descriptor");
+		g_dbus_method_invocation_return_dbus_error(
+			invocation, PROVMAN_DBUS_ERR_BAD_ARGS, "");
+		return;
+	}
+
+	task = g_new0(provman_task, 1);
+	task->type = type;
+	task->invocation = invocation;
+	task->fd.fd = fd;
+	task->fd.key = g_strdup(key);
+	if (task->fd.key)
+		g_strstrip(task->fd.key);
+
+	prv_add_task(context, task);
+}
+
+static void prv_add_commit_task(provman_context *context,
+				GDBusMethodInvocation *invocation)
+{
+	provman_task *task = g_new0(provman_task, 1);
+
+	PROVMAN_LOG("Add Task Commit");
+
+	task->type = PROVMAN_TASK_COMMIT;
+	task->invocation = invocation;
+
 	prv_add_task(context, task);
 }
 
@@ -463,6 +983,69 @@ static void prv_add_delete_task(provman_context *context,
 static void prv_lost_client(GDBusConnection *connection, const gchar *name,
 			    gpointer user_data);
 
+/*
+ * Synchronous requests only need to be queued if they have to wait for
+ * other tasks or for a plugin to be synced.  Otherwise they are executed
+ * straight away, using the strings of the method call's parameters.
+ * Keys with leading or trailing white space are queued as they need to
+ * be copied before they can be stripped.  Set, Get and Delete are
+ * answered before this function returns.  GetAll only takes its snapshot
+ * here.  Its reply is serialized and sent later by a dispatch thread.
+ */
+
+static bool prv_execute_now(provman_context *context, provman_task_type type,
+			    GDBusMethodInvocation *invocation,
+			    const gchar *key, const gchar *value)
+{
+	provman_task task;
+	gsize key_len = strlen(key);
+	bool executed = true;
+
+	if (context->quitting || context->tasks->len > 0 ||
+	    prv_async_in_progress(context))
+		return false;
+
+	if (key_len == 0 || g_ascii_isspace(key[0]) ||
+	    g_ascii_isspace(key[key_len - 1]))
+		return false;
+
+	if (!plugin_manager_ready(context->plugin_manager, key))
+		return false;
+
+	memset(&task, 0, sizeof(task));
+	task.type = type;
+	task.invocation = invocation;
+	(void) prv_set_session_view(context, &task);
+
+	switch (type) {
+	case PROVMAN_TASK_SET:
+		task.key_value.key = (gchar *) key;
+		task.key_value.value = (gchar *) value;
+		provman_task_set(context->plugin_manager, &task);
+		break;
+	case PROVMAN_TASK_GET:
+		task.key.key = (gchar *) key;
+		provman_task_get(context->plugin_manager, &task);
+		break;
+	case PROVMAN_TASK_GET_ALL:
+		task.key.key = (gchar *) key;
+		provman_task_get_all(context->plugin_manager,
+				     context->dispatch, &task);
+		break;
+	case PROVMAN_TASK_DELETE:
+		task.key.key = (gchar *) key;
+		provman_task_delete(context->plugin_manager, &task);
+		break;
+	default:
+		executed = false;
+		break;
+	}
+
+	plugin_manager_set_view(context->plugin_manager, NULL);
+
+	return executed;
+}
+
 static void prv_session_ended(provman_context *context)
 {
 	GDBusMethodInvocation *invocation;
@@ -514,8 +1097,7 @@ static void prv_lost_client(GDBusConnection *connection, const gchar *name,
 	PROVMAN_LOGF("Lost client connection %s", name);
 
 	for (i = 0; i < context->tasks->len; ++i) {
-		task = ((provman_task *) g_ptr_array_index(context->tasks,
-							       i));
+		task = provman_task_queue_index(context->tasks, i);
 		if (task->type == PROVMAN_TASK_SYNC_OUT)
 			break;
 	}
@@ -524,6 +1106,56 @@ static void prv_lost_client(GDBusConnection *connection, const gchar *name,
 		prv_session_ended(context);
 }
 
+/*
+ * Requests for committed settings do not belong to a session.  They are
+ * answered straight away, even while the plugins are being synced, and
+ * do not affect the lifetime of provman.
+ */
+
+static bool prv_get_committed(provman_context *context,
+			      const gchar *method_name, GVariant *parameters,
+			      GDBusMethodInvocation *invocation)
+{
+	int err;
+	gchar *key;
+	gchar *value;
+	provman_settings_tree_t **trees;
+	guint64 generation = 0;
+
+	if (!g_strcmp0(method_name, PROVMAN_INTERFACE_GET_COMMITTED)) {
+		g_variant_get(parameters, "(s)", &key);
+		g_strstrip(key);
+		err = plugin_manager_get_committed(context->plugin_manager,
+						   key, &value, &generation);
+		if (err == PROVMAN_ERR_NONE) {
+			g_dbus_method_invocation_return_value(
+				invocation, g_variant_new("(st)", value,
+							  generation));
+			g_free(value);
+		} else {
+			g_dbus_method_invocation_return_dbus_error(
+				invocation, provman_err_to_dbus(err), "");
+		}
+	} else if (!g_strcmp0(method_name,
+			      PROVMAN_INTERFACE_GET_ALL_COMMITTED)) {
+		g_variant_get(parameters, "(s)", &key);
+		g_strstrip(key);
+		trees = plugin_manager_snapshot_committed(
+			context->plugin_manager, &generation);
+		provman_task_return_all(context->dispatch, invocation, key,
+					trees, &generation);
+	} else {
+		return false;
+	}
+
+	PROVMAN_LOGF("%s %s returned committed generation %"
+		     G_GUINT64_FORMAT, method_name, key, generation);
+
+	g_free(key);
+
+	return true;
+}
+
 static bool prv_find_connection(provman_context *context,
 				GDBusMethodInvocation *new_invocation)
 {
@@ -531,7 +1163,8 @@ static bool prv_find_connection(provman_context *context,
 	GSList *ptr;
 	const gchar *bus_name = 
 		g_dbus_method_invocation_get_sender(new_invocation);
-	bool found = !g_strcmp0(bus_name, context->holder);
+	bool found = !g_strcmp0(bus_name, context->holder) ||
+		g_hash_table_lookup(context->sessions, bus_name);
 
 	ptr = context->queued_clients;
 
@@ -546,6 +1179,386 @@ static bool prv_find_connection(provman_context *context,
 	return found;
 }
 
+static void prv_session_free(gpointer data)
+{
+	provman_session *session = data;
+
+	g_bus_unwatch_name(session->name_watch);
+	plugin_manager_view_delete(session->view);
+	g_free(session);
+}
+
+static void prv_lost_session(GDBusConnection *connection, const gchar *name,
+			     gpointer user_data);
+
+static void prv_open_session(provman_context *context,
+			     GDBusMethodInvocation *invocation)
+{
+	provman_session *session;
+	const gchar *name = g_dbus_method_invocation_get_sender(invocation);
+	const gchar *imsi;
+
+	g_variant_get(g_dbus_method_invocation_get_parameters(invocation),
+		      "(&s)", &imsi);
+
+	if (g_hash_table_size(context->sessions) == 0) {
+		g_free(context->session_imsi);
+		context->session_imsi = g_strdup(imsi);
+		prv_add_sync_in_task(context, imsi);
+	}
+
+	session = g_new0(provman_session, 1);
+	session->name_watch = g_bus_watch_name(context->bus, name, 0, NULL,
+					       prv_lost_session, context,
+					       NULL);
+	g_hash_table_insert(context->sessions, g_strdup(name), session);
+
+	PROVMAN_LOGF("start session with %s IMSI %s, %u sessions", name, imsi,
+		     g_hash_table_size(context->sessions));
+
+	g_dbus_method_invocation_return_value(invocation, NULL);
+}
+
+/*
+ * Once the last session has ended, the queued client that has waited the
+ * longest is started, together with all the other queued clients that
+ * manage the same IMSI.
+ */
+
+static void prv_start_queued_sessions(provman_context *context)
+{
+	GSList *ptr = context->queued_clients;
+	GSList *next;
+	const gchar *imsi;
+
+	while (ptr) {
+		next = ptr->next;
+		g_variant_get(g_dbus_method_invocation_get_parameters(
+				      ptr->data), "(&s)", &imsi);
+		if (g_hash_table_size(context->sessions) == 0 ||
+		    !strcmp(context->session_imsi, imsi)) {
+			prv_open_session(context, ptr->data);
+			context->queued_clients = g_slist_delete_link(
+				context->queued_clients, ptr);
+		}
+		ptr = next;
+	}
+}
+
+static void prv_close_session(provman_context *context, const gchar *name)
+{
+	provman_session *session;
+
+	session = g_hash_table_lookup(context->sessions, name);
+	if (session->view &&
+	    plugin_manager_get_view(context->plugin_manager) == session->view) {
+		context->orphan_view = session->view;
+		session->view = NULL;
+	}
+
+	(void) g_hash_table_remove(context->sessions, name);
+
+	PROVMAN_LOGF("end session with %s, %u sessions", name,
+		     g_hash_table_size(context->sessions));
+
+	if (g_hash_table_size(context->sessions) == 0) {
+		prv_add_sync_out_task(context);
+		prv_start_queued_sessions(context);
+	}
+}
+
+/*
+ * The changes made by a client that disappears without calling End are
+ * discarded.  If it has called End, they are committed by its pending
+ * PROVMAN_TASK_COMMIT task.
+ */
+
+static void prv_lost_session(GDBusConnection *connection, const gchar *name,
+			     gpointer user_data)
+{
+	provman_context *context = user_data;
+	provman_session *session;
+
+	PROVMAN_LOGF("Lost client connection %s", name);
+
+	session = g_hash_table_lookup(context->sessions, name);
+	if (session && !session->ending)
+		prv_close_session(context, name);
+}
+
+/*
+ * A client can join the sessions in progress if it manages the same IMSI
+ * and no other client is waiting for them to end.
+ */
+
+static void prv_start_concurrent(provman_context *context,
+				 GDBusMethodInvocation *invocation)
+{
+	const gchar *imsi;
+
+	g_variant_get(g_dbus_method_invocation_get_parameters(invocation),
+		      "(&s)", &imsi);
+
+	if (prv_find_connection(context, invocation)) {
+		PROVMAN_LOG("session already started for this client");
+		g_dbus_method_invocation_return_dbus_error(
+			invocation, PROVMAN_DBUS_ERR_UNEXPECTED, "");
+	} else if (g_hash_table_size(context->sessions) == 0 ||
+		   (!context->queued_clients &&
+		    !g_strcmp0(context->session_imsi, imsi))) {
+		prv_open_session(context, invocation);
+	} else {
+		PROVMAN_LOG("Queuing start request");
+		context->queued_clients = g_slist_append(
+			context->queued_clients, invocation);
+	}
+}
+
+static bool prv_session_member(provman_context *context, const gchar *name)
+{
+	provman_session *session;
+
+	if (!context->concurrent)
+		return !g_strcmp0(context->holder, name);
+
+	session = g_hash_table_lookup(context->sessions, name);
+
+	return session && !session->ending;
+}
+
+static void prv_end_session(provman_context *context,
+			    GDBusMethodInvocation *invocation)
+{
+	provman_session *session;
+
+	if (context->concurrent) {
+		session = g_hash_table_lookup(
+			context->sessions,
+			g_dbus_method_invocation_get_sender(invocation));
+		session->ending = true;
+		prv_add_commit_task(context, invocation);
+	} else {
+		g_dbus_method_invocation_return_value(invocation, NULL);
+		prv_session_ended(context);
+	}
+}
+
+static void prv_watcher_free(gpointer data)
+{
+	provman_watcher *watcher = data;
+
+	g_bus_unwatch_name(watcher->name_watch);
+	g_ptr_array_unref(watcher->prefixes);
+	g_free(watcher);
+}
+
+static bool prv_watched(provman_watcher *watcher, const gchar *key)
+{
+	unsigned int i;
+
+	for (i = 0; i < watcher->prefixes->len; ++i)
+		if (provman_utils_key_matches(
+			    g_ptr_array_index(watcher->prefixes, i), key))
+			return true;
+
+	return false;
+}
+
+static void prv_emit_to_watcher(provman_context *context, const gchar *name,
+				provman_watcher *watcher, GHashTable *changed,
+				GHashTable *removed)
+{
+	GVariantBuilder set_vb;
+	GVariantBuilder removed_vb;
+	GHashTableIter iter;
+	gpointer key;
+	gpointer value;
+	bool empty = true;
+
+	g_variant_builder_init(&set_vb, G_VARIANT_TYPE("a{ss}"));
+	g_variant_builder_init(&removed_vb, G_VARIANT_TYPE("as"));
+
+	g_hash_table_iter_init(&iter, changed);
+	while (g_hash_table_iter_next(&iter, &key, &value)) {
+		if (prv_watched(watcher, key)) {
+			g_variant_builder_add(&set_vb, "{ss}", key, value);
+			empty = false;
+		}
+	}
+
+	g_hash_table_iter_init(&iter, removed);
+	while (g_hash_table_iter_next(&iter, &key, NULL)) {
+		if (prv_watched(watcher, key)) {
+			g_variant_builder_add(&removed_vb, "s", key);
+			empty = false;
+		}
+	}
+
+	if (empty) {
+		g_variant_builder_clear(&set_vb);
+		g_variant_builder_clear(&removed_vb);
+		return;
+	}
+
+	PROVMAN_LOGF("Emitting %s to %s", PROVMAN_INTERFACE_SETTINGS_CHANGED,
+		     name);
+
+	(void) g_dbus_connection_emit_signal(
+		context->connection, name, PROVMAN_OBJECT, PROVMAN_INTERFACE,
+		PROVMAN_INTERFACE_SETTINGS_CHANGED,
+		g_variant_new("(@a{ss}@as)", g_variant_builder_end(&set_vb),
+			      g_variant_builder_end(&removed_vb)),
+		NULL);
+}
+
+/*
+ * All the changes committed by a sync are sent in a single signal.  The
+ * signal is addressed to each watcher in turn, and only contains the
+ * settings it is interested in, so that clients that are not watching
+ * are not woken up.
+ */
+
+static void prv_emit_changes(provman_context *context)
+{
+	GHashTable *changed;
+	GHashTable *removed;
+	GHashTableIter iter;
+	gpointer name;
+	gpointer watcher;
+
+	if (!plugin_manager_take_changes(context->plugin_manager, &changed,
+					 &removed))
+		return;
+
+	if (context->connection) {
+		g_hash_table_iter_init(&iter, context->watchers);
+		while (g_hash_table_iter_next(&iter, &name, &watcher))
+			prv_emit_to_watcher(context, name, watcher, changed,
+					    removed);
+	}
+
+	g_hash_table_unref(changed);
+	g_hash_table_unref(removed);
+}
+
+static void prv_watchers_changed(provman_context *context)
+{
+	bool watched = g_hash_table_size(context->watchers) > 0;
+
+	plugin_manager_track_changes(context->plugin_manager, watched);
+
+	/* A provman that is only being kept alive by its watchers may need
+	   to exit. */
+
+	if (!watched)
+		prv_schedule_tasks(context);
+}
+
+static void prv_watcher_vanished(GDBusConnection *connection,
+				 const gchar *name, gpointer user_data)
+{
+	provman_context *context = user_data;
+
+	PROVMAN_LOGF("Lost watcher %s", name);
+
+	(void) g_hash_table_remove(context->watchers, name);
+	prv_watchers_changed(context);
+}
+
+static void prv_add_watch(provman_context *context, const gchar *name,
+			  const gchar *prefix)
+{
+	provman_watcher *watcher;
+	unsigned int i;
+
+	watcher = g_hash_table_lookup(context->watchers, name);
+	if (!watcher) {
+		watcher = g_new0(provman_watcher, 1);
+		watcher->prefixes = g_ptr_array_new_with_free_func(g_free);
+		watcher->name_watch =
+			g_bus_watch_name(context->bus, name, 0, NULL,
+					 prv_watcher_vanished, context, NULL);
+		g_hash_table_insert(context->watchers, g_strdup(name),
+				    watcher);
+	}
+
+	for (i = 0; i < watcher->prefixes->len; ++i)
+		if (!strcmp(g_ptr_array_index(watcher->prefixes, i), prefix))
+			break;
+
+	if (i == watcher->prefixes->len)
+		g_ptr_array_add(watcher->prefixes, g_strdup(prefix));
+}
+
+static int prv_remove_watch(provman_context *context, const gchar *name,
+			    const gchar *prefix)
+{
+	provman_watcher *watcher;
+	unsigned int i;
+
+	watcher = g_hash_table_lookup(context->watchers, name);
+	if (!watcher)
+		return PROVMAN_ERR_NOT_FOUND;
+
+	for (i = 0; i < watcher->prefixes->len; ++i)
+		if (!strcmp(g_ptr_array_index(watcher->prefixes, i), prefix))
+			break;
+
+	if (i == watcher->prefixes->len)
+		return PROVMAN_ERR_NOT_FOUND;
+
+	g_ptr_array_remove_index_fast(watcher->prefixes, i);
+	if (watcher->prefixes->len == 0)
+		(void) g_hash_table_remove(context->watchers, name);
+
+	return PROVMAN_ERR_NONE;
+}
+
+/*
+ * Like requests for committed settings, Watch and Unwatch can be called
+ * by any client at any time.  provman does not exit while it has
+ * watchers.
+ */
+
+static bool prv_watch(provman_context *context, const gchar *method_name,
+		      GVariant *parameters, GDBusMethodInvocation *invocation)
+{
+	int err = PROVMAN_ERR_NONE;
+	gchar *prefix;
+	const gchar *sender = g_dbus_method_invocation_get_sender(invocation);
+
+	if (!g_strcmp0(method_name, PROVMAN_INTERFACE_WATCH)) {
+		g_variant_get(parameters, "(s)", &prefix);
+		g_strstrip(prefix);
+		prv_add_watch(context, sender, prefix);
+		if (context->timeout_id) {
+			(void) g_source_remove(context->timeout_id);
+			context->timeout_id = 0;
+		}
+	} else if (!g_strcmp0(method_name, PROVMAN_INTERFACE_UNWATCH)) {
+		g_variant_get(parameters, "(s)", &prefix);
+		g_strstrip(prefix);
+		err = prv_remove_watch(context, sender, prefix);
+	} else {
+		return false;
+	}
+
+	PROVMAN_LOGF("%s %s from %s returned %d", method_name, prefix,
+		     sender, err);
+
+	if (err == PROVMAN_ERR_NONE)
+		g_dbus_method_invocation_return_value(invocation, NULL);
+	else
+		g_dbus_method_invocation_return_dbus_error(
+			invocation, provman_err_to_dbus(err), "");
+
+	g_free(prefix);
+
+	prv_watchers_changed(context);
+
+	return true;
+}
+
 static void prv_provman_method_call(GDBusConnection *connection, 
 					 const gchar *sender,
 					 const gchar *object_path,
@@ -559,16 +1572,32 @@ static void prv_provman_method_call(GDBusConnection *connection,
 	gchar *value;
 	gchar *key;
 	GVariant *variant;
+	gint32 handle;
+	guint32 page_size;
+	guint64 generation;
 
 	PROVMAN_LOGF("%s called", method_name);
 
+	if (prv_get_committed(context, method_name, parameters, invocation))
+		return;
+
+	if (prv_watch(context, method_name, parameters, invocation))
+		return;
+
 	if (context->timeout_id) {
 		(void) g_source_remove(context->timeout_id);
 		context->timeout_id = 0;
 	}
 
+	if (context->trim_id) {
+		(void) g_source_remove(context->trim_id);
+		context->trim_id = 0;
+	}
+
 	if (!g_strcmp0(method_name, PROVMAN_INTERFACE_START)) {
-		if (!context->holder) {
+		if (context->concurrent) {
+			prv_start_concurrent(context, invocation);
+		} else if (!context->holder) {
 			context->holder = g_strdup(
 				g_dbus_method_invocation_get_sender(
 					invocation));
@@ -594,9 +1623,9 @@ static void prv_provman_method_call(GDBusConnection *connection,
 				"");
 		}
 	} else {
-		if (g_strcmp0(context->holder, 
-			      g_dbus_method_invocation_get_sender(
-				      invocation)) != 0) {
+		if (!prv_session_member(context,
+					g_dbus_method_invocation_get_sender(
+						invocation))) {
 			g_dbus_method_invocation_return_dbus_error(
 				invocation, PROVMAN_DBUS_ERR_UNEXPECTED,
 				"");
@@ -604,27 +1633,61 @@ static void prv_provman_method_call(GDBusConnection *connection,
 				      method_name);
 		}
 		else if (!g_strcmp0(method_name, PROVMAN_INTERFACE_END)) {
-			g_dbus_method_invocation_return_value(invocation, NULL);
-			prv_session_ended(context);
+			prv_end_session(context, invocation);
 		} else if (!g_strcmp0(method_name, 
 				      PROVMAN_INTERFACE_SET)) {
 			g_variant_get(parameters, "(&s&s)", &key, &value);
-			prv_add_set_task(context, invocation, key, value);
+			if (!prv_execute_now(context, PROVMAN_TASK_SET,
+					     invocation, key, value))
+				prv_add_set_task(context, invocation, key,
+						 value);
 		} else if (!g_strcmp0(method_name, 
 				      PROVMAN_INTERFACE_SET_ALL)) {
 			variant = g_variant_get_child_value(parameters, 0);
 			prv_add_set_all_task(context, invocation, variant);
+		} else if (!g_strcmp0(method_name,
+				      PROVMAN_INTERFACE_EXECUTE)) {
+			variant = g_variant_get_child_value(parameters, 0);
+			prv_add_execute_task(context, invocation, variant);
+		} else if (!g_strcmp0(method_name,
+				      PROVMAN_INTERFACE_IMPORT)) {
+			g_variant_get(parameters, "(h)", &handle);
+			prv_add_fd_task(context, PROVMAN_TASK_IMPORT,
+					invocation, NULL, handle);
+		} else if (!g_strcmp0(method_name,
+				      PROVMAN_INTERFACE_EXPORT)) {
+			g_variant_get(parameters, "(&sh)", &key, &handle);
+			prv_add_fd_task(context, PROVMAN_TASK_EXPORT,
+					invocation, key, handle);
 		} else if (!g_strcmp0(method_name, PROVMAN_INTERFACE_GET)) {
 			g_variant_get(parameters, "(&s)", &key);
-			prv_add_get_task(context, invocation, key);
+			if (!prv_execute_now(context, PROVMAN_TASK_GET,
+					     invocation, key, NULL))
+				prv_add_get_task(context, invocation, key);
 		} else if (!g_strcmp0(method_name, 
 				      PROVMAN_INTERFACE_GET_ALL)) {
 			g_variant_get(parameters, "(&s)", &key);
-			prv_add_get_all_task(context, invocation, key);
+			if (!prv_execute_now(context, PROVMAN_TASK_GET_ALL,
+					     invocation, key, NULL))
+				prv_add_get_all_task(context, invocation,
+						     key);
+		} else if (!g_strcmp0(method_name,
+				      PROVMAN_INTERFACE_GET_ALL_PAGED)) {
+			g_variant_get(parameters, "(&su&s)", &key, &page_size,
+				      &value);
+			prv_add_get_all_paged_task(context, invocation, key,
+						   page_size, value);
+		} else if (!g_strcmp0(method_name,
+				      PROVMAN_INTERFACE_GET_CHANGES_SINCE)) {
+			g_variant_get(parameters, "(&st)", &key, &generation);
+			prv_add_get_changes_task(context, invocation, key,
+						 generation);
 		} else if (!g_strcmp0(method_name, 
 				      PROVMAN_INTERFACE_DELETE)) {
 			g_variant_get(parameters, "(&s)", &key);
-			prv_add_delete_task(context, invocation, key);
+			if (!prv_execute_now(context, PROVMAN_TASK_DELETE,
+					     invocation, key, NULL))
+				prv_add_delete_task(context, invocation, key);
 		}
 	}
 }
@@ -734,7 +1797,52 @@ on_error:
 	return err;
 }
 
-int provman_run(GBusType bus, const char *log_path)
+static int prv_parse_options(provman_context *context, int argc, char *argv[])
+{
+	int err = PROVMAN_ERR_NONE;
+	GOptionContext *option_context;
+	GOptionEntry entries[] = {
+		{ "resident", 'r', 0, G_OPTION_ARG_NONE, &context->resident,
+		  "Keep running between management sessions", NULL },
+		{ "trim-delay", 't', 0, G_OPTION_ARG_INT, &context->trim_delay,
+		  "Seconds a resident instance waits after a session "
+		  "before releasing unused memory", "SECONDS" },
+		{ "lazy", 'l', 0, G_OPTION_ARG_NONE, &context->lazy,
+		  "Only sync in the plugins whose settings are accessed",
+		  NULL },
+		{ "concurrent", 'c', 0, G_OPTION_ARG_NONE,
+		  &context->concurrent,
+		  "Allow several clients managing the same IMSI to hold "
+		  "sessions at the same time", NULL },
+		{ "dispatch-threads", 'd', 0, G_OPTION_ARG_INT,
+		  &context->dispatch_threads,
+		  "Number of threads used to decode requests and serialize "
+		  "replies, 0 to use the main thread", "THREADS" },
+		{ NULL }
+	};
+
+	context->trim_delay = PROVMAN_TRIM_DELAY;
+	context->dispatch_threads = PROVMAN_DISPATCH_THREADS;
+
+	option_context = g_option_context_new(NULL);
+	g_option_context_add_main_entries(option_context, entries, NULL);
+
+	if (!g_option_context_parse(option_context, &argc, &argv, NULL) ||
+	    context->trim_delay < 0 || context->dispatch_threads < 0)
+		err = PROVMAN_ERR_BAD_ARGS;
+
+	/* The views of concurrent sessions are copies of the caches of all
+	   the plugins, so they must all be synced in at the start. */
+
+	if (context->concurrent)
+		context->lazy = FALSE;
+
+	g_option_context_free(option_context);
+
+	return err;
+}
+
+int provman_run(GBusType bus, const char *log_path, int argc, char *argv[])
 {
 	int err = PROVMAN_ERR_NONE;
 	provman_context context;
@@ -746,16 +1854,31 @@ int provman_run(GBusType bus, const char *log_path)
 	prv_provman_context_init(&context);
 	context.bus = bus;
 
+	err = prv_parse_options(&context, argc, argv);
+	if (err != PROVMAN_ERR_NONE) {
+		syslog(LOG_ERR, "Invalid command line options");
+		goto on_error;
+	}
+
 	sigemptyset(&mask);
 	sigaddset(&mask, SIGTERM);
 	sigaddset(&mask, SIGINT);
 
+	/* Export writes to file descriptors passed by clients, which may
+	   close them at any time. */
+
+	(void) signal(SIGPIPE, SIG_IGN);
+
 	if (sigprocmask(SIG_BLOCK, &mask, NULL) == -1) {
 		err = PROVMAN_ERR_IO;
 		goto on_error;
 	}
 
 	g_type_init();
+#if !GLIB_CHECK_VERSION(2, 32, 0)
+	if (!g_thread_supported())
+		g_thread_init(NULL);
+#endif
 
 #ifdef PROVMAN_LOGGING
 	err = provman_log_open(log_path);
@@ -763,15 +1886,22 @@ int provman_run(GBusType bus, const char *log_path)
 		goto on_error;
 #endif
 
-	PROVMAN_LOGF("============= provman starting (Bus %u)"
-		     "=============", bus);
+	PROVMAN_LOGF("============= provman starting (Bus %u%s%s%s)"
+		     "=============", bus,
+		     context.resident ? ", resident" : "",
+		     context.lazy ? ", lazy" : "",
+		     context.concurrent ? ", concurrent" : "");
 
-	err = plugin_manager_new(&context.plugin_manager);
+	err = plugin_manager_new(&context.plugin_manager, context.lazy);
 	if (err != PROVMAN_ERR_NONE)
 		goto on_error;
 	
 	PROVMAN_LOG("Plugins OK");
 
+	err = provman_dispatch_new(context.dispatch_threads, &context.dispatch);
+	if (err != PROVMAN_ERR_NONE)
+		goto on_error;
+
 	context.node_info = g_dbus_node_info_new_for_xml(g_provman_introspection, NULL);
 	if (!context.node_info) {
 		PROVMAN_LOG("Unable to create introspection data!");
@@ -787,10 +1917,15 @@ int provman_run(GBusType bus, const char *log_path)
 					  prv_bus_acquired, NULL,
 					  prv_name_lost, &context, NULL);
 
-	context.tasks = g_ptr_array_new_with_free_func(prv_free_provman_task);
+	context.tasks = provman_task_queue_new(prv_free_provman_task);
+	context.watchers = g_hash_table_new_full(g_str_hash, g_str_equal,
+						 g_free, prv_watcher_free);
+	context.sessions = g_hash_table_new_full(g_str_hash, g_str_equal,
+						 g_free, prv_session_free);
 
-	context.timeout_id = g_timeout_add(PROVMAN_TIMEOUT, prv_timeout,
-					   &context);
+	if (!context.resident)
+		context.timeout_id = g_timeout_add(PROVMAN_TIMEOUT, prv_timeout,
+						   &context);
 
 	err = prv_init_signal_handler(mask, &context);
 	if (err != PROVMAN_ERR_NONE)
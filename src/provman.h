@@ -34,6 +34,6 @@
 
 #include <gio/gio.h>
 
-int provman_run(GBusType bus, const char *log_path);
+int provman_run(GBusType bus, const char *log_path, int argc, char *argv[]);
 
 #endif
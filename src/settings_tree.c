@@ -0,0 +1,1048 @@
+/*
+ * Provman
+ *
+ * Copyright (C) 2011 Intel Corporation. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ *
+ *
+ * Mark Ryan <mark.d.ryan@intel.com>
+ *
+ */
+
+/*!
+ * @file settings_tree.c
+ *
+ * @brief contains functions for managing the settings tree
+ *
+ *****************************************************************************/
+
+#include "config.h"
+
+#include <string.h>
+#include <glib.h>
+
+#include "log.h"
+#include "utils.h"
+
+#include "settings_tree.h"
+
+/*
+ * The label of a node contains one or more key segments separated by '/'.
+ * The key associated with a node is obtained by joining the labels of
+ * all the nodes on the path from the root to that node with '/'.  Keys
+ * begin with a '/' so the first segment of most keys is empty.  Empty
+ * segments are stored like any other segment.  The root node has no
+ * label and never holds a value.
+ *
+ * The children of a node are sorted by the first segment of their
+ * labels, which is unique among siblings.  Nodes, apart from the root,
+ * that do not hold a value always have at least two children.
+ *
+ * Labels and values are interned strings, so segments that occur in many
+ * keys, e.g., "calendar" or "format", and common values are stored only
+ * once and values can be compared by pointer.
+ *
+ * A node may be shared by several trees, in which case its refcount is
+ * greater than one and it must not be modified.  Functions that modify a
+ * tree obtain private copies of the nodes they are about to change, by
+ * calling prv_writable_root and prv_writable_child, on the way down from
+ * the root.  The parent of a node that is being copied is always private
+ * to the tree being modified.
+ */
+
+typedef struct prv_node_t_ prv_node_t;
+struct prv_node_t_ {
+	unsigned int refcount;
+	const gchar *label;
+	const gchar *value;
+	GPtrArray *children;
+};
+
+struct provman_settings_tree_t_ {
+	prv_node_t *root;
+	unsigned int size;
+};
+
+/*
+ * The key being searched for is related to a child in one of the
+ * following ways.
+ */
+
+enum prv_match_t_ {
+	PRV_MATCH_NONE,    /* The key is not stored under the child */
+	PRV_MATCH_EXACT,   /* The key identifies the child */
+	PRV_MATCH_DESCEND, /* The key is located under the child */
+	PRV_MATCH_PARTIAL, /* The key ends in the middle of the child's label */
+	PRV_MATCH_SPLIT    /* The key diverges in the middle of the label */
+};
+typedef enum prv_match_t_ prv_match_t;
+
+static const gchar *prv_intern_len(const gchar *str, unsigned int len)
+{
+	gchar *copy = g_strndup(str, len);
+	const gchar *interned = provman_utils_intern(copy);
+
+	g_free(copy);
+
+	return interned;
+}
+
+/*
+ * Ownership of the references to label and value, both of which must be
+ * interned, passes to the new node.
+ */
+
+static prv_node_t *prv_node_new(const gchar *label, const gchar *value)
+{
+	prv_node_t *node = g_new0(prv_node_t, 1);
+
+	node->refcount = 1;
+	node->label = label;
+	node->value = value;
+
+	return node;
+}
+
+static void prv_node_unref(prv_node_t *node)
+{
+	unsigned int i;
+
+	if (--node->refcount > 0)
+		return;
+
+	if (node->children) {
+		for (i = 0; i < node->children->len; ++i)
+			prv_node_unref(g_ptr_array_index(node->children, i));
+		g_ptr_array_unref(node->children);
+	}
+
+	provman_utils_intern_unref((gpointer) node->value);
+	provman_utils_intern_unref((gpointer) node->label);
+	g_free(node);
+}
+
+static unsigned int prv_node_count(prv_node_t *node)
+{
+	unsigned int i;
+	unsigned int count = node->value ? 1 : 0;
+
+	if (node->children)
+		for (i = 0; i < node->children->len; ++i)
+			count += prv_node_count(g_ptr_array_index(
+							node->children, i));
+
+	return count;
+}
+
+/*
+ * Releases the caller's reference to node and returns a private copy of
+ * it.  The children of node are shared with the copy.
+ */
+
+static prv_node_t *prv_node_copy(prv_node_t *node)
+{
+	prv_node_t *copy;
+	prv_node_t *child;
+	unsigned int i;
+
+	copy = prv_node_new(provman_utils_intern_ref(node->label),
+			    provman_utils_intern_ref(node->value));
+
+	if (node->children) {
+		copy->children = g_ptr_array_sized_new(node->children->len);
+		for (i = 0; i < node->children->len; ++i) {
+			child = g_ptr_array_index(node->children, i);
+			++child->refcount;
+			g_ptr_array_add(copy->children, child);
+		}
+	}
+
+	prv_node_unref(node);
+
+	return copy;
+}
+
+static prv_node_t *prv_writable_root(provman_settings_tree_t *tree)
+{
+	if (tree->root->refcount > 1)
+		tree->root = prv_node_copy(tree->root);
+
+	return tree->root;
+}
+
+static prv_node_t *prv_writable_child(prv_node_t *node, unsigned int index)
+{
+	prv_node_t *child = g_ptr_array_index(node->children, index);
+
+	if (child->refcount > 1) {
+		child = prv_node_copy(child);
+		g_ptr_array_index(node->children, index) = child;
+	}
+
+	return child;
+}
+
+static int prv_segment_cmp(const gchar *a, const gchar *b)
+{
+	int ca;
+	int cb;
+
+	while (*a && *a != '/' && *a == *b) {
+		++a;
+		++b;
+	}
+
+	ca = *a == '/' ? 0 : (guchar) *a;
+	cb = *b == '/' ? 0 : (guchar) *b;
+
+	return ca - cb;
+}
+
+/*
+ * Returns true if a child whose label begins with the same segment as
+ * key exists.  index is set to the position of that child or to the
+ * position at which such a child should be inserted.
+ */
+
+static bool prv_find_child(prv_node_t *node, const gchar *key,
+			   unsigned int *index)
+{
+	unsigned int low = 0;
+	unsigned int high;
+	unsigned int mid;
+	int cmp;
+	prv_node_t *child;
+
+	high = node->children ? node->children->len : 0;
+
+	while (low < high) {
+		mid = low + (high - low) / 2;
+		child = g_ptr_array_index(node->children, mid);
+		cmp = prv_segment_cmp(key, child->label);
+		if (cmp == 0) {
+			*index = mid;
+			return true;
+		} else if (cmp < 0) {
+			high = mid;
+		} else {
+			low = mid + 1;
+		}
+	}
+
+	*index = low;
+
+	return false;
+}
+
+/*
+ * Compares key to the label of child.  common is set to the number of
+ * characters at the start of key that are matched by the label.  In the
+ * case of PRV_MATCH_SPLIT this is the length of the segments that are
+ * common to both.
+ */
+
+static prv_match_t prv_match(prv_node_t *child, const gchar *key,
+			     unsigned int *common)
+{
+	const gchar *label = child->label;
+	unsigned int i = 0;
+	prv_match_t retval;
+
+	while (label[i] && label[i] == key[i])
+		++i;
+
+	if (!label[i] && !key[i]) {
+		retval = PRV_MATCH_EXACT;
+	} else if (!label[i] && key[i] == '/') {
+		retval = PRV_MATCH_DESCEND;
+	} else if (!key[i] && label[i] == '/') {
+		retval = PRV_MATCH_PARTIAL;
+	} else {
+		do {
+			--i;
+		} while (i > 0 && label[i] != '/');
+		retval = label[i] == '/' ? PRV_MATCH_SPLIT : PRV_MATCH_NONE;
+	}
+
+	*common = i;
+
+	return retval;
+}
+
+/*
+ * Locates the node that is identified by key or, if there is no such
+ * node, the node whose key is the shortest key that is located under key.
+ * In the latter case partial is set to true.  The key of the returned
+ * node is prefix followed by the label of the node.
+ */
+
+static prv_node_t *prv_find(provman_settings_tree_t *tree, const gchar *key,
+			    bool *partial, const gchar **prefix_end)
+{
+	prv_node_t *node = tree->root;
+	prv_node_t *child;
+	unsigned int index;
+	unsigned int common;
+	prv_match_t match;
+	const gchar *pos = key;
+
+	for (;;) {
+		if (!prv_find_child(node, pos, &index))
+			return NULL;
+
+		child = g_ptr_array_index(node->children, index);
+		match = prv_match(child, pos, &common);
+
+		if (match == PRV_MATCH_DESCEND) {
+			node = child;
+			pos += common + 1;
+		} else if (match == PRV_MATCH_EXACT ||
+			   match == PRV_MATCH_PARTIAL) {
+			*partial = match == PRV_MATCH_PARTIAL;
+			*prefix_end = pos;
+			return child;
+		} else {
+			return NULL;
+		}
+	}
+}
+
+static void prv_insert_child(prv_node_t *node, unsigned int index,
+			     prv_node_t *child)
+{
+	if (!node->children)
+		node->children = g_ptr_array_new();
+
+	g_ptr_array_add(node->children, NULL);
+	memmove(&node->children->pdata[index + 1],
+		&node->children->pdata[index],
+		(node->children->len - index - 1) * sizeof(gpointer));
+	node->children->pdata[index] = child;
+}
+
+/*
+ * Both node and the child at index must be private to the tree being
+ * modified.
+ */
+
+static void prv_compact_child(prv_node_t *node, unsigned int index)
+{
+	prv_node_t *child = g_ptr_array_index(node->children, index);
+	prv_node_t *grandchild;
+	gchar *label;
+
+	if (child->value)
+		return;
+
+	if (!child->children || child->children->len == 0) {
+		(void) g_ptr_array_remove_index(node->children, index);
+		prv_node_unref(child);
+	} else if (child->children->len == 1) {
+		grandchild = prv_writable_child(child, 0);
+		label = g_strconcat(child->label, "/", grandchild->label, NULL);
+		provman_utils_intern_unref((gpointer) grandchild->label);
+		grandchild->label = provman_utils_intern(label);
+		g_free(label);
+		g_ptr_array_index(node->children, index) = grandchild;
+		g_ptr_array_set_size(child->children, 0);
+		prv_node_unref(child);
+	}
+}
+
+void provman_settings_tree_new(provman_settings_tree_t **tree)
+{
+	provman_settings_tree_t *new_tree = g_new0(provman_settings_tree_t, 1);
+
+	new_tree->root = prv_node_new(NULL, NULL);
+	*tree = new_tree;
+}
+
+provman_settings_tree_t *provman_settings_tree_snapshot(
+	provman_settings_tree_t *tree)
+{
+	provman_settings_tree_t *snapshot = g_new0(provman_settings_tree_t, 1);
+
+	snapshot->root = tree->root;
+	++snapshot->root->refcount;
+	snapshot->size = tree->size;
+
+	return snapshot;
+}
+
+void provman_settings_tree_delete(provman_settings_tree_t *tree)
+{
+	if (tree) {
+		prv_node_unref(tree->root);
+		g_free(tree);
+	}
+}
+
+unsigned int provman_settings_tree_size(provman_settings_tree_t *tree)
+{
+	return tree->size;
+}
+
+const gchar *provman_settings_tree_lookup(provman_settings_tree_t *tree,
+					  const gchar *key)
+{
+	prv_node_t *node;
+	bool partial;
+	const gchar *prefix_end;
+
+	node = prv_find(tree, key, &partial, &prefix_end);
+
+	return (node && !partial) ? node->value : NULL;
+}
+
+bool provman_settings_tree_insert(provman_settings_tree_t *tree,
+				  const gchar *key, const gchar *value)
+{
+	prv_node_t *node;
+	prv_node_t *child;
+	prv_node_t *split;
+	unsigned int index;
+	unsigned int common;
+	const gchar *pos = key;
+	const gchar *label;
+	const gchar *interned;
+
+	/* Nodes are not copied unless the tree is really being modified. */
+
+	interned = provman_utils_intern(value);
+	if (provman_settings_tree_lookup(tree, key) == interned) {
+		provman_utils_intern_unref((gpointer) interned);
+		return false;
+	}
+
+	node = prv_writable_root(tree);
+
+	for (;;) {
+		if (!prv_find_child(node, pos, &index)) {
+			prv_insert_child(node, index,
+					 prv_node_new(provman_utils_intern(pos),
+						      interned));
+			break;
+		}
+
+		child = prv_writable_child(node, index);
+		switch (prv_match(child, pos, &common)) {
+		case PRV_MATCH_DESCEND:
+			node = child;
+			pos += common + 1;
+			continue;
+		case PRV_MATCH_EXACT:
+			if (child->value) {
+				provman_utils_intern_unref((gpointer)
+							   child->value);
+				child->value = interned;
+				return true;
+			}
+			child->value = interned;
+			break;
+		case PRV_MATCH_PARTIAL:
+		case PRV_MATCH_SPLIT:
+
+			/* The child needs to be split at the end of the
+			   segments it has in common with key. */
+
+			split = prv_node_new(prv_intern_len(pos, common), NULL);
+			split->children = g_ptr_array_new();
+			label = provman_utils_intern(child->label + common + 1);
+			provman_utils_intern_unref((gpointer) child->label);
+			child->label = label;
+			g_ptr_array_add(split->children, child);
+			g_ptr_array_index(node->children, index) = split;
+
+			if (pos[common] == 0) {
+				split->value = interned;
+				break;
+			}
+			node = split;
+			pos += common + 1;
+			continue;
+		default:
+			break;
+		}
+		break;
+	}
+
+	++tree->size;
+
+	return true;
+}
+
+/*
+ * Removes key, or the contents of the directory key if dir is true, from
+ * the subtree rooted at node, which must be private to the tree being
+ * modified.  Any nodes that are made redundant by the removal are
+ * compacted.  The caller is responsible for compacting node itself.
+ */
+
+static unsigned int prv_remove(prv_node_t *node, const gchar *key, bool dir)
+{
+	prv_node_t *child;
+	prv_node_t *grandchild;
+	unsigned int index;
+	unsigned int common;
+	unsigned int removed = 0;
+	unsigned int i;
+
+	if (!prv_find_child(node, key, &index))
+		goto on_error;
+
+	child = g_ptr_array_index(node->children, index);
+	switch (prv_match(child, key, &common)) {
+	case PRV_MATCH_EXACT:
+		child = prv_writable_child(node, index);
+		if (dir) {
+			if (child->children) {
+				for (i = 0; i < child->children->len; ++i) {
+					grandchild = g_ptr_array_index(
+						child->children, i);
+					removed += prv_node_count(grandchild);
+					prv_node_unref(grandchild);
+				}
+				g_ptr_array_set_size(child->children, 0);
+			}
+		} else if (child->value) {
+			provman_utils_intern_unref((gpointer) child->value);
+			child->value = NULL;
+			removed = 1;
+		}
+		break;
+	case PRV_MATCH_DESCEND:
+		child = prv_writable_child(node, index);
+		removed = prv_remove(child, key + common + 1, dir);
+		break;
+	case PRV_MATCH_PARTIAL:
+		if (dir) {
+			(void) g_ptr_array_remove_index(node->children, index);
+			removed = prv_node_count(child);
+			prv_node_unref(child);
+			goto on_error;
+		}
+		break;
+	default:
+		break;
+	}
+
+	if (removed > 0)
+		prv_compact_child(node, index);
+
+on_error:
+
+	return removed;
+}
+
+bool provman_settings_tree_remove(provman_settings_tree_t *tree,
+				  const gchar *key)
+{
+	unsigned int removed = 0;
+
+	if (provman_settings_tree_lookup(tree, key)) {
+		removed = prv_remove(prv_writable_root(tree), key, false);
+		tree->size -= removed;
+	}
+
+	return removed > 0;
+}
+
+static gchar *prv_strip_dir(const gchar *key)
+{
+	unsigned int key_length = strlen(key);
+
+	if (key_length > 0 && key[key_length - 1] == '/')
+		--key_length;
+
+	return g_strndup(key, key_length);
+}
+
+unsigned int provman_settings_tree_remove_dir(provman_settings_tree_t *tree,
+					      const gchar *key)
+{
+	unsigned int removed = 0;
+	prv_node_t *node;
+	bool partial;
+	const gchar *prefix_end;
+	gchar *dir;
+
+	dir = prv_strip_dir(key);
+
+	node = prv_find(tree, dir, &partial, &prefix_end);
+	if (node && (partial || (node->children && node->children->len > 0))) {
+		removed = prv_remove(prv_writable_root(tree), dir, true);
+		tree->size -= removed;
+	}
+
+	g_free(dir);
+
+	return removed;
+}
+
+static void prv_walk(prv_node_t *node, GString *key, bool children_only,
+		     provman_settings_tree_cb_t cb, void *user_data)
+{
+	unsigned int i;
+	gsize key_length = key->len;
+	prv_node_t *child;
+
+	if (node->value && !children_only)
+		cb(key->str, node->value, user_data);
+
+	if (node->children) {
+		for (i = 0; i < node->children->len; ++i) {
+			child = g_ptr_array_index(node->children, i);
+			g_string_append_c(key, '/');
+			g_string_append(key, child->label);
+			prv_walk(child, key, false, cb, user_data);
+			g_string_truncate(key, key_length);
+		}
+	}
+}
+
+void provman_settings_tree_foreach(provman_settings_tree_t *tree,
+				   const gchar *search_key,
+				   provman_settings_tree_cb_t cb,
+				   void *user_data)
+{
+	prv_node_t *node;
+	bool partial;
+	bool children_only;
+	const gchar *prefix_end;
+	gchar *dir;
+	GString *key;
+
+	dir = prv_strip_dir(search_key);
+	children_only = strlen(dir) < strlen(search_key);
+
+	node = prv_find(tree, dir, &partial, &prefix_end);
+	if (node) {
+		key = g_string_new("");
+		g_string_append_len(key, dir, prefix_end - dir);
+		g_string_append(key, node->label);
+		prv_walk(node, key, children_only && !partial, cb, user_data);
+		g_string_free(key, TRUE);
+	}
+
+	g_free(dir);
+}
+
+int provman_settings_tree_key_cmp(const gchar *a, const gchar *b)
+{
+	int cmp;
+
+	for (;;) {
+		cmp = prv_segment_cmp(a, b);
+		if (cmp != 0)
+			return cmp;
+
+		while (*a && *a != '/') {
+			++a;
+			++b;
+		}
+
+		if (!*a || !*b)
+			return (*a ? 1 : 0) - (*b ? 1 : 0);
+
+		++a;
+		++b;
+	}
+}
+
+/*
+ * remaining counts down the number of settings that may still be visited
+ * by provman_settings_tree_foreach_after.
+ */
+
+typedef struct prv_page_t_ prv_page_t;
+struct prv_page_t_ {
+	unsigned int remaining;
+	provman_settings_tree_cb_t cb;
+	void *user_data;
+};
+
+static void prv_walk_page(prv_node_t *node, GString *key, bool children_only,
+			  prv_page_t *page);
+
+static void prv_walk_children(prv_node_t *node, GString *key,
+			      unsigned int from, prv_page_t *page)
+{
+	unsigned int i;
+	gsize key_length = key->len;
+	prv_node_t *child;
+
+	if (!node->children)
+		return;
+
+	for (i = from; i < node->children->len && page->remaining > 0; ++i) {
+		child = g_ptr_array_index(node->children, i);
+		g_string_append_c(key, '/');
+		g_string_append(key, child->label);
+		prv_walk_page(child, key, false, page);
+		g_string_truncate(key, key_length);
+	}
+}
+
+static void prv_walk_page(prv_node_t *node, GString *key, bool children_only,
+			  prv_page_t *page)
+{
+	if (node->value && !children_only && page->remaining > 0) {
+		page->cb(key->str, node->value, page->user_data);
+		--page->remaining;
+	}
+
+	prv_walk_children(node, key, 0, page);
+}
+
+/*
+ * key is a prefix of the key after which the walk starts and after points
+ * to the remainder of that key, i.e., to the segments that follow key.
+ * The children that precede the one matching the first of these segments
+ * are skipped, as are the children of that child that precede after.
+ */
+
+static void prv_walk_after(prv_node_t *node, GString *key, const gchar *after,
+			   prv_page_t *page)
+{
+	gsize key_length = key->len;
+	unsigned int index;
+	unsigned int common;
+	prv_match_t match;
+	prv_node_t *child;
+
+	if (!node->children)
+		return;
+
+	if (prv_find_child(node, after, &index)) {
+		child = g_ptr_array_index(node->children, index);
+		match = prv_match(child, after, &common);
+		g_string_append_c(key, '/');
+		g_string_append(key, child->label);
+
+		if (match == PRV_MATCH_EXACT)
+			prv_walk_page(child, key, true, page);
+		else if (match == PRV_MATCH_DESCEND)
+			prv_walk_after(child, key, after + common + 1, page);
+		else if (provman_settings_tree_key_cmp(after, child->label) < 0)
+			prv_walk_page(child, key, false, page);
+
+		g_string_truncate(key, key_length);
+		++index;
+	}
+
+	prv_walk_children(node, key, index, page);
+}
+
+unsigned int provman_settings_tree_foreach_after(
+	provman_settings_tree_t *tree, const gchar *search_key,
+	const gchar *after, unsigned int limit,
+	provman_settings_tree_cb_t cb, void *user_data)
+{
+	prv_node_t *node;
+	bool partial;
+	bool children_only;
+	const gchar *prefix_end;
+	gchar *dir;
+	GString *key;
+	prv_page_t page;
+
+	page.remaining = limit;
+	page.cb = cb;
+	page.user_data = user_data;
+
+	dir = prv_strip_dir(search_key);
+	children_only = strlen(dir) < strlen(search_key);
+
+	node = prv_find(tree, dir, &partial, &prefix_end);
+	if (!node)
+		goto on_error;
+
+	key = g_string_new("");
+	g_string_append_len(key, dir, prefix_end - dir);
+	g_string_append(key, node->label);
+	children_only = children_only && !partial;
+
+	if (!after) {
+		prv_walk_page(node, key, children_only, &page);
+	} else if (!strncmp(after, key->str, key->len) &&
+		   after[key->len] == '/') {
+		prv_walk_after(node, key, after + key->len + 1, &page);
+	} else if (!strcmp(after, key->str)) {
+		prv_walk_page(node, key, true, &page);
+	} else if (provman_settings_tree_key_cmp(after, key->str) < 0) {
+		prv_walk_page(node, key, children_only, &page);
+	}
+
+	g_string_free(key, TRUE);
+
+on_error:
+
+	g_free(dir);
+
+	return limit - page.remaining;
+}
+
+typedef struct prv_diff_t_ prv_diff_t;
+struct prv_diff_t_ {
+	provman_settings_tree_cb_t changed;
+	provman_settings_tree_cb_t removed;
+	void *user_data;
+	GHashTable *old_settings;
+};
+
+static void prv_append_label(GString *key, bool separator, const gchar *label)
+{
+	if (separator)
+		g_string_append_c(key, '/');
+	g_string_append(key, label);
+}
+
+static void prv_collect_setting(const gchar *key, const gchar *value,
+				void *user_data)
+{
+	g_hash_table_insert(user_data, g_strdup(key), (gpointer) value);
+}
+
+static void prv_compare_setting(const gchar *key, const gchar *value,
+				void *user_data)
+{
+	prv_diff_t *diff = user_data;
+	const gchar *old_value = g_hash_table_lookup(diff->old_settings, key);
+
+	if (old_value != value)
+		diff->changed(key, value, diff->user_data);
+	if (old_value)
+		(void) g_hash_table_remove(diff->old_settings, key);
+}
+
+/*
+ * Two children whose labels start with the same segment but differ
+ * afterwards, e.g., 'a/b' and 'a', hold the same part of the namespace
+ * compressed in different ways.  Their settings are compared through a
+ * hash table.  This only happens where a directory has gained or lost
+ * a branch.
+ */
+
+static void prv_diff_flat(prv_node_t *old_child, prv_node_t *new_child,
+			  GString *key, bool separator, prv_diff_t *diff)
+{
+	gsize key_length = key->len;
+	GHashTableIter iter;
+	gpointer old_key;
+	gpointer old_value;
+
+	diff->old_settings = g_hash_table_new_full(g_str_hash, g_str_equal,
+						   g_free, NULL);
+
+	prv_append_label(key, separator, old_child->label);
+	prv_walk(old_child, key, false, prv_collect_setting,
+		 diff->old_settings);
+	g_string_truncate(key, key_length);
+
+	prv_append_label(key, separator, new_child->label);
+	prv_walk(new_child, key, false, prv_compare_setting, diff);
+	g_string_truncate(key, key_length);
+
+	g_hash_table_iter_init(&iter, diff->old_settings);
+	while (g_hash_table_iter_next(&iter, &old_key, &old_value))
+		diff->removed(old_key, old_value, diff->user_data);
+
+	g_hash_table_unref(diff->old_settings);
+	diff->old_settings = NULL;
+}
+
+static void prv_diff_node(prv_node_t *old_node, prv_node_t *new_node,
+			  GString *key, prv_diff_t *diff);
+
+/*
+ * The children of both nodes are sorted by their first segment, so they
+ * can be matched by merging the two arrays.  separator is false for the
+ * children of the root, whose labels are not preceded by a '/'.
+ */
+
+static void prv_diff_children(prv_node_t *old_node, prv_node_t *new_node,
+			      GString *key, bool separator, prv_diff_t *diff)
+{
+	gsize key_length = key->len;
+	unsigned int old_len = old_node->children ? old_node->children->len : 0;
+	unsigned int new_len = new_node->children ? new_node->children->len : 0;
+	unsigned int i = 0;
+	unsigned int j = 0;
+	prv_node_t *old_child;
+	prv_node_t *new_child;
+	int cmp;
+
+	while (i < old_len || j < new_len) {
+		old_child = i < old_len ?
+			g_ptr_array_index(old_node->children, i) : NULL;
+		new_child = j < new_len ?
+			g_ptr_array_index(new_node->children, j) : NULL;
+
+		if (!new_child)
+			cmp = -1;
+		else if (!old_child)
+			cmp = 1;
+		else
+			cmp = prv_segment_cmp(old_child->label,
+					      new_child->label);
+
+		if (cmp < 0) {
+			prv_append_label(key, separator, old_child->label);
+			prv_walk(old_child, key, false, diff->removed,
+				 diff->user_data);
+			++i;
+		} else if (cmp > 0) {
+			prv_append_label(key, separator, new_child->label);
+			prv_walk(new_child, key, false, diff->changed,
+				 diff->user_data);
+			++j;
+		} else if (!strcmp(old_child->label, new_child->label)) {
+			prv_append_label(key, separator, new_child->label);
+			prv_diff_node(old_child, new_child, key, diff);
+			++i;
+			++j;
+		} else {
+			prv_diff_flat(old_child, new_child, key, separator,
+				      diff);
+			++i;
+			++j;
+		}
+
+		g_string_truncate(key, key_length);
+	}
+}
+
+static void prv_diff_node(prv_node_t *old_node, prv_node_t *new_node,
+			  GString *key, prv_diff_t *diff)
+{
+	if (old_node == new_node)
+		return;
+
+	if (new_node->value && new_node->value != old_node->value)
+		diff->changed(key->str, new_node->value, diff->user_data);
+	else if (!new_node->value && old_node->value)
+		diff->removed(key->str, old_node->value, diff->user_data);
+
+	prv_diff_children(old_node, new_node, key, true, diff);
+}
+
+void provman_settings_tree_diff(provman_settings_tree_t *old_tree,
+				provman_settings_tree_t *new_tree,
+				provman_settings_tree_cb_t changed,
+				provman_settings_tree_cb_t removed,
+				void *user_data)
+{
+	prv_diff_t diff;
+	GString *key;
+
+	if (old_tree->root == new_tree->root)
+		return;
+
+	diff.changed = changed;
+	diff.removed = removed;
+	diff.user_data = user_data;
+	diff.old_settings = NULL;
+
+	key = g_string_new("");
+	prv_diff_children(old_tree->root, new_tree->root, key, false, &diff);
+	g_string_free(key, TRUE);
+}
+
+static void prv_add_to_hash(const gchar *key, const gchar *value,
+			    void *user_data)
+{
+	g_hash_table_insert(user_data, (gpointer) provman_utils_intern(key),
+			    (gpointer) provman_utils_intern_ref(value));
+}
+
+GHashTable *provman_settings_tree_to_hash(provman_settings_tree_t *tree)
+{
+	GHashTable *settings;
+	GString *key;
+	unsigned int i;
+	prv_node_t *child;
+
+	settings = provman_utils_new_settings();
+
+	if (tree->root->children) {
+		key = g_string_new("");
+		for (i = 0; i < tree->root->children->len; ++i) {
+			child = g_ptr_array_index(tree->root->children, i);
+			g_string_assign(key, child->label);
+			prv_walk(child, key, false, prv_add_to_hash, settings);
+		}
+		g_string_free(key, TRUE);
+	}
+
+	return settings;
+}
+
+static void prv_add_segment(GHashTable *children, const gchar *label)
+{
+	const gchar *end = strchr(label, '/');
+
+	if (!end)
+		end = label + strlen(label);
+
+	g_hash_table_insert(children, g_strndup(label, end - label), NULL);
+}
+
+GHashTable *provman_settings_tree_get_children(provman_settings_tree_t *tree,
+					       const gchar *dir)
+{
+	GHashTable *children;
+	prv_node_t *node;
+	bool partial;
+	const gchar *prefix_end;
+	gchar *stripped;
+	unsigned int i;
+
+	children = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+	stripped = prv_strip_dir(dir);
+
+	node = prv_find(tree, stripped, &partial, &prefix_end);
+	if (!node)
+		goto on_error;
+
+	/* If dir ends in the middle of the node's label, the only child
+	   of dir is the segment of the label that follows it. */
+
+	if (partial)
+		prv_add_segment(children, node->label + strlen(prefix_end) + 1);
+	else if (node->children)
+		for (i = 0; i < node->children->len; ++i)
+			prv_add_segment(children, ((prv_node_t *)
+				g_ptr_array_index(node->children, i))->label);
+
+on_error:
+
+	g_free(stripped);
+
+	return children;
+}
+
+#ifdef PROVMAN_LOGGING
+static void prv_log_setting(const gchar *key, const gchar *value,
+			    void *user_data)
+{
+	PROVMAN_LOGF("%s = %s", key, value);
+}
+
+void provman_settings_tree_dump(provman_settings_tree_t *tree)
+{
+	provman_settings_tree_foreach(tree, "/", prv_log_setting, NULL);
+}
+#endif
@@ -0,0 +1,207 @@
+/*
+ * Provman
+ *
+ * Copyright (C) 2011 Intel Corporation. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ *
+ *
+ * Mark Ryan <mark.d.ryan@intel.com>
+ *
+ */
+
+/*!
+ * @file snapshot.c
+ *
+ * @brief contains functions for persisting the settings of a plugin
+ *
+ *****************************************************************************/
+
+#include "config.h"
+
+#include <string.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "error.h"
+#include "log.h"
+#include "utils.h"
+
+#include "snapshot.h"
+
+/*
+ * A snapshot file consists of a magic string followed by a sequence of
+ * nul terminated strings: the imsi, the token and then the key and value
+ * of each setting.  The files are mapped into memory when they are read.
+ * They are only ever read by the provman instance that wrote them, so
+ * no attempt is made to make them portable.
+ *
+ * The settings are copied from the mapping into a settings tree rather
+ * than served from the mapping itself.  plugin_manager's caches are
+ * settings trees.  They are snapshotted, diffed, journaled and modified
+ * in place, so a cache backed by the mapping would need a second
+ * implementation of all of these.  Loading a snapshot therefore costs
+ * one tree insertion per setting.  This is still much cheaper than a
+ * sync_in, which has to query the middleware.
+ */
+
+#define PRV_SNAPSHOT_MAGIC "PMSNAP01"
+#define PRV_SNAPSHOT_MAGIC_LEN (sizeof(PRV_SNAPSHOT_MAGIC) - 1)
+
+static int prv_make_path(const char *plugin_name, gchar **path)
+{
+	int err;
+	gchar *fname;
+
+	fname = g_strdup_printf("snapshot-%s.dat", plugin_name);
+	err = provman_utils_make_file_path(fname, path);
+	g_free(fname);
+
+	return err;
+}
+
+/*
+ * Returns the string located at *pos and advances *pos past it, or
+ * returns NULL if the string is not terminated before end.
+ */
+
+static const gchar *prv_next_string(const gchar **pos, const gchar *end)
+{
+	const gchar *str = *pos;
+	const gchar *nul;
+
+	nul = memchr(str, 0, end - str);
+	if (!nul)
+		return NULL;
+
+	*pos = nul + 1;
+
+	return str;
+}
+
+int provman_snapshot_load(const char *plugin_name, const gchar *imsi,
+			  const gchar *token, provman_settings_tree_t **tree)
+{
+	int err = PROVMAN_ERR_NONE;
+	gchar *path = NULL;
+	GMappedFile *file = NULL;
+	provman_settings_tree_t *snapshot = NULL;
+	gsize length;
+	const gchar *pos;
+	const gchar *end;
+	const gchar *key;
+	const gchar *value;
+
+	err = prv_make_path(plugin_name, &path);
+	if (err != PROVMAN_ERR_NONE)
+		goto on_error;
+
+	file = g_mapped_file_new(path, FALSE, NULL);
+	if (!file) {
+		err = PROVMAN_ERR_NOT_FOUND;
+		goto on_error;
+	}
+
+	pos = g_mapped_file_get_contents(file);
+	length = g_mapped_file_get_length(file);
+	end = pos + length;
+
+	if (length < PRV_SNAPSHOT_MAGIC_LEN ||
+	    memcmp(pos, PRV_SNAPSHOT_MAGIC, PRV_SNAPSHOT_MAGIC_LEN)) {
+		err = PROVMAN_ERR_CORRUPT;
+		goto on_error;
+	}
+	pos += PRV_SNAPSHOT_MAGIC_LEN;
+
+	key = prv_next_string(&pos, end);
+	value = prv_next_string(&pos, end);
+	if (!key || !value) {
+		err = PROVMAN_ERR_CORRUPT;
+		goto on_error;
+	}
+
+	if (strcmp(key, imsi) || strcmp(value, token)) {
+		err = PROVMAN_ERR_NOT_FOUND;
+		goto on_error;
+	}
+
+	provman_settings_tree_new(&snapshot);
+
+	while (pos < end) {
+		key = prv_next_string(&pos, end);
+		value = key ? prv_next_string(&pos, end) : NULL;
+		if (!value) {
+			err = PROVMAN_ERR_CORRUPT;
+			goto on_error;
+		}
+		(void) provman_settings_tree_insert(snapshot, key, value);
+	}
+
+	*tree = snapshot;
+	snapshot = NULL;
+
+on_error:
+
+	if (err == PROVMAN_ERR_CORRUPT)
+		PROVMAN_LOGF("Snapshot %s is corrupt", path);
+
+	provman_settings_tree_delete(snapshot);
+
+	if (file)
+		g_mapped_file_unref(file);
+
+	g_free(path);
+
+	return err;
+}
+
+static void prv_append_setting(const gchar *key, const gchar *value,
+			       void *user_data)
+{
+	GString *data = user_data;
+
+	g_string_append_len(data, key, strlen(key) + 1);
+	g_string_append_len(data, value, strlen(value) + 1);
+}
+
+void provman_snapshot_save(const char *plugin_name, const gchar *imsi,
+			   const gchar *token, provman_settings_tree_t *tree)
+{
+	gchar *path = NULL;
+	GString *data;
+
+	if (prv_make_path(plugin_name, &path) != PROVMAN_ERR_NONE)
+		return;
+
+	data = g_string_new(PRV_SNAPSHOT_MAGIC);
+	prv_append_setting(imsi, token, data);
+	provman_settings_tree_foreach(tree, "/", prv_append_setting, data);
+
+	if (!g_file_set_contents(path, data->str, data->len, NULL))
+		PROVMAN_LOGF("Unable to write snapshot %s", path);
+
+	g_string_free(data, TRUE);
+	g_free(path);
+}
+
+void provman_snapshot_remove(const char *plugin_name)
+{
+	gchar *path = NULL;
+
+	if (prv_make_path(plugin_name, &path) == PROVMAN_ERR_NONE) {
+		(void) g_unlink(path);
+		g_free(path);
+	}
+}
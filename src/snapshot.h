@@ -0,0 +1,56 @@
+/*
+ * Provman
+ *
+ * Copyright (C) 2011 Intel Corporation. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ *
+ *
+ * Mark Ryan <mark.d.ryan@intel.com>
+ *
+ */
+
+/*!
+ * @file snapshot.h
+ *
+ * @brief contains functions for persisting the settings of a plugin
+ *
+ * A snapshot file holds a copy of the settings of a single plugin
+ * together with the IMSI and the validation token that were current when
+ * the settings were obtained.  Snapshots allow provman to answer requests
+ * at start up without waiting for its plugins to read their settings from
+ * the middleware.
+ *
+ *****************************************************************************/
+
+#ifndef PROVMAN_SNAPSHOT_H
+#define PROVMAN_SNAPSHOT_H
+
+#include <glib.h>
+
+#include "settings_tree.h"
+
+/*
+ * Returns PROVMAN_ERR_NOT_FOUND if there is no snapshot for the plugin
+ * or if it was taken for a different imsi or token.
+ */
+
+int provman_snapshot_load(const char *plugin_name, const gchar *imsi,
+			  const gchar *token, provman_settings_tree_t **tree);
+void provman_snapshot_save(const char *plugin_name, const gchar *imsi,
+			   const gchar *token, provman_settings_tree_t *tree);
+void provman_snapshot_remove(const char *plugin_name);
+
+#endif
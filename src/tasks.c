@@ -31,15 +31,26 @@
 
 #include "config.h"
 
+#include <string.h>
+#include <unistd.h>
+
 #include "log.h"
 #include "error.h"
 
 #include "tasks.h"
+#include "bulk.h"
 
 #define PROV_ERROR_NOT_FOUND PROVMAN_SERVICE".Error.NotFound"
 #define PROV_ERROR_BAD_KEY PROVMAN_SERVICE".Error.BadKey"
 #define PROV_ERROR_UNKNOWN PROVMAN_SERVICE".Error.Unknown"
 
+#define PROVMAN_OP_SET "set"
+#define PROVMAN_OP_GET "get"
+#define PROVMAN_OP_GET_ALL "getall"
+#define PROVMAN_OP_DELETE "delete"
+
+#define PROVMAN_IMPORT_MAX_ERRORS 1024
+
 typedef struct provman_sync_in_context_ provman_sync_in_context;
 struct provman_sync_in_context_ {
 	provman_task_sync_in_cb finished;
@@ -52,6 +63,108 @@ struct provman_sync_out_context_ {
 	void *finished_data;
 };
 
+typedef struct provman_decode_context_ provman_decode_context;
+struct provman_decode_context_ {
+	provman_task *task;
+	provman_task_decoded_cb decoded;
+	void *decoded_data;
+};
+
+typedef struct provman_import_context_ provman_import_context;
+struct provman_import_context_ {
+	plugin_manager_t *manager;
+	GDBusMethodInvocation *invocation;
+	guint imported;
+	guint failed;
+	GVariantBuilder errors;
+	provman_task_sync_in_cb finished;
+	void *finished_data;
+};
+
+typedef struct provman_export_context_ provman_export_context;
+struct provman_export_context_ {
+	GDBusMethodInvocation *invocation;
+	gchar *key;
+	gint fd;
+	provman_settings_tree_t **trees;
+	GByteArray *buffer;
+	guint count;
+};
+
+typedef struct provman_return_all_context_ provman_return_all_context;
+struct provman_return_all_context_ {
+	GDBusMethodInvocation *invocation;
+	gchar *key;
+	provman_settings_tree_t **trees;
+	bool with_generation;
+	guint64 generation;
+};
+
+#define PROVMAN_TASK_QUEUE_INITIAL_CAPACITY 16
+
+provman_task_queue *provman_task_queue_new(GDestroyNotify free_func)
+{
+	provman_task_queue *queue = g_new0(provman_task_queue, 1);
+
+	queue->capacity = PROVMAN_TASK_QUEUE_INITIAL_CAPACITY;
+	queue->tasks = g_new(provman_task *, queue->capacity);
+	queue->free_func = free_func;
+
+	return queue;
+}
+
+void provman_task_queue_delete(provman_task_queue *queue)
+{
+	if (queue) {
+		while (queue->len > 0)
+			provman_task_queue_remove_head(queue);
+		g_free(queue->tasks);
+		g_free(queue);
+	}
+}
+
+void provman_task_queue_push(provman_task_queue *queue, provman_task *task)
+{
+	provman_task **tasks;
+	guint first;
+
+	if (queue->len == queue->capacity) {
+
+		/* Unwrap the tasks into the start of a buffer of twice the
+		   size. */
+
+		tasks = g_new(provman_task *, queue->capacity * 2);
+		first = queue->capacity - queue->head;
+		memcpy(tasks, queue->tasks + queue->head,
+		       first * sizeof(*tasks));
+		memcpy(tasks + first, queue->tasks,
+		       queue->head * sizeof(*tasks));
+		g_free(queue->tasks);
+		queue->tasks = tasks;
+		queue->head = 0;
+		queue->capacity *= 2;
+	}
+
+	queue->tasks[(queue->head + queue->len) & (queue->capacity - 1)] = task;
+	++queue->len;
+}
+
+provman_task *provman_task_queue_index(provman_task_queue *queue, guint i)
+{
+	return queue->tasks[(queue->head + i) & (queue->capacity - 1)];
+}
+
+void provman_task_queue_remove_head(provman_task_queue *queue)
+{
+	provman_task *task = queue->tasks[queue->head];
+
+	queue->head = (queue->head + 1) & (queue->capacity - 1);
+	--queue->len;
+
+	if (queue->free_func)
+		queue->free_func(task);
+}
+
 static void prv_sync_in_task_finished(int result, void *user_data)
 {
 	provman_sync_in_context *task_context = user_data;
@@ -102,6 +215,149 @@ on_error:
 	return false;
 }
 
+/*
+ * Called on a dispatch thread.  The task is not accessed by the main
+ * loop until it has been decoded.
+ */
+
+static void prv_decode_work(void *data)
+{
+	provman_decode_context *task_context = data;
+	provman_variant *variant = &task_context->task->variant;
+	GVariantIter *iter;
+	gchar *op;
+	gchar *key;
+	gchar *value;
+
+	variant->settings = g_ptr_array_new_with_free_func(g_free);
+
+	iter = g_variant_iter_new(variant->variant);
+	if (task_context->task->type == PROVMAN_TASK_EXECUTE) {
+		while (g_variant_iter_next(iter, "(sss)", &op, &key, &value)) {
+			g_ptr_array_add(variant->settings, op);
+			g_ptr_array_add(variant->settings, g_strstrip(key));
+			g_ptr_array_add(variant->settings, value);
+		}
+	} else {
+		while (g_variant_iter_next(iter, "{ss}", &key, &value)) {
+			g_ptr_array_add(variant->settings, g_strstrip(key));
+			g_ptr_array_add(variant->settings, value);
+		}
+	}
+	g_variant_iter_free(iter);
+
+	g_variant_unref(variant->variant);
+	variant->variant = NULL;
+}
+
+static void prv_decode_done(void *data)
+{
+	provman_decode_context *task_context = data;
+
+	task_context->task->decoding = false;
+	task_context->decoded(task_context->decoded_data);
+
+	g_free(task_context);
+}
+
+void provman_task_decode(provman_dispatch_t *dispatch, provman_task *task,
+			 provman_task_decoded_cb decoded, void *decoded_data)
+{
+	provman_decode_context *task_context =
+		g_new0(provman_decode_context, 1);
+
+	task_context->task = task;
+	task_context->decoded = decoded;
+	task_context->decoded_data = decoded_data;
+
+	task->decoding = true;
+	provman_dispatch_push(dispatch, prv_decode_work, prv_decode_done,
+			      task_context);
+}
+
+/*
+ * The keys are borrowed from the task, which outlives the array.
+ */
+
+static GPtrArray *prv_task_keys(provman_task *task)
+{
+	GPtrArray *keys = g_ptr_array_new();
+	unsigned int i;
+
+	switch (task->type) {
+	case PROVMAN_TASK_SET:
+		g_ptr_array_add(keys, task->key_value.key);
+		break;
+	case PROVMAN_TASK_GET:
+	case PROVMAN_TASK_GET_ALL:
+	case PROVMAN_TASK_DELETE:
+		g_ptr_array_add(keys, task->key.key);
+		break;
+	case PROVMAN_TASK_GET_ALL_PAGED:
+		g_ptr_array_add(keys, task->page.key);
+		break;
+	case PROVMAN_TASK_GET_CHANGES:
+		g_ptr_array_add(keys, task->changes.key);
+		break;
+	case PROVMAN_TASK_EXPORT:
+		g_ptr_array_add(keys, task->fd.key);
+		break;
+	case PROVMAN_TASK_IMPORT:
+
+		/* We don't know which keys will be imported. */
+
+		g_ptr_array_add(keys, (gpointer) "/");
+		break;
+	case PROVMAN_TASK_SET_ALL:
+		for (i = 0; i < task->variant.settings->len; i += 2)
+			g_ptr_array_add(keys, g_ptr_array_index(
+						task->variant.settings, i));
+		break;
+	case PROVMAN_TASK_EXECUTE:
+		for (i = 1; i < task->variant.settings->len; i += 3)
+			g_ptr_array_add(keys, g_ptr_array_index(
+						task->variant.settings, i));
+		break;
+	default:
+		break;
+	}
+
+	g_ptr_array_add(keys, NULL);
+
+	return keys;
+}
+
+bool provman_task_materialize(plugin_manager_t *plugin_manager,
+			      provman_task *task,
+			      provman_task_sync_in_cb finished,
+			      void *finished_data)
+{
+	int err = PROVMAN_ERR_NONE;
+	GPtrArray *keys;
+	provman_sync_in_context *task_context =
+		g_new0(provman_sync_in_context, 1);
+
+	task_context->finished = finished;
+	task_context->finished_data = finished_data;
+
+	keys = prv_task_keys(task);
+	err = plugin_manager_materialize(plugin_manager,
+					 (const gchar *const *) keys->pdata,
+					 prv_sync_in_task_finished,
+					 task_context);
+	g_ptr_array_unref(keys);
+	if (err != PROVMAN_ERR_NONE)
+		goto on_error;
+
+	return true;
+
+on_error:
+
+	g_free(task_context);
+
+	return false;
+}
+
 bool provman_task_async_cancel(plugin_manager_t *plugin_manager)
 {
 	return plugin_manager_cancel(plugin_manager);
@@ -166,8 +422,8 @@ void provman_task_set_all(plugin_manager_t *manager, provman_task *task)
 
 	PROVMAN_LOG("Processing Set All task");
 
-	err = plugin_manager_set_all(manager, task->variant.variant,
-		&array);
+	err = plugin_manager_set_all(manager, task->variant.settings,
+				     &array);
 	if (err != PROVMAN_ERR_NONE)
 		goto on_error;
 
@@ -211,20 +467,74 @@ on_error:
 	task->invocation = NULL;
 }
 
-void provman_task_get_all(plugin_manager_t *manager, provman_task *task)
+/*
+ * Called on a dispatch thread.  The snapshot is only read here.  It is
+ * freed on the main loop thread, which owns the reference counts of the
+ * settings trees.
+ */
+
+static void prv_return_all_work(void *data)
 {
-	int err = PROVMAN_ERR_NONE;
+	provman_return_all_context *task_context = data;
 	GVariant *array;
 
+	array = plugin_manager_snapshot_to_variant(task_context->trees,
+						   task_context->key);
+	if (task_context->with_generation)
+		g_dbus_method_invocation_return_value(
+			task_context->invocation,
+			g_variant_new("(@a{ss}t)", array,
+				      task_context->generation));
+	else
+		g_dbus_method_invocation_return_value(
+			task_context->invocation,
+			g_variant_new("(@a{ss})", array));
+}
+
+static void prv_return_all_done(void *data)
+{
+	provman_return_all_context *task_context = data;
+
+	plugin_manager_free_snapshot(task_context->trees);
+	g_free(task_context->key);
+	g_free(task_context);
+}
+
+void provman_task_return_all(provman_dispatch_t *dispatch,
+			     GDBusMethodInvocation *invocation,
+			     const gchar *key, provman_settings_tree_t **trees,
+			     const guint64 *generation)
+{
+	provman_return_all_context *task_context =
+		g_new0(provman_return_all_context, 1);
+
+	task_context->invocation = invocation;
+	task_context->key = g_strdup(key);
+	task_context->trees = trees;
+	if (generation) {
+		task_context->with_generation = true;
+		task_context->generation = *generation;
+	}
+
+	provman_dispatch_push(dispatch, prv_return_all_work,
+			      prv_return_all_done, task_context);
+}
+
+void provman_task_get_all(plugin_manager_t *manager,
+			  provman_dispatch_t *dispatch, provman_task *task)
+{
+	int err = PROVMAN_ERR_NONE;
+	provman_settings_tree_t **trees;
+
 	PROVMAN_LOGF("Processing Get All task on key %s",
 		task->key.key);
 
-	if (plugin_manager_get_all(manager, task->key.key, &array) !=
-	    PROVMAN_ERR_NONE)
+	err = plugin_manager_snapshot(manager, &trees);
+	if (err != PROVMAN_ERR_NONE)
 		goto on_error;
 
-	g_dbus_method_invocation_return_value(task->invocation,
-					      g_variant_new("(@a{ss})",array));
+	provman_task_return_all(dispatch, task->invocation, task->key.key,
+				trees, NULL);
 
 	task->invocation = NULL;
 	return;
@@ -237,6 +547,94 @@ on_error:
 	task->invocation = NULL;
 }
 
+void provman_task_get_all_paged(plugin_manager_t *manager,
+				provman_task *task)
+{
+	int err = PROVMAN_ERR_NONE;
+	GVariant *settings;
+	gchar *cursor;
+
+	PROVMAN_LOGF("Processing Get All Paged task on key %s from %s",
+		     task->page.key, task->page.cursor);
+
+	err = plugin_manager_get_page(manager, task->page.key,
+				      task->page.cursor, task->page.page_size,
+				      &settings, &cursor);
+	if (err != PROVMAN_ERR_NONE)
+		goto on_error;
+
+	g_dbus_method_invocation_return_value(
+		task->invocation, g_variant_new("(@a{ss}s)", settings, cursor));
+
+	g_free(cursor);
+
+	task->invocation = NULL;
+	return;
+
+on_error:
+
+	g_dbus_method_invocation_return_dbus_error(
+		task->invocation, provman_err_to_dbus(err), "");
+
+	task->invocation = NULL;
+}
+
+/*
+ * A session that has not executed any tasks has no view and nothing to
+ * commit.
+ */
+
+void provman_task_commit(plugin_manager_t *manager, provman_task *task,
+			 plugin_manager_view_t *view)
+{
+	int err = PROVMAN_ERR_NONE;
+
+	PROVMAN_LOG("Processing Commit task");
+
+	if (view)
+		err = plugin_manager_view_commit(manager, view);
+
+	if (err == PROVMAN_ERR_NONE)
+		g_dbus_method_invocation_return_value(task->invocation, NULL);
+	else
+		g_dbus_method_invocation_return_dbus_error(
+			task->invocation, provman_err_to_dbus(err), "");
+
+	task->invocation = NULL;
+}
+
+void provman_task_get_changes(plugin_manager_t *manager, provman_task *task)
+{
+	int err = PROVMAN_ERR_NONE;
+	GVariant *set;
+	GVariant *removed;
+	guint64 generation;
+
+	PROVMAN_LOGF("Processing Get Changes Since task on key %s from %"
+		     G_GUINT64_FORMAT, task->changes.key,
+		     task->changes.generation);
+
+	err = plugin_manager_get_changes(manager, task->changes.key,
+					 task->changes.generation, &set,
+					 &removed, &generation);
+	if (err != PROVMAN_ERR_NONE)
+		goto on_error;
+
+	g_dbus_method_invocation_return_value(
+		task->invocation, g_variant_new("(@a{ss}@ast)", set, removed,
+						generation));
+
+	task->invocation = NULL;
+	return;
+
+on_error:
+
+	g_dbus_method_invocation_return_dbus_error(
+		task->invocation, provman_err_to_dbus(err), "");
+
+	task->invocation = NULL;
+}
+
 void provman_task_delete(plugin_manager_t *manager, provman_task *task)
 {
 	int err = PROVMAN_ERR_NONE;
@@ -257,3 +655,249 @@ on_error:
 
 	task->invocation = NULL;
 }
+
+static int prv_execute_op(plugin_manager_t *manager, const gchar *op,
+			  const gchar *key, const gchar *value,
+			  GVariant **result)
+{
+	int err = PROVMAN_ERR_NONE;
+	gchar *got = NULL;
+	provman_settings_tree_t **trees;
+	GVariantBuilder vb;
+
+	if (!g_strcmp0(op, PROVMAN_OP_SET)) {
+		err = plugin_manager_set(manager, key, value);
+	} else if (!g_strcmp0(op, PROVMAN_OP_GET)) {
+		err = plugin_manager_get(manager, key, &got);
+		if (err == PROVMAN_ERR_NONE) {
+			g_variant_builder_init(&vb, G_VARIANT_TYPE("a{ss}"));
+			g_variant_builder_add(&vb, "{ss}", key, got);
+			*result = g_variant_builder_end(&vb);
+			g_free(got);
+		}
+	} else if (!g_strcmp0(op, PROVMAN_OP_GET_ALL)) {
+		err = plugin_manager_snapshot(manager, &trees);
+		if (err == PROVMAN_ERR_NONE) {
+			*result = plugin_manager_snapshot_to_variant(trees, key);
+			plugin_manager_free_snapshot(trees);
+		}
+	} else if (!g_strcmp0(op, PROVMAN_OP_DELETE)) {
+		err = plugin_manager_remove(manager, key);
+	} else {
+		err = PROVMAN_ERR_BAD_ARGS;
+	}
+
+	return err;
+}
+
+void provman_task_execute(plugin_manager_t *manager, provman_task *task)
+{
+	GPtrArray *ops = task->variant.settings;
+	GVariantBuilder vb;
+	GVariant *result;
+	unsigned int i;
+	const gchar *op;
+	const gchar *key;
+	int err;
+
+	PROVMAN_LOGF("Processing Execute task with %u operations",
+		     ops->len / 3);
+
+	g_variant_builder_init(&vb, G_VARIANT_TYPE("a(sa{ss})"));
+
+	for (i = 0; i + 2 < ops->len; i += 3) {
+		op = g_ptr_array_index(ops, i);
+		key = g_ptr_array_index(ops, i + 1);
+		result = NULL;
+
+		err = prv_execute_op(manager, op, key,
+				     g_ptr_array_index(ops, i + 2), &result);
+		PROVMAN_LOGF("%s %s returned %d", op, key, err);
+
+		if (!result)
+			result = g_variant_new_array(G_VARIANT_TYPE("{ss}"),
+						     NULL, 0);
+		g_variant_builder_add(&vb, "(s@a{ss})",
+				      provman_err_to_dbus(err), result);
+	}
+
+	g_dbus_method_invocation_return_value(
+		task->invocation, g_variant_new("(@a(sa{ss}))",
+						g_variant_builder_end(&vb)));
+
+	task->invocation = NULL;
+}
+
+static void prv_import_setting(const gchar *key, const gchar *value,
+			       void *user_data)
+{
+	provman_import_context *task_context = user_data;
+
+	if (plugin_manager_set(task_context->manager, key, value) ==
+	    PROVMAN_ERR_NONE) {
+		++task_context->imported;
+	} else {
+		PROVMAN_LOGF("Unable to import %s = %s", key, value);
+		if (task_context->failed < PROVMAN_IMPORT_MAX_ERRORS)
+			g_variant_builder_add(&task_context->errors, "s", key);
+		++task_context->failed;
+	}
+}
+
+static void prv_import_finished(int result, void *user_data)
+{
+	provman_import_context *task_context = user_data;
+
+	PROVMAN_LOGF("Imported %u settings, %u failed, error %d",
+		     task_context->imported, task_context->failed, result);
+
+	if (result == PROVMAN_ERR_NONE)
+		g_dbus_method_invocation_return_value(
+			task_context->invocation,
+			g_variant_new("(uas)", task_context->imported,
+				      &task_context->errors));
+	else
+		g_dbus_method_invocation_return_dbus_error(
+			task_context->invocation, provman_err_to_dbus(result),
+			"");
+
+	g_variant_builder_clear(&task_context->errors);
+
+	task_context->finished(result, task_context->finished_data);
+
+	g_free(task_context);
+}
+
+bool provman_task_import(plugin_manager_t *manager, provman_task *task,
+			 provman_task_sync_in_cb finished,
+			 void *finished_data)
+{
+	int err = PROVMAN_ERR_NONE;
+	provman_import_context *task_context =
+		g_new0(provman_import_context, 1);
+
+	PROVMAN_LOG("Processing Import task");
+
+	task_context->manager = manager;
+	task_context->invocation = task->invocation;
+	task_context->finished = finished;
+	task_context->finished_data = finished_data;
+	g_variant_builder_init(&task_context->errors, G_VARIANT_TYPE("as"));
+
+	err = provman_bulk_import(task->fd.fd, prv_import_setting,
+				  prv_import_finished, task_context);
+	task->fd.fd = -1;
+	if (err != PROVMAN_ERR_NONE)
+		goto on_error;
+
+	task->invocation = NULL;
+
+	return true;
+
+on_error:
+
+	g_variant_builder_clear(&task_context->errors);
+	g_free(task_context);
+
+	g_dbus_method_invocation_return_dbus_error(
+		task->invocation, provman_err_to_dbus(err), "");
+
+	task->invocation = NULL;
+
+	return false;
+}
+
+static void prv_export_context_free(provman_export_context *task_context)
+{
+	if (task_context->fd != -1)
+		(void) close(task_context->fd);
+	if (task_context->buffer)
+		g_byte_array_unref(task_context->buffer);
+	g_free(task_context->key);
+	g_free(task_context);
+}
+
+/* Called on a dispatch thread. */
+
+static void prv_export_work(void *data)
+{
+	provman_export_context *task_context = data;
+
+	task_context->buffer = provman_bulk_encode(task_context->trees,
+						   task_context->key,
+						   &task_context->count);
+}
+
+static void prv_export_finished(int result, void *user_data)
+{
+	provman_export_context *task_context = user_data;
+
+	if (result == PROVMAN_ERR_NONE)
+		g_dbus_method_invocation_return_value(
+			task_context->invocation,
+			g_variant_new("(u)", task_context->count));
+	else
+		g_dbus_method_invocation_return_dbus_error(
+			task_context->invocation, provman_err_to_dbus(result),
+			"");
+
+	prv_export_context_free(task_context);
+}
+
+/*
+ * The settings are written to the client's file descriptor from the
+ * main loop rather than from the dispatch thread, so that a client that
+ * does not read them cannot hold on to a dispatch thread.
+ */
+
+static void prv_export_done(void *data)
+{
+	int err;
+	provman_export_context *task_context = data;
+
+	plugin_manager_free_snapshot(task_context->trees);
+	task_context->trees = NULL;
+
+	err = provman_bulk_export(task_context->fd, task_context->buffer,
+				  prv_export_finished, task_context);
+	task_context->fd = -1;
+	task_context->buffer = NULL;
+
+	if (err != PROVMAN_ERR_NONE)
+		prv_export_finished(err, task_context);
+}
+
+void provman_task_export(plugin_manager_t *manager,
+			 provman_dispatch_t *dispatch, provman_task *task)
+{
+	int err = PROVMAN_ERR_NONE;
+	provman_settings_tree_t **trees;
+	provman_export_context *task_context;
+
+	PROVMAN_LOGF("Processing Export task on key %s", task->fd.key);
+
+	err = plugin_manager_snapshot(manager, &trees);
+	if (err != PROVMAN_ERR_NONE)
+		goto on_error;
+
+	task_context = g_new0(provman_export_context, 1);
+	task_context->invocation = task->invocation;
+	task_context->key = g_strdup(task->fd.key);
+	task_context->fd = task->fd.fd;
+	task_context->trees = trees;
+
+	task->fd.fd = -1;
+	task->invocation = NULL;
+
+	provman_dispatch_push(dispatch, prv_export_work, prv_export_done,
+			      task_context);
+
+	return;
+
+on_error:
+
+	g_dbus_method_invocation_return_dbus_error(
+		task->invocation, provman_err_to_dbus(err), "");
+
+	task->invocation = NULL;
+}
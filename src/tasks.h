@@ -36,6 +36,7 @@
 #include <gio/gio.h>
 
 #include "plugin_manager.h"
+#include "dispatch.h"
 
 enum provman_task_type_ {
 	PROVMAN_TASK_SYNC_IN,
@@ -44,7 +45,13 @@ enum provman_task_type_ {
 	PROVMAN_TASK_GET,
 	PROVMAN_TASK_SET_ALL,
 	PROVMAN_TASK_GET_ALL,
-	PROVMAN_TASK_DELETE	
+	PROVMAN_TASK_GET_ALL_PAGED,
+	PROVMAN_TASK_GET_CHANGES,
+	PROVMAN_TASK_DELETE,
+	PROVMAN_TASK_EXECUTE,
+	PROVMAN_TASK_IMPORT,
+	PROVMAN_TASK_EXPORT,
+	PROVMAN_TASK_COMMIT
 };
 
 typedef enum provman_task_type_ provman_task_type;
@@ -60,9 +67,36 @@ struct provman_key_value_ {
 	gchar *value;
 };
 
+/*
+ * The parameters of SetAll and Execute are decoded on a dispatch thread.
+ * For SetAll, settings contains the decoded keys and values, stored
+ * alternately.  For Execute, it contains the name, key and value of each
+ * operation.
+ */
+
 typedef struct provman_variant_ provman_variant;
 struct provman_variant_ {
 	GVariant *variant;
+	GPtrArray *settings;
+};
+
+typedef struct provman_fd_ provman_fd;
+struct provman_fd_ {
+	gchar *key;
+	gint fd;
+};
+
+typedef struct provman_page_ provman_page;
+struct provman_page_ {
+	gchar *key;
+	gchar *cursor;
+	guint32 page_size;
+};
+
+typedef struct provman_changes_ provman_changes;
+struct provman_changes_ {
+	gchar *key;
+	guint64 generation;
 };
 
 typedef struct provman_task_ provman_task;
@@ -70,29 +104,78 @@ struct provman_task_ {
 	provman_task_type type;
 	GDBusMethodInvocation *invocation;
 	gchar *imsi;
+	bool decoding;
 	union {
 		provman_key key;
 		provman_key_value key_value;
 		provman_variant variant;
+		provman_fd fd;
+		provman_page page;
+		provman_changes changes;
 	};
 };
 
+/*
+ * Tasks are queued in a ring buffer whose capacity is always a power of
+ * two.  Tasks can be added to the tail and removed from the head in
+ * constant time.
+ */
+
+typedef struct provman_task_queue_ provman_task_queue;
+struct provman_task_queue_ {
+	provman_task **tasks;
+	guint capacity;
+	guint head;
+	guint len;
+	GDestroyNotify free_func;
+};
+
+provman_task_queue *provman_task_queue_new(GDestroyNotify free_func);
+void provman_task_queue_delete(provman_task_queue *queue);
+void provman_task_queue_push(provman_task_queue *queue, provman_task *task);
+provman_task *provman_task_queue_index(provman_task_queue *queue, guint i);
+void provman_task_queue_remove_head(provman_task_queue *queue);
+
 typedef void (*provman_task_sync_in_cb)(
 	int result, void *user_data);
 
 typedef void (*provman_task_sync_out_cb)(
 	int result, void *user_data);
 
+typedef void (*provman_task_decoded_cb)(void *user_data);
+
 bool provman_task_sync_in(plugin_manager_t *plugin_manager,
 			       provman_task *task,
 			       provman_task_sync_in_cb finished,
 			       void *finished_data);
+void provman_task_decode(provman_dispatch_t *dispatch, provman_task *task,
+			 provman_task_decoded_cb decoded, void *decoded_data);
+bool provman_task_materialize(plugin_manager_t *plugin_manager,
+			      provman_task *task,
+			      provman_task_sync_in_cb finished,
+			      void *finished_data);
 void provman_task_set(plugin_manager_t *manager, provman_task *task);
 void provman_task_set_all(plugin_manager_t *manager, provman_task *task);
-void provman_task_get_all(plugin_manager_t *manager, provman_task *task);
+void provman_task_get_all(plugin_manager_t *manager,
+			  provman_dispatch_t *dispatch, provman_task *task);
+void provman_task_return_all(provman_dispatch_t *dispatch,
+			     GDBusMethodInvocation *invocation,
+			     const gchar *key, provman_settings_tree_t **trees,
+			     const guint64 *generation);
+void provman_task_get_all_paged(plugin_manager_t *manager,
+				provman_task *task);
+void provman_task_get_changes(plugin_manager_t *manager, provman_task *task);
 void provman_task_get(plugin_manager_t *manager, provman_task *task);
 void provman_task_delete(plugin_manager_t *manager,
 			      provman_task *task);
+void provman_task_execute(plugin_manager_t *manager, provman_task *task);
+bool provman_task_import(plugin_manager_t *manager, provman_task *task,
+			 provman_task_sync_in_cb finished,
+			 void *finished_data);
+void provman_task_export(plugin_manager_t *manager,
+			 provman_dispatch_t *dispatch, provman_task *task);
+void provman_task_commit(plugin_manager_t *manager, provman_task *task,
+			 plugin_manager_view_t *view);
 
 bool provman_task_sync_out(plugin_manager_t *plugin_manager,
 				provman_task *task,
@@ -69,6 +69,17 @@ on_error:
 	return err;
 }
 
+gboolean provman_utils_key_matches(const char *search_key, const char *key)
+{
+	size_t len = strlen(search_key);
+
+	if (strncmp(search_key, key, len))
+		return FALSE;
+
+	return key[len] == 0 || key[len] == '/' ||
+		(len > 0 && search_key[len - 1] == '/');
+}
+
 int provman_utils_make_file_path(const char* fname, gchar **path)
 {
 	int err = PROVMAN_ERR_NONE;
@@ -101,6 +112,106 @@ on_error:
 	return err;
 }
 
+/*
+ * Interned strings are allocated in the same block as their reference
+ * count.  The pool is a set of the strings themselves.  The block
+ * containing a string is located by subtracting the offset of str.
+ * The pool is not locked.  It must only be modified from the main loop
+ * thread.  Dispatch threads may read interned strings but must not
+ * intern, ref or unref them.
+ */
+
+typedef struct prv_intern_t_ prv_intern_t;
+struct prv_intern_t_ {
+	unsigned int refcount;
+	gchar str[];
+};
+
+static GHashTable *g_intern_pool;
+#ifdef PROVMAN_LOGGING
+static unsigned int g_intern_refs;
+#endif
+
+static prv_intern_t *prv_intern_from_str(const gchar *str)
+{
+	return (prv_intern_t *) (void *)
+		(str - G_STRUCT_OFFSET(prv_intern_t, str));
+}
+
+const gchar *provman_utils_intern(const gchar *str)
+{
+	prv_intern_t *entry;
+	gchar *interned;
+	gsize len;
+
+	if (!str)
+		return NULL;
+
+	if (!g_intern_pool)
+		g_intern_pool = g_hash_table_new(g_str_hash, g_str_equal);
+
+	interned = g_hash_table_lookup(g_intern_pool, str);
+	if (interned) {
+		entry = prv_intern_from_str(interned);
+	} else {
+		len = strlen(str);
+		entry = g_malloc(sizeof(*entry) + len + 1);
+		entry->refcount = 0;
+		memcpy(entry->str, str, len + 1);
+		g_hash_table_insert(g_intern_pool, entry->str, entry->str);
+	}
+
+	++entry->refcount;
+#ifdef PROVMAN_LOGGING
+	++g_intern_refs;
+#endif
+
+	return entry->str;
+}
+
+const gchar *provman_utils_intern_ref(const gchar *str)
+{
+	if (str) {
+		++prv_intern_from_str(str)->refcount;
+#ifdef PROVMAN_LOGGING
+		++g_intern_refs;
+#endif
+	}
+
+	return str;
+}
+
+void provman_utils_intern_unref(gpointer str)
+{
+	prv_intern_t *entry;
+
+	if (!str)
+		return;
+
+	entry = prv_intern_from_str(str);
+#ifdef PROVMAN_LOGGING
+	--g_intern_refs;
+#endif
+	if (--entry->refcount == 0) {
+		(void) g_hash_table_remove(g_intern_pool, entry->str);
+		g_free(entry);
+	}
+}
+
+GHashTable *provman_utils_new_settings(void)
+{
+	return g_hash_table_new_full(g_str_hash, g_str_equal,
+				     provman_utils_intern_unref,
+				     provman_utils_intern_unref);
+}
+
+void provman_utils_settings_insert(GHashTable *settings, const gchar *key,
+				   const gchar *value)
+{
+	g_hash_table_insert(settings, (gpointer) provman_utils_intern(key),
+			    (gpointer) provman_utils_intern(value));
+}
+
 GHashTable* provman_utils_dup_settings(GHashTable *settings)
 {
 	GHashTable *copy;
@@ -108,13 +219,11 @@ GHashTable* provman_utils_dup_settings(GHashTable *settings)
 	gpointer key;
 	gpointer value;
 
-	copy = g_hash_table_new_full(g_str_hash, g_str_equal,
-				     g_free, g_free);
+	copy = provman_utils_new_settings();
 
 	g_hash_table_iter_init(&iter, settings);
 	while (g_hash_table_iter_next(&iter, &key, &value))
-		g_hash_table_insert(copy, g_strdup((gchar*) key), 
-				    g_strdup((gchar*) value));
+		provman_utils_settings_insert(copy, key, value);
 
 	return copy;
 }
@@ -175,4 +284,11 @@ void provman_utils_dump_hash_table(GHashTable* hash_table)
 	}
 	g_list_free(list);
 }
+
+void provman_utils_log_intern_stats(void)
+{
+	PROVMAN_LOGF("Intern pool: %u strings, %u references",
+		     g_intern_pool ? g_hash_table_size(g_intern_pool) : 0,
+		     g_intern_refs);
+}
 #endif